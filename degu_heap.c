@@ -0,0 +1,351 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <zephyr.h>
+#include <init.h>
+#include <stdint.h>
+#include <string.h>
+#include <logging/log.h>
+#ifdef CONFIG_DEGU_HEAP_TLS
+#include "mbedtls/platform.h"
+#endif
+#include "degu_heap.h"
+
+LOG_MODULE_REGISTER(degu_heap);
+
+/*
+ * One pool shared by the MicroPython heap and mbedTLS, instead of a
+ * static area for each. The first DEGU_MPY_HEAP_MIN bytes are the VM's,
+ * so that a script always starts at once. When the VM starts its arena
+ * is extended over the free memory which follows, as far as mbedTLS
+ * does not need it, and shrunk back when the VM stops. mbedTLS
+ * allocates from the top of the pool, last fit, to keep the memory
+ * after the VM's part free; free neighbours are merged while searching.
+ */
+#define CHUNK_FREE	0xff
+#define CHUNK_MIN	32
+
+#define MPY_BASE	ROUND_UP(CONFIG_DEGU_MPY_HEAP_MIN, 8)
+
+struct chunk {
+	u32_t size;	/* including this header, multiple of 8 */
+	u32_t owner;	/* enum degu_heap_owner or CHUNK_FREE */
+};
+
+static u8_t pool[ROUND_DOWN(CONFIG_DEGU_HEAP_SIZE, 8)] __aligned(8);
+static struct degu_heap_stats stats[DEGU_HEAP_OWNERS];
+static K_MUTEX_DEFINE(heap_lock);
+
+BUILD_ASSERT_MSG(MPY_BASE + CHUNK_MIN <= sizeof(pool),
+		 "DEGU_MPY_HEAP_MIN leaves nothing of DEGU_HEAP_SIZE");
+
+/* the chunks start after the VM's arena */
+static struct chunk *chunks = (struct chunk *)(pool + MPY_BASE);
+static size_t mpy_ext;
+static bool mpy_taken;
+
+/*
+ * The largest TLS use seen, kept across warm reboots such as those of
+ * an update. Until a session has been measured, DEGU_HEAP_TLS_RESERVE
+ * is kept free for mbedTLS.
+ */
+#define TLS_PEAK_MAGIC	0x544c5350
+static __noinit u32_t tls_peak_magic;
+static __noinit u32_t tls_peak;
+
+static inline struct chunk *chunk_first(void)
+{
+	return chunks;
+}
+
+static inline struct chunk *chunk_next(struct chunk *c)
+{
+	return (struct chunk *)((u8_t *)c + c->size);
+}
+
+static inline bool chunk_valid(struct chunk *c)
+{
+	return (u8_t *)c < pool + sizeof(pool);
+}
+
+static void chunk_merge(struct chunk *c)
+{
+	struct chunk *next;
+
+	for (next = chunk_next(c); chunk_valid(next) &&
+	     next->owner == CHUNK_FREE; next = chunk_next(c)) {
+		c->size += next->size;
+	}
+}
+
+static void stats_add(enum degu_heap_owner owner, u32_t size)
+{
+	stats[owner].allocs++;
+	stats[owner].used += size;
+	if (stats[owner].used > stats[owner].peak) {
+		stats[owner].peak = stats[owner].used;
+	}
+	if (owner == DEGU_HEAP_TLS && stats[owner].peak > tls_peak) {
+		tls_peak = stats[owner].peak;
+		tls_peak_magic = TLS_PEAK_MAGIC;
+	}
+}
+
+/* the free memory mbedTLS may still need, beyond what it holds */
+static size_t tls_headroom(void)
+{
+	size_t need = CONFIG_DEGU_HEAP_TLS_RESERVE;
+
+	if (tls_peak_magic == TLS_PEAK_MAGIC && tls_peak > 0) {
+		need = tls_peak + tls_peak / 4;
+	}
+	return need > stats[DEGU_HEAP_TLS].used ?
+		need - stats[DEGU_HEAP_TLS].used : 0;
+}
+
+static void *chunk_alloc(enum degu_heap_owner owner, size_t size)
+{
+	struct chunk *c, *fit = NULL;
+	u32_t need;
+
+	if (size > sizeof(pool)) {
+		return NULL;
+	}
+	need = ROUND_UP(size, 8) + sizeof(struct chunk);
+
+	for (c = chunk_first(); chunk_valid(c); c = chunk_next(c)) {
+		if (c->owner != CHUNK_FREE) {
+			continue;
+		}
+		chunk_merge(c);
+		if (c->size >= need) {
+			fit = c;
+		}
+	}
+	if (fit == NULL) {
+		stats[owner].failures++;
+		return NULL;
+	}
+
+	/* the tail of the chunk, the head stays free for the VM */
+	c = fit;
+	if (fit->size - need >= CHUNK_MIN) {
+		fit->size -= need;
+		c = chunk_next(fit);
+		c->size = need;
+	}
+	c->owner = owner;
+	stats_add(owner, c->size);
+
+	return c + 1;
+}
+
+static size_t chunk_largest(void)
+{
+	struct chunk *c;
+	size_t largest = 0;
+
+	for (c = chunk_first(); chunk_valid(c); c = chunk_next(c)) {
+		if (c->owner != CHUNK_FREE) {
+			continue;
+		}
+		chunk_merge(c);
+		if (c->size > largest) {
+			largest = c->size;
+		}
+	}
+
+	return largest > sizeof(struct chunk) ? largest - sizeof(struct chunk) : 0;
+}
+
+void *degu_heap_alloc(enum degu_heap_owner owner, size_t size)
+{
+	void *ptr;
+
+	k_mutex_lock(&heap_lock, K_FOREVER);
+	ptr = chunk_alloc(owner, size);
+	k_mutex_unlock(&heap_lock);
+
+	return ptr;
+}
+
+void degu_heap_free(void *ptr)
+{
+	struct chunk *c;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	c = (struct chunk *)ptr - 1;
+	if ((u8_t *)c < (u8_t *)chunks || !chunk_valid(c) ||
+	    c->owner >= DEGU_HEAP_OWNERS) {
+		LOG_ERR("bad free %p", ptr);
+		return;
+	}
+
+	k_mutex_lock(&heap_lock, K_FOREVER);
+	stats[c->owner].used -= c->size;
+	c->owner = CHUNK_FREE;
+	k_mutex_unlock(&heap_lock);
+}
+
+/*
+ * The VM heap is DEGU_MPY_HEAP_MIN, extended up to DEGU_MPY_HEAP_MAX
+ * over the free chunk which follows, less the headroom mbedTLS may
+ * still need. It never waits: mbedTLS gets what is left, a handshake
+ * which needs more fails and is retried by its caller.
+ */
+void *degu_heap_mpy_arena(size_t *size)
+{
+	struct chunk *c, *rest;
+	size_t ext = 0;
+	size_t headroom;
+
+	k_mutex_lock(&heap_lock, K_FOREVER);
+
+	if (mpy_taken) {
+		k_mutex_unlock(&heap_lock);
+		return NULL;
+	}
+
+	c = chunk_first();
+	if (chunk_valid(c) && c->owner == CHUNK_FREE) {
+		chunk_merge(c);
+		headroom = MAX(tls_headroom(), CHUNK_MIN);
+		if (c->size > headroom) {
+			ext = c->size - headroom;
+		}
+		if (CONFIG_DEGU_MPY_HEAP_MAX > MPY_BASE) {
+			ext = MIN(ext, CONFIG_DEGU_MPY_HEAP_MAX - MPY_BASE);
+		} else {
+			ext = 0;
+		}
+		ext = ROUND_DOWN(ext, 8);
+	}
+	if (ext > 0) {
+		rest = (struct chunk *)((u8_t *)c + ext);
+		rest->size = c->size - ext;
+		rest->owner = CHUNK_FREE;
+		chunks = rest;
+	}
+	mpy_ext = ext;
+	mpy_taken = true;
+	stats_add(DEGU_HEAP_MPY, MPY_BASE + ext);
+
+	k_mutex_unlock(&heap_lock);
+
+	LOG_INF("MicroPython heap: %u bytes", (unsigned int)(MPY_BASE + ext));
+
+	*size = MPY_BASE + ext;
+	return pool;
+}
+
+void degu_heap_mpy_release(void)
+{
+	struct chunk *c;
+
+	k_mutex_lock(&heap_lock, K_FOREVER);
+	if (mpy_taken) {
+		if (mpy_ext > 0) {
+			c = (struct chunk *)(pool + MPY_BASE);
+			c->size = mpy_ext;
+			c->owner = CHUNK_FREE;
+			chunks = c;
+			chunk_merge(c);
+		}
+		stats[DEGU_HEAP_MPY].used -= MPY_BASE + mpy_ext;
+		mpy_ext = 0;
+		mpy_taken = false;
+	}
+	k_mutex_unlock(&heap_lock);
+}
+
+size_t degu_heap_largest_free(void)
+{
+	size_t largest;
+
+	k_mutex_lock(&heap_lock, K_FOREVER);
+	largest = chunk_largest();
+	k_mutex_unlock(&heap_lock);
+
+	return largest;
+}
+
+size_t degu_heap_total_free(void)
+{
+	size_t used = 0;
+	int i;
+
+	k_mutex_lock(&heap_lock, K_FOREVER);
+	for (i = 0; i < DEGU_HEAP_OWNERS; i++) {
+		used += stats[i].used;
+	}
+	k_mutex_unlock(&heap_lock);
+
+	return sizeof(pool) - used;
+}
+
+void degu_heap_get_stats(enum degu_heap_owner owner, struct degu_heap_stats *out)
+{
+	k_mutex_lock(&heap_lock, K_FOREVER);
+	*out = stats[owner];
+	k_mutex_unlock(&heap_lock);
+}
+
+#ifdef CONFIG_DEGU_HEAP_TLS
+static void *tls_calloc(size_t n, size_t size)
+{
+	void *ptr;
+
+	if (size && n > SIZE_MAX / size) {
+		return NULL;
+	}
+
+	ptr = degu_heap_alloc(DEGU_HEAP_TLS, n * size);
+	if (ptr) {
+		memset(ptr, 0, n * size);
+	}
+
+	return ptr;
+}
+#endif
+
+static int degu_heap_init(struct device *unused)
+{
+	struct chunk *c = chunk_first();
+
+	ARG_UNUSED(unused);
+
+	c->size = sizeof(pool) - MPY_BASE;
+	c->owner = CHUNK_FREE;
+
+#ifdef CONFIG_DEGU_HEAP_TLS
+	/* right after mbedTLS has set up its own heap, before any session */
+	mbedtls_platform_set_calloc_free(tls_calloc, degu_heap_free);
+#endif
+
+	return 0;
+}
+
+SYS_INIT(degu_heap_init, POST_KERNEL, 1);
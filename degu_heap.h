@@ -0,0 +1,44 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+enum degu_heap_owner {
+	DEGU_HEAP_MPY,		/* the MicroPython GC heap */
+	DEGU_HEAP_TLS,		/* mbedTLS, i.e. the DTLS sessions */
+	DEGU_HEAP_OWNERS,
+};
+
+struct degu_heap_stats {
+	u32_t used;		/* bytes held, headers included */
+	u32_t peak;
+	u32_t allocs;
+	u32_t failures;
+};
+
+void *degu_heap_alloc(enum degu_heap_owner owner, size_t size);
+void degu_heap_free(void *ptr);
+void *degu_heap_mpy_arena(size_t *size);
+void degu_heap_mpy_release(void);
+size_t degu_heap_largest_free(void);
+size_t degu_heap_total_free(void);
+void degu_heap_get_stats(enum degu_heap_owner owner, struct degu_heap_stats *out);
@@ -0,0 +1,211 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <zephyr.h>
+#include <stdio.h>
+#include <string.h>
+#include <net/socket.h>
+#include <net/net_if.h>
+#include <net/net_ip.h>
+#include <net/coap.h>
+#include <logging/log.h>
+#ifdef CONFIG_NET_L2_OPENTHREAD
+#include <net/openthread.h>
+#include <openthread/ip6.h>
+#endif
+#include "zcoap.h"
+#include "degu_ota.h"
+#include "degu_mcast.h"
+
+LOG_MODULE_REGISTER(degu_mcast);
+
+#define MCAST_STACK_SIZE	2048
+#define MCAST_PRIORITY		11
+
+/* CoAP NON POST to update/mcast, see tools/mcast_sender.py */
+#define MCAST_MAGIC		0x434d4744
+#define MCAST_ANNOUNCE		0
+#define MCAST_DATA		1
+#define MCAST_END		2
+
+struct mcast_hdr {
+	u32_t magic;
+	u8_t type;
+	u8_t reserved[3];
+	u32_t session;
+	u32_t arg;	/* ANNOUNCE:image size, DATA:block number */
+} __packed;
+
+static u8_t mcast_buf[MAX_COAP_MSG_LEN];
+
+static int mcast_join(void)
+{
+	struct net_if *iface = net_if_get_default();
+	struct net_if_mcast_addr *maddr;
+	struct in6_addr addr;
+
+	if (zsock_inet_pton(AF_INET6, CONFIG_DEGU_OTA_MCAST_GROUP, &addr) <= 0) {
+		LOG_ERR("Bad multicast group %s", CONFIG_DEGU_OTA_MCAST_GROUP);
+		return 1;
+	}
+
+	maddr = net_if_ipv6_maddr_add(iface, &addr);
+	if (!maddr) {
+		return 1;
+	}
+	net_if_ipv6_maddr_join(maddr);
+
+#ifdef CONFIG_NET_L2_OPENTHREAD
+	/* realm-local groups are forwarded by the Thread routers (MPL) */
+	struct openthread_context *ot_context = net_if_l2_data(iface);
+
+	otIp6SubscribeMulticastAddress(ot_context->instance,
+				       (const otIp6Address *)&addr);
+#endif
+
+	return 0;
+}
+
+static bool mcast_is_ota(struct coap_packet *pkt)
+{
+	struct coap_option opts[2];
+
+	if (coap_find_options(pkt, COAP_OPTION_URI_PATH, opts, 2) != 2) {
+		return false;
+	}
+
+	return opts[0].len == 6 && !memcmp(opts[0].value, "update", 6) &&
+	       opts[1].len == 5 && !memcmp(opts[1].value, "mcast", 5);
+}
+
+static void mcast_handle(const u8_t *data, u16_t len, u32_t *session)
+{
+	struct mcast_hdr hdr;
+	char ver[33];
+
+	if (len < sizeof(hdr)) {
+		return;
+	}
+	memcpy(&hdr, data, sizeof(hdr));
+	data += sizeof(hdr);
+	len -= sizeof(hdr);
+
+	if (hdr.magic != MCAST_MAGIC) {
+		return;
+	}
+
+	switch (hdr.type) {
+	case MCAST_ANNOUNCE:
+		if (hdr.session == *session || len < 32) {
+			break;
+		}
+		memcpy(ver, data, 32);
+		ver[32] = '\0';
+		if (degu_ota_mcast_announce(hdr.session, ver, hdr.arg) == 0) {
+			*session = hdr.session;
+		}
+		break;
+
+	case MCAST_DATA:
+		if (hdr.session == *session) {
+			degu_ota_mcast_block(hdr.session, hdr.arg, data, len);
+		}
+		break;
+
+	case MCAST_END:
+		if (hdr.session == *session) {
+			degu_ota_mcast_end(hdr.session);
+			*session = 0;
+		}
+		break;
+	}
+}
+
+static void mcast_thread(void *p1, void *p2, void *p3)
+{
+	struct sockaddr_in6 addr = {
+		.sin6_family = AF_INET6,
+		.sin6_port = htons(COAP_PORT),
+	};
+	struct coap_packet pkt;
+	const u8_t *data;
+	u32_t session = 0;
+	struct timeval tv;
+	fd_set fds;
+	u16_t len;
+	int sock;
+	int r;
+
+	while (!net_if_is_up(net_if_get_default())) {
+		k_sleep(K_SECONDS(1));
+	}
+
+	if (mcast_join()) {
+		LOG_ERR("Can't join %s", CONFIG_DEGU_OTA_MCAST_GROUP);
+		return;
+	}
+
+	sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		LOG_ERR("Can't listen for multicast updates");
+		return;
+	}
+
+	while (1) {
+		FD_ZERO(&fds);
+		FD_SET(sock, &fds);
+		tv.tv_sec = CONFIG_DEGU_OTA_MCAST_TIMEOUT;
+		tv.tv_usec = 0;
+		r = select(sock + 1, &fds, NULL, NULL, session ? &tv : NULL);
+		if (r == 0) {
+			/* the sender has gone quiet, repair over unicast */
+			degu_ota_mcast_end(session);
+			session = 0;
+			continue;
+		}
+
+		r = recv(sock, mcast_buf, sizeof(mcast_buf), 0);
+		if (r <= 0 || coap_packet_parse(&pkt, mcast_buf, r, NULL, 0) < 0) {
+			continue;
+		}
+
+		if (coap_header_get_type(&pkt) != COAP_TYPE_NON_CON ||
+		    coap_header_get_code(&pkt) != COAP_METHOD_POST ||
+		    !mcast_is_ota(&pkt)) {
+			continue;
+		}
+
+		data = coap_packet_get_payload(&pkt, &len);
+		if (data) {
+			mcast_handle(data, len, &session);
+		}
+	}
+}
+
+K_THREAD_DEFINE(degu_mcast_tid, MCAST_STACK_SIZE, mcast_thread,
+		NULL, NULL, NULL, MCAST_PRIORITY, 0, K_FOREVER);
+
+void degu_mcast_start(void)
+{
+	k_thread_start(degu_mcast_tid);
+}
@@ -24,6 +24,7 @@
  * THE SOFTWARE.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <flash.h>
@@ -32,16 +33,54 @@
 #include <net/coap.h>
 #include <sys/util.h>
 #include <logging/log.h>
+#include <misc/reboot.h>
+#include <hal/nrf_power.h>
 #include "mbedtls/md5.h"
+#include "lib/utils/interrupt_char.h"
 #include "degu_utils.h"
 #include "zcoap.h"
 #include "degu_ota.h"
+#include "degu_mcast.h"
+#include "degu_proxy.h"
+#include "degu_shadow.h"
 #include "version.h"
 
 #define FIRWARE_SIZE_SLOT0	((uint32_t *)0x0001400CL)
+/* image header (0x200) and TLVs, not counted in ih_img_size */
+#define FIRMWARE_OVERHEAD	848
+#define IMAGE_MAGIC		0x96f3b83d
 #define BOOT_MAGIC_SZ		16
 #define BOOT_MAGIC_OFFS		(DT_FLASH_AREA_IMAGE_1_SIZE - BOOT_MAGIC_SZ)
 
+#define OTA_BLOCK_SIZE		1024
+#define OTA_PROGRESS_PATH	"/NAND:/OTAPROG.DAT"
+#define OTA_PROGRESS_MAGIC	0x4f544150
+/* blocks written between two progress records */
+#define OTA_PROGRESS_INTERVAL	16
+/* resume attempts before starting over from block 0 */
+#define OTA_RESUME_MAX		8
+
+/* nRF52840 flash page, slot-1 is written a page at a time */
+#define SLOT1_PAGE_SIZE		4096
+#define SLOT1_WRITE_ALIGN	4
+#ifndef SLOT1_WRITE_VERIFY
+#define SLOT1_WRITE_VERIFY	1
+#endif
+/* pages erased ahead of the download on the system workqueue, 0:disable */
+#ifndef SLOT1_ERASE_AHEAD
+#define SLOT1_ERASE_AHEAD	1
+#endif
+/* MCUboot trailer, not covered by the downloaded image */
+#define SLOT1_TRAILER_OFFS	(DT_FLASH_AREA_IMAGE_1_SIZE - SLOT1_PAGE_SIZE)
+
+/* blocks buffered between the network and the storage thread */
+#define OTA_PIPE_DEPTH		3
+#define OTA_STORAGE_STACK_SIZE	1536
+#define OTA_STORAGE_PRIORITY	5
+
+/* time given to the script to end after CTRL-C, then the board reboots */
+#define OTA_STOP_TIMEOUT	K_SECONDS(10)
+
 LOG_MODULE_REGISTER(degu_ota);
 
 static u32_t boot_img_magic[4] = {
@@ -59,6 +98,82 @@ u16_t payload_len;
 u8_t *payload;
 u32_t byte_written;
 
+/*
+ * Firmware download progress, kept on /NAND: so that an interrupted
+ * update resumes from the last recorded block instead of erasing slot-1.
+ */
+struct ota_progress {
+	u32_t magic;
+	char ver[33];
+	u8_t attempts;
+	u32_t block;
+	u32_t image_size;
+	mbedtls_md5_context md5;
+};
+
+/* leading fields of the MCUboot image header */
+struct image_header {
+	u32_t ih_magic;
+	u32_t ih_load_addr;
+	u16_t ih_hdr_size;
+	u16_t ih_protect_tlv_size;
+	u32_t ih_img_size;
+};
+
+static struct ota_progress ota_progress;
+static u32_t resume_end;
+static bool ota_write_err;
+
+/* write-back buffer for slot-1 */
+static u8_t page_buf[SLOT1_PAGE_SIZE] __aligned(4);
+static u32_t page_base;
+static u32_t page_fill;
+static u32_t slot1_session_start;
+static bool slot1_active;
+
+/*
+ * slot-1 is erased a page at a time just before it is written.
+ * Pages below slot1_ready_end are erased or hold data of this image.
+ */
+static u32_t slot1_ready_end;
+static K_MUTEX_DEFINE(slot1_erase_lock);
+static struct k_work slot1_erase_work;
+
+struct ota_pipe_buf {
+	u16_t len;
+	u8_t data[OTA_BLOCK_SIZE];
+};
+
+K_MEM_SLAB_DEFINE(ota_pipe_slab, sizeof(struct ota_pipe_buf), OTA_PIPE_DEPTH, 4);
+K_MSGQ_DEFINE(ota_pipe_q, sizeof(struct ota_pipe_buf *), OTA_PIPE_DEPTH + 1, 4);
+static K_SEM_DEFINE(ota_pipe_done, 0, 1);
+static int (*ota_pipe_sink)(u8_t *buf, u16_t len);
+static atomic_t ota_pipe_err;
+static u32_t ota_pipe_start_time;
+
+static struct ota_pipe_stats {
+	u32_t net_wait_ms;
+	u32_t storage_busy_ms;
+	u32_t storage_wait_ms;
+} ota_pipe_stats;
+
+/* buffered script and config writes, page_buf is shared with slot-1 */
+static u32_t file_fill;
+
+static struct file_stats {
+	u32_t bytes;
+	u32_t write_calls;
+	u32_t start;
+} file_stats;
+
+static struct slot1_stats {
+	u32_t bytes;
+	u32_t write_calls;
+	u32_t write_ms;
+	u32_t erase_calls;
+	u32_t erase_ms;
+} slot1_stats;
+
 char script_user_ver[33];
 char config_user_ver[33];
 char firmware_system_ver[33];
@@ -68,6 +183,98 @@ bool update_flag_script_user;
 bool update_flag_config_user;
 bool update_flag_firmware_system;
 
+enum {
+	ARTIFACT_SCRIPT_USER,
+	ARTIFACT_CONFIG_USER,
+	ARTIFACT_FIRMWARE_SYSTEM,
+	ARTIFACT_NUM,
+};
+
+static const char *const artifact_names[ARTIFACT_NUM] = {
+	"script_user",
+	"config_user",
+	"firmware_system",
+};
+
+/* pending artifacts, from update/manifest or the legacy update/status */
+struct ota_artifact {
+	char ver[33];
+	char uri[DEGU_COAP_PATH_MAX + 1];
+	u32_t size;
+} ota_artifacts[ARTIFACT_NUM];
+
+/*
+ * Script and config updates are written to a temporary file, verified,
+ * then renamed into place. The previous file is kept as a rollback copy.
+ */
+static const struct user_file {
+	char *path;
+	char *tmp;
+	char *bak;
+} user_files[] = {
+	[ARTIFACT_SCRIPT_USER] = {
+		"/NAND:/main.py", "/NAND:/MAIN.TMP", "/NAND:/MAIN.BAK" },
+	[ARTIFACT_CONFIG_USER] = {
+		"/NAND:/CONFIG", "/NAND:/CONFIG.TMP", "/NAND:/CONFIG.BAK" },
+};
+
+/*
+ * A new script runs on trial with the previous one kept in MAIN.BAK.
+ * It is kept once degu.confirm() is called, it ran for
+ * CONFIG_DEGU_SCRIPT_TRIAL_TIME seconds or it ended without an exception.
+ * Otherwise MAIN.BAK is put back, at once or on the next boot.
+ */
+#define SCRIPT_SEL_PATH "/NAND:/SCRIPT.SEL"
+#define SCRIPT_SEL_MAGIC 0x53454c31
+/* the rejected script while MAIN.BAK is put back, not MAIN.TMP of a download */
+#define SCRIPT_REJ_PATH "/NAND:/MAIN.REJ"
+
+/* set before the reboots made on purpose, kept over a soft reset */
+#define REBOOT_INTENDED_MAGIC 0x52424f54
+static __noinit u32_t reboot_intended;
+
+enum {
+	SCRIPT_CONFIRMED,
+	SCRIPT_TRIAL,
+};
+
+static struct script_sel {
+	u32_t magic;
+	u32_t state;
+	u32_t boots;
+	char rejected[33];	/* md5 of the last script rolled back */
+} script_sel;
+
+static K_MUTEX_DEFINE(script_lock);
+static struct k_delayed_work script_health_work;
+static bool script_rolled_back;
+/* the last reset was a watchdog, a lockup or an unexpected soft reset */
+static bool boot_crashed;
+
+/* artifacts listed by the manifest need no PUT and POST to prepare */
+static bool manifest_used;
+
+#ifdef CONFIG_DEGU_OTA_PROXY
+/* digest of an artifact which failed its check, got from the gateway only */
+static char proxy_rejected[33];
+#endif
+
+/* update checks run on the update thread and from degu.check_update() */
+static K_MUTEX_DEFINE(ota_lock);
+static K_SEM_DEFINE(ota_check_sem, 0, 1);
+static K_SEM_DEFINE(ota_safe_sem, 0, 1);
+static K_SEM_DEFINE(ota_restart_sem, 0, 1);
+static bool ota_initialized;
+static bool ota_update_pending;
+static bool ota_firmware_updated;
+
+/* what main() is doing with the MicroPython VM */
+static enum {
+	OTA_VM_RUNNING,
+	OTA_VM_WAITING,
+	OTA_VM_NONE,
+} ota_vm_state;
+
 struct shadow_send {
 	struct state_send {
 		struct reported {
@@ -109,6 +316,31 @@ static const struct json_obj_descr desired_descr[] = {
 	JSON_OBJ_DESCR_PRIM(struct desired, firmware_system_ver, JSON_TOK_STRING),
 };
 
+struct manifest_artifact {
+	char *name;
+	char *ver;
+	char *uri;
+	s32_t size;
+};
+
+struct manifest {
+	struct manifest_artifact artifacts[ARTIFACT_NUM];
+	size_t artifacts_len;
+};
+
+static const struct json_obj_descr manifest_artifact_descr[] = {
+	JSON_OBJ_DESCR_PRIM(struct manifest_artifact, name, JSON_TOK_STRING),
+	JSON_OBJ_DESCR_PRIM(struct manifest_artifact, ver, JSON_TOK_STRING),
+	JSON_OBJ_DESCR_PRIM(struct manifest_artifact, uri, JSON_TOK_STRING),
+	JSON_OBJ_DESCR_PRIM(struct manifest_artifact, size, JSON_TOK_NUMBER),
+};
+
+static const struct json_obj_descr manifest_descr[] = {
+	JSON_OBJ_DESCR_OBJ_ARRAY(struct manifest, artifacts, ARTIFACT_NUM,
+		artifacts_len, manifest_artifact_descr,
+		ARRAY_SIZE(manifest_artifact_descr)),
+};
+
 static const struct json_obj_descr state_send_descr[] = {
 	JSON_OBJ_DESCR_OBJECT(struct state_send, reported, reported_descr),
 };
@@ -125,70 +357,70 @@ static const struct json_obj_descr shadow_recv_descr[] = {
 	JSON_OBJ_DESCR_OBJECT(struct shadow_recv, state, state_recv_descr),
 };
 
-static char *md5sum(char *buf, int len)
+static void md5_to_hex(unsigned char *output, char *outword)
 {
-	unsigned char output[16];
-	static char outword[33];
-	mbedtls_md5_ret(buf, len, output);
 	for(int i = 0; i<16; i++){
 		sprintf(outword+i*2, "%02x", output[i]);
 	}
 	outword[32] = '\0';
+}
+
+static char *md5sum(char *buf, int len)
+{
+	unsigned char output[16];
+	static char outword[33];
+	mbedtls_md5_ret(buf, len, output);
+	md5_to_hex(output, outword);
 	return outword;
 }
 
 static int user_sum(char *path, char *md5)
 {
-	int err, offset = 0;
-	char *file_data;
-	int count = INT_MAX;
-	int read = 0;
+	struct fs_file_t fp;
+	struct fs_dirent entry;
+	mbedtls_md5_context ctx;
+	unsigned char output[16];
+	u8_t buf[128];
+	ssize_t rlen;
+	int err;
 
-	err = fs_stat(path, &dirent);
+	err = fs_stat(path, &entry);
 	if(err) {
 		LOG_ERR("Failed to stat file");
 		strcpy(md5, "none");
 		return 1;
 	}
 
-	err = fs_open(&file, path);
+	err = fs_open(&fp, path);
 	if(err) {
 		LOG_ERR("Can't open file");
 		strcpy(md5, "none");
 		return 1;
 	}
 
-	if (offset > 0) {
-		fs_seek(&file, offset, FS_SEEK_SET);
-	}
-
-	file_data = k_malloc(dirent.size);
-	if (!file_data) {
-		LOG_ERR("Cannot malloc for a user file");
-		return 1;
-	}
-
+	mbedtls_md5_init(&ctx);
+	mbedtls_md5_starts_ret(&ctx);
 	while(1){
-		read = fs_read(&file, file_data + offset, MIN(count, sizeof(file_data)));
-		if (read <= 0) {
+		rlen = fs_read(&fp, buf, sizeof(buf));
+		if (rlen <= 0) {
 			break;
 		}
-		offset += read;
-		count -= read;
+		mbedtls_md5_update_ret(&ctx, buf, rlen);
 	}
+	mbedtls_md5_finish_ret(&ctx, output);
+	mbedtls_md5_free(&ctx);
 
-	strcpy(md5, md5sum(file_data, dirent.size));
+	md5_to_hex(output, md5);
 	LOG_INF("%s : %s\n", path, md5);
 
-	k_free(file_data);
-	fs_close(&file);
+	fs_close(&fp);
 
 	return 0;
 }
 
 static int firmware_sum(char *md5)
 {
-	int size = *FIRWARE_SIZE_SLOT0 + 848;
+	int size = *FIRWARE_SIZE_SLOT0 + FIRMWARE_OVERHEAD;
 
 	strcpy(md5, md5sum((char *)DT_FLASH_AREA_IMAGE_0_OFFSET, size));
 	LOG_INF("firmware size: %d, md5sum: %s", size, md5);
@@ -199,9 +431,9 @@ static int firmware_sum(char *md5)
 int update_init(void)
 {
 	char shadow_encoded[1024];
-	memset(shadow_encoded, 0, 1024);
+	int ret;
 
-	degu_get_asset();
+	memset(shadow_encoded, 0, 1024);
 
 	flash_dev = device_get_binding(DT_FLASH_DEV_NAME);
 	if (!flash_dev) {
@@ -209,16 +441,18 @@ int update_init(void)
 		return DEGU_OTA_ERR;
 	}
 
-	payload = (u8_t *)k_malloc(MAX_COAP_MSG_LEN);
 	if (!payload) {
-		LOG_ERR("Cannot malloc for payload");
-		return DEGU_OTA_ERR;
+		payload = (u8_t *)k_malloc(MAX_COAP_MSG_LEN);
+		if (!payload) {
+			LOG_ERR("Cannot malloc for payload");
+			return DEGU_OTA_ERR;
+		}
 	}
 	memset(payload, 0, MAX_COAP_MSG_LEN);
 
-	update_flag_script_user = false;
-	update_flag_config_user = false;
-	update_flag_firmware_system = false;
+	k_mutex_lock(&ota_lock, K_FOREVER);
+	degu_coap_session_open();
+	degu_get_asset();
 
 	user_sum("/NAND:/main.py", script_user_ver);
 	shadow_send.state.reported.script_user_ver = script_user_ver;
@@ -235,26 +469,12 @@ int update_init(void)
 	json_obj_encode_buf(shadow_send_descr, ARRAY_SIZE(shadow_send_descr),
 				&shadow_send, shadow_encoded, sizeof(shadow_encoded));
 
-	return degu_coap_request("thing", COAP_METHOD_POST, shadow_encoded, NULL) < COAP_RESPONSE_CODE_OK ? DEGU_OTA_ERR : DEGU_OTA_OK;
-}
-
-int erase_flash_slot1(void)
-{
-	int err;
-
-	LOG_INF("Erasing slot-1...");
-
-	flash_write_protection_set(flash_dev, false);
-	err = flash_erase(flash_dev, DT_FLASH_AREA_IMAGE_1_OFFSET, DT_FLASH_AREA_IMAGE_1_SIZE);
-	flash_write_protection_set(flash_dev, true);
-	if (err) {
-		LOG_INF("Erasing slot-1 failed");
-		return 1;
-	}
-
-	LOG_INF("Erased slot-1 ");
+	/* nothing is sent when the versions have not changed since the last boot */
+	ret = degu_shadow_report(shadow_encoded, true) < COAP_RESPONSE_CODE_OK ? DEGU_OTA_ERR : DEGU_OTA_OK;
+	degu_coap_session_close();
+	k_mutex_unlock(&ota_lock);
 
-	return 0;
+	return ret;
 }
 
 int write_flash_slot1(int written, void *data, int len)
@@ -282,164 +502,1547 @@ int write_flash_slot1(int written, void *data, int len)
 	return 0;
 }
 
-void write_file(u8_t *buf, u16_t len)
+static int ota_progress_save(void)
 {
-	fs_write(&file, buf, len);
-	fs_sync(&file);
+	struct fs_file_t prog;
+	ssize_t len;
+
+	if (fs_open(&prog, OTA_PROGRESS_PATH)) {
+		LOG_ERR("Can't open OTA progress");
+		return 1;
+	}
+
+	len = fs_write(&prog, &ota_progress, sizeof(ota_progress));
+	fs_close(&prog);
+
+	return len == sizeof(ota_progress) ? 0 : 1;
 }
 
-void write_firmware(u8_t *buf, u16_t len)
+static void ota_progress_clear(void)
 {
-	write_flash_slot1(byte_written, buf, len);
-	byte_written += len;
-	LOG_INF("Wrote: %d", byte_written);
-}
+	struct fs_dirent entry;
 
-void write_img_magic() {
-	write_flash_slot1(BOOT_MAGIC_OFFS, boot_img_magic, BOOT_MAGIC_SZ);
+	if (!fs_stat(OTA_PROGRESS_PATH, &entry)) {
+		fs_unlink(OTA_PROGRESS_PATH);
+	}
+	memset(&ota_progress, 0, sizeof(ota_progress));
 }
 
-int do_update(void)
+/**
+ * load the progress record of the given firmware version.
+ * @return	number of blocks already in slot-1, 0:start over
+ */
+static u32_t ota_progress_load(const char *ver)
 {
-	char request_url[1024];
-	int err;
+	struct fs_file_t prog;
+	ssize_t len;
 
-	memset(request_url, 0, 1024);
+	if (fs_open(&prog, OTA_PROGRESS_PATH)) {
+		return 0;
+	}
 
-	json_obj_encode_buf(desired_descr, ARRAY_SIZE(desired_descr),
-		&shadow_recv.state.desired, request_url, sizeof(request_url));
+	len = fs_read(&prog, &ota_progress, sizeof(ota_progress));
+	fs_close(&prog);
 
-	if (update_flag_script_user) {
-		if (degu_coap_request("update/script_user", COAP_METHOD_PUT, "", NULL) < COAP_RESPONSE_CODE_OK) {
-			goto error;
-		}
+	if (len != sizeof(ota_progress) ||
+	    ota_progress.magic != OTA_PROGRESS_MAGIC ||
+	    strcmp(ota_progress.ver, ver) != 0 ||
+	    ota_progress.attempts >= OTA_RESUME_MAX) {
+		return 0;
+	}
 
-		if (degu_coap_request("update/script_user", COAP_METHOD_POST, request_url, NULL) < COAP_RESPONSE_CODE_OK) {
-			goto error;
-		}
+	return ota_progress.block;
+}
 
-		err = fs_stat("/NAND:/main.py", &dirent);
-		if (!err) {
-			fs_unlink("/NAND:/main.py");
-		}
+/* erase slot-1 pages up to the given offset, the caller holds the lock */
+static int slot1_erase_to(u32_t end)
+{
+	u32_t start;
+	int err;
 
-		err = fs_open(&file, "/NAND:/main.py");
-		if(err) {
-			LOG_ERR("Can't open user script");
-			goto error;
+	end = MIN(ROUND_UP(end, SLOT1_PAGE_SIZE), DT_FLASH_AREA_IMAGE_1_SIZE);
+
+	while (slot1_ready_end < end) {
+		start = k_uptime_get_32();
+		err = flash_erase(flash_dev, DT_FLASH_AREA_IMAGE_1_OFFSET + slot1_ready_end,
+				  SLOT1_PAGE_SIZE);
+		slot1_stats.erase_calls++;
+		slot1_stats.erase_ms += k_uptime_get_32() - start;
+		if (err) {
+			LOG_ERR("Failed to erase slot-1 at %d", slot1_ready_end);
+			return 1;
 		}
+		slot1_ready_end += SLOT1_PAGE_SIZE;
+	}
 
-		memset(payload, 0, 1024);
-		if (degu_coap_request("update/script_user", COAP_METHOD_GET, payload, &write_file) < COAP_RESPONSE_CODE_OK) {
-			fs_close(&file);
-			goto error;
-		}
+	return 0;
+}
 
-		fs_close(&file);
+static void slot1_erase_ahead(struct k_work *work)
+{
+	k_mutex_lock(&slot1_erase_lock, K_FOREVER);
+	if (slot1_active) {
+		slot1_erase_to(page_base + (SLOT1_ERASE_AHEAD + 1) * SLOT1_PAGE_SIZE);
 	}
+	k_mutex_unlock(&slot1_erase_lock);
+}
 
-	if (update_flag_config_user) {
-		if (degu_coap_request("update/config_user", COAP_METHOD_PUT, "", NULL) < COAP_RESPONSE_CODE_OK) {
-			goto error;
-		}
+static void slot1_begin(u32_t offset)
+{
+	memset(&slot1_stats, 0, sizeof(slot1_stats));
+	memset(page_buf, 0xff, sizeof(page_buf));
+	page_base = offset;
+	page_fill = 0;
+	slot1_ready_end = offset;
+	slot1_session_start = k_uptime_get_32();
+	k_work_init(&slot1_erase_work, slot1_erase_ahead);
+
+	/* keep slot-1 writable during the whole download */
+	flash_write_protection_set(flash_dev, false);
+	slot1_active = true;
+}
 
-		if (degu_coap_request("update/config_user", COAP_METHOD_POST, request_url, NULL) < COAP_RESPONSE_CODE_OK) {
-			goto error;
-		}
+static int slot1_flush(void)
+{
+	u32_t len = ROUND_UP(page_fill, SLOT1_WRITE_ALIGN);
+	u32_t start;
+	bool written = false;
+	int err;
 
-		err = fs_stat("/NAND:/CONFIG", &dirent);
-		if (!err) {
-			fs_unlink("/NAND:/CONFIG");
-		}
+	if (page_fill == 0) {
+		return 0;
+	}
 
-		err = fs_open(&file, "/NAND:/CONFIG");
-		if(err) {
-			LOG_ERR("Can't open config file");
-			goto error;
-		}
+	k_mutex_lock(&slot1_erase_lock, K_FOREVER);
+	if (page_base < resume_end &&
+	    !memcmp((const void *)(DT_FLASH_AREA_IMAGE_1_OFFSET + page_base),
+		    page_buf, len)) {
+		/* written before the download was interrupted */
+		written = true;
+		slot1_ready_end = MAX(slot1_ready_end, page_base + SLOT1_PAGE_SIZE);
+	} else if (slot1_erase_to(page_base + len)) {
+		k_mutex_unlock(&slot1_erase_lock);
+		return 1;
+	}
 
-		memset(payload, 0, 1024);
-		if (degu_coap_request("update/config_user", COAP_METHOD_GET, payload, &write_file) < COAP_RESPONSE_CODE_OK) {
-			fs_close(&file);
-			goto error;
+	if (!written) {
+		start = k_uptime_get_32();
+		err = flash_write(flash_dev, DT_FLASH_AREA_IMAGE_1_OFFSET + page_base,
+				  page_buf, len);
+		slot1_stats.write_calls++;
+		slot1_stats.write_ms += k_uptime_get_32() - start;
+		if (err) {
+			LOG_ERR("Failed to write slot-1 at %d", page_base);
+			k_mutex_unlock(&slot1_erase_lock);
+			return 1;
+		}
+#if SLOT1_WRITE_VERIFY
+		if (memcmp((const void *)(DT_FLASH_AREA_IMAGE_1_OFFSET + page_base),
+			   page_buf, len)) {
+			LOG_ERR("slot-1 verify failed at %d", page_base);
+			k_mutex_unlock(&slot1_erase_lock);
+			return 1;
+		}
+#endif
+	}
+	slot1_stats.bytes += page_fill;
+
+	if (page_fill == SLOT1_PAGE_SIZE &&
+	    ota_progress.block % OTA_PROGRESS_INTERVAL == 0) {
+		ota_progress.attempts = 0;
+		if (ota_progress_save()) {
+			/* a torn record is not resumed from, saved again next interval */
+			LOG_ERR("Failed to save OTA progress at block %d", ota_progress.block);
+			fs_unlink(OTA_PROGRESS_PATH);
 		}
+		/* the FAT disk shares the flash controller with slot-1 */
+		flash_write_protection_set(flash_dev, false);
+	}
+	k_mutex_unlock(&slot1_erase_lock);
 
-		fs_close(&file);
+	page_base += page_fill;
+	page_fill = 0;
+	memset(page_buf, 0xff, sizeof(page_buf));
+
+#if SLOT1_ERASE_AHEAD
+	/* pages being resumed must not be erased before they are compared */
+	if (page_base >= resume_end) {
+		k_work_submit(&slot1_erase_work);
 	}
+#endif
 
-	if (update_flag_firmware_system) {
-		byte_written = 0;
+	return 0;
+}
 
-		if (degu_coap_request("update/firmware_system", COAP_METHOD_PUT, "", NULL) < COAP_RESPONSE_CODE_OK) {
-			goto error;
-		}
+static int slot1_write(u8_t *buf, u16_t len)
+{
+	u32_t chunk;
 
-		if (degu_coap_request("update/firmware_system", COAP_METHOD_POST, request_url, NULL) < COAP_RESPONSE_CODE_OK) {
-			goto error;
+	while (len > 0) {
+		chunk = MIN(len, SLOT1_PAGE_SIZE - page_fill);
+		memcpy(page_buf + page_fill, buf, chunk);
+		page_fill += chunk;
+		buf += chunk;
+		len -= chunk;
+
+		if (page_fill == SLOT1_PAGE_SIZE && slot1_flush()) {
+			return 1;
 		}
+	}
 
-		erase_flash_slot1();
+	return 0;
+}
 
-		memset(payload, 0, 1024);
-		if (degu_coap_request("update/firmware_system", COAP_METHOD_GET, payload, &write_firmware) < COAP_RESPONSE_CODE_OK) {
-			goto error;
-		}
+/**
+ * end a slot-1 session.
+ * @param	complete	true:the whole image has been received
+ */
+static void slot1_end(bool complete)
+{
+	u32_t elapsed;
+
+	/*
+	 * A partial page of an interrupted download is not written, the resume
+	 * would find it neither erased nor equal to the image.
+	 */
+	if (complete && !ota_write_err && slot1_flush()) {
+		ota_write_err = true;
+	}
 
-		write_img_magic();
+	/* wait for a running erase-ahead and keep a queued one from erasing */
+	k_mutex_lock(&slot1_erase_lock, K_FOREVER);
+	slot1_active = false;
+	flash_write_protection_set(flash_dev, true);
+	k_mutex_unlock(&slot1_erase_lock);
+
+	elapsed = k_uptime_get_32() - slot1_session_start;
+	LOG_INF("slot-1: %d bytes, %d writes, flash %d ms, total %d ms (%d B/s)",
+		slot1_stats.bytes, slot1_stats.write_calls, slot1_stats.write_ms,
+		elapsed, elapsed ? slot1_stats.bytes * 1000 / elapsed : 0);
+	LOG_INF("slot-1: %d pages erased, erase %d ms",
+		slot1_stats.erase_calls, slot1_stats.erase_ms);
+}
+
+static int ota_firmware_begin(const char *ver)
+{
+	u32_t block = ota_progress_load(ver);
+
+	ota_write_err = false;
+
+	if (block == 0) {
+		memset(&ota_progress, 0, sizeof(ota_progress));
+		ota_progress.magic = OTA_PROGRESS_MAGIC;
+		strncpy(ota_progress.ver, ver, sizeof(ota_progress.ver) - 1);
+		mbedtls_md5_init(&ota_progress.md5);
+		mbedtls_md5_starts_ret(&ota_progress.md5);
+		resume_end = 0;
+	} else {
+		LOG_INF("Resuming firmware update from block %d", block);
+		/* pages after the last record may already be programmed */
+		resume_end = (block + OTA_PROGRESS_INTERVAL) * OTA_BLOCK_SIZE;
 	}
 
-	return DEGU_OTA_OK;
+	ota_progress.attempts++;
+	if (ota_progress_save()) {
+		return 1;
+	}
 
-error:
-	return DEGU_OTA_ERR;
+	byte_written = block * OTA_BLOCK_SIZE;
+	slot1_begin(byte_written);
+
+	return 0;
 }
 
-int check_update(void)
+static void script_sel_save(void)
 {
-	int diff;
-	int ret = DEGU_OTA_ERR;
+	struct fs_file_t fp;
 
-	if (degu_coap_request("update/status", COAP_METHOD_PUT, "", NULL) < COAP_RESPONSE_CODE_OK) {
-		goto end;
+	script_sel.magic = SCRIPT_SEL_MAGIC;
+
+	if (fs_open(&fp, SCRIPT_SEL_PATH)) {
+		LOG_ERR("Can't open %s", SCRIPT_SEL_PATH);
+		return;
 	}
 
-	memset(payload, 0, 1024);
-	if (degu_coap_request("update/status", COAP_METHOD_GET, payload, NULL) < COAP_RESPONSE_CODE_OK) {
-		goto end;
+	if (fs_write(&fp, &script_sel, sizeof(script_sel)) != sizeof(script_sel)) {
+		LOG_ERR("Failed to write %s", SCRIPT_SEL_PATH);
 	}
+	fs_close(&fp);
+}
 
-	if (!payload) {
+static void script_sel_load(void)
+{
+	struct fs_file_t fp;
+
+	memset(&script_sel, 0, sizeof(script_sel));
+
+	if (fs_open(&fp, SCRIPT_SEL_PATH)) {
+		return;
+	}
+
+	if (fs_read(&fp, &script_sel, sizeof(script_sel)) != sizeof(script_sel) ||
+	    script_sel.magic != SCRIPT_SEL_MAGIC) {
+		memset(&script_sel, 0, sizeof(script_sel));
+	}
+	script_sel.rejected[sizeof(script_sel.rejected) - 1] = '\0';
+	fs_close(&fp);
+}
+
+/* a new script has been renamed into place, try it on the next start */
+static void script_trial_mark(void)
+{
+	k_mutex_lock(&script_lock, K_FOREVER);
+	script_sel.state = SCRIPT_TRIAL;
+	script_sel.boots = 0;
+	script_sel_save();
+	k_mutex_unlock(&script_lock);
+}
+
+/* put MAIN.BAK back without downloading anything */
+static bool script_trial_rollback(void)
+{
+	const struct user_file *uf = &user_files[ARTIFACT_SCRIPT_USER];
+	struct fs_dirent entry;
+	char md5[33];
+	bool ret = false;
+
+	k_mutex_lock(&script_lock, K_FOREVER);
+	if (script_sel.state != SCRIPT_TRIAL) {
 		goto end;
 	}
 
-	json_obj_parse(payload, strlen(payload), shadow_recv_descr,
-			ARRAY_SIZE(shadow_recv_descr), &shadow_recv);
+	k_delayed_work_cancel(&script_health_work);
 
-	if (shadow_recv.state.desired.script_user_ver != NULL) {
-		diff = strcmp(shadow_recv.state.desired.script_user_ver,
-				shadow_send.state.reported.script_user_ver);
-		if (diff) {
-			update_flag_script_user = true;
-			ret = DEGU_OTA_OK;
-		}
+	if (fs_stat(uf->bak, &entry)) {
+		LOG_ERR("No script to roll back to, keeping %s", uf->path);
+		goto confirm;
 	}
-	if (shadow_recv.state.desired.config_user_ver != NULL) {
-		diff = strcmp(shadow_recv.state.desired.config_user_ver,
-				shadow_send.state.reported.config_user_ver);
-		if (diff) {
-			update_flag_config_user = true;
-			ret = DEGU_OTA_OK;
-		}
+
+	user_sum(uf->path, md5);
+	LOG_WRN("Rolling back script %s", md5);
+
+	/*
+	 * An interrupted swap is finished by ota_file_recover(). MAIN.TMP may
+	 * belong to a download running without script_lock.
+	 */
+	if (!fs_stat(SCRIPT_REJ_PATH, &entry)) {
+		fs_unlink(SCRIPT_REJ_PATH);
 	}
-	if (shadow_recv.state.desired.firmware_system_ver != NULL) {
-		diff = strcmp(shadow_recv.state.desired.firmware_system_ver,
-				shadow_send.state.reported.firmware_system_ver);
-		if (diff) {
-			update_flag_firmware_system = true;
-			ret = DEGU_OTA_OK;
-		}
+	if (fs_rename(uf->path, SCRIPT_REJ_PATH) || fs_rename(uf->bak, uf->path)) {
+		LOG_ERR("Failed to roll back %s", uf->path);
+		goto end;
 	}
+	fs_unlink(SCRIPT_REJ_PATH);
 
+	/* the same version is not downloaded again */
+	strcpy(script_sel.rejected, md5);
+	ret = true;
+
+confirm:
+	script_sel.state = SCRIPT_CONFIRMED;
+	script_sel_save();
 end:
+	k_mutex_unlock(&script_lock);
 	return ret;
 }
+
+static void script_health_handler(struct k_work *work)
+{
+	LOG_INF("Script ran for %d seconds", CONFIG_DEGU_SCRIPT_TRIAL_TIME);
+	degu_ota_confirm();
+}
+
+/**
+ * called before the script is started.
+ * @param	boot	true:after a reboot, false:after a VM restart
+ */
+static void script_trial_begin(bool boot)
+{
+	k_mutex_lock(&script_lock, K_FOREVER);
+	if (script_sel.state != SCRIPT_TRIAL) {
+		k_mutex_unlock(&script_lock);
+		return;
+	}
+
+	/*
+	 * the trial script has already been started once and crashed. A
+	 * power cycle, a reset pin or a reboot for an update is not counted.
+	 */
+	if (boot && script_sel.boots > 0 && boot_crashed) {
+		k_mutex_unlock(&script_lock);
+		script_trial_rollback();
+		return;
+	}
+
+	if (script_sel.boots == 0) {
+		script_sel.boots = 1;
+		script_sel_save();
+	}
+
+	if (CONFIG_DEGU_SCRIPT_TRIAL_TIME > 0) {
+		k_delayed_work_submit(&script_health_work,
+				      K_SECONDS(CONFIG_DEGU_SCRIPT_TRIAL_TIME));
+	}
+	k_mutex_unlock(&script_lock);
+}
+
+static int ota_file_open(int artifact)
+{
+	const struct user_file *uf = &user_files[artifact];
+
+	if (!fs_stat(uf->tmp, &dirent)) {
+		fs_unlink(uf->tmp);
+	}
+
+	if (fs_open(&file, uf->tmp)) {
+		LOG_ERR("Can't open %s", uf->tmp);
+		return 1;
+	}
+
+	/* script and config updates never overlap a firmware download */
+	memset(&file_stats, 0, sizeof(file_stats));
+	file_stats.start = k_uptime_get_32();
+	file_fill = 0;
+
+	return 0;
+}
+
+static int file_flush(void)
+{
+	if (file_fill == 0) {
+		return 0;
+	}
+
+	if (fs_write(&file, page_buf, file_fill) != file_fill) {
+		LOG_ERR("Failed to write file");
+		return 1;
+	}
+	file_stats.write_calls++;
+	file_fill = 0;
+
+	return 0;
+}
+
+static int store_file(u8_t *buf, u16_t len)
+{
+	u32_t chunk;
+
+	file_stats.bytes += len;
+
+	while (len > 0) {
+		chunk = MIN(len, sizeof(page_buf) - file_fill);
+		memcpy(page_buf + file_fill, buf, chunk);
+		file_fill += chunk;
+		buf += chunk;
+		len -= chunk;
+
+		if (file_fill == sizeof(page_buf) && file_flush()) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void ota_file_abort(int artifact)
+{
+	fs_close(&file);
+	fs_unlink(user_files[artifact].tmp);
+}
+
+/* the parent router may have served a bad copy, don't ask it again */
+static void ota_digest_failed(const char *ver)
+{
+#ifdef CONFIG_DEGU_OTA_PROXY
+	strncpy(proxy_rejected, ver, sizeof(proxy_rejected) - 1);
+#endif
+}
+
+static int ota_file_commit(int artifact, const char *ver)
+{
+	const struct user_file *uf = &user_files[artifact];
+	char md5[33];
+	int err;
+
+	/* the only sync of the whole transfer */
+	err = file_flush();
+	if (!err) {
+		err = fs_sync(&file);
+	}
+	fs_close(&file);
+
+	LOG_INF("%s: %d bytes, %d writes, 1 sync, %d ms (per-block sync: %d)",
+		uf->path, file_stats.bytes, file_stats.write_calls,
+		k_uptime_get_32() - file_stats.start,
+		DIV_ROUND_UP(file_stats.bytes, OTA_BLOCK_SIZE));
+
+	if (err) {
+		LOG_ERR("Failed to sync %s", uf->tmp);
+		goto abort;
+	}
+
+	if (user_sum(uf->tmp, md5) || strcmp(md5, ver) != 0) {
+		LOG_ERR("%s md5sum %s, expected %s", uf->tmp, md5, ver);
+		ota_digest_failed(ver);
+		goto abort;
+	}
+
+	if (!fs_stat(uf->bak, &dirent)) {
+		fs_unlink(uf->bak);
+	}
+
+	if (!fs_stat(uf->path, &dirent) && fs_rename(uf->path, uf->bak)) {
+		LOG_ERR("Can't keep %s", uf->path);
+		goto abort;
+	}
+
+	if (fs_rename(uf->tmp, uf->path)) {
+		LOG_ERR("Can't rename %s", uf->tmp);
+		return 1;
+	}
+
+	if (artifact == ARTIFACT_SCRIPT_USER && !fs_stat(uf->bak, &dirent)) {
+		script_trial_mark();
+	}
+
+	return 0;
+
+abort:
+	fs_unlink(uf->tmp);
+	return 1;
+}
+
+/* finish a replacement interrupted between the two renames */
+static void ota_file_recover(void)
+{
+	const struct user_file *uf;
+	struct fs_dirent entry;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(user_files); i++) {
+		uf = &user_files[i];
+		if (fs_stat(uf->path, &entry) && !fs_stat(uf->bak, &entry)) {
+			LOG_INF("Restoring %s", uf->path);
+			fs_rename(uf->bak, uf->path);
+		}
+		if (!fs_stat(uf->tmp, &entry)) {
+			fs_unlink(uf->tmp);
+		}
+	}
+
+	if (!fs_stat(SCRIPT_REJ_PATH, &entry)) {
+		fs_unlink(SCRIPT_REJ_PATH);
+	}
+}
+
+/* read and clear the reset reason, the register accumulates */
+static void boot_cause_load(void)
+{
+	u32_t reas = nrf_power_resetreas_get();
+
+	nrf_power_resetreas_clear(reas);
+
+	boot_crashed = (reas & (NRF_POWER_RESETREAS_DOG_MASK |
+				NRF_POWER_RESETREAS_LOCKUP_MASK)) ||
+		       ((reas & NRF_POWER_RESETREAS_SREQ_MASK) &&
+			reboot_intended != REBOOT_INTENDED_MAGIC);
+	reboot_intended = 0;
+
+	LOG_INF("Reset reason %x%s", reas, boot_crashed ? ", crashed" : "");
+}
+
+/* reboot without counting a boot of the script on trial */
+void degu_ota_reboot(void)
+{
+	reboot_intended = REBOOT_INTENDED_MAGIC;
+	sys_reboot(SYS_REBOOT_COLD);
+}
+
+/* check the image header in the first block */
+static int check_image_header(u8_t *buf, u16_t len)
+{
+	struct image_header hdr;
+
+	if (len < sizeof(hdr)) {
+		return 1;
+	}
+	memcpy(&hdr, buf, sizeof(hdr));
+
+	if (hdr.ih_magic != IMAGE_MAGIC) {
+		LOG_ERR("Bad image magic: %x", hdr.ih_magic);
+		return 1;
+	}
+
+	ota_progress.image_size = hdr.ih_img_size + FIRMWARE_OVERHEAD;
+	if (ota_progress.image_size > SLOT1_TRAILER_OFFS) {
+		LOG_ERR("Image too large: %d", ota_progress.image_size);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int store_firmware(u8_t *buf, u16_t len)
+{
+	if (ota_write_err) {
+		return 1;
+	}
+
+	if (byte_written == 0 && check_image_header(buf, len)) {
+		ota_write_err = true;
+		return 1;
+	}
+
+	if (byte_written + len > ota_progress.image_size) {
+		LOG_ERR("Image larger than its header: %d", byte_written + len);
+		ota_write_err = true;
+		return 1;
+	}
+
+	/* the progress record is saved when a page completes */
+	mbedtls_md5_update_ret(&ota_progress.md5, buf, len);
+	byte_written += len;
+	ota_progress.block++;
+
+	if (slot1_write(buf, len)) {
+		ota_write_err = true;
+		return 1;
+	}
+	LOG_DBG("Received: %d", byte_written);
+
+	return 0;
+}
+
+/*
+ * OTA pipeline: the thread running degu_coap_request() copies each block
+ * into a buffer from a small pool, and the storage thread drains the
+ * buffers to slot-1 or the file system. The network thread blocks when
+ * every buffer is in use.
+ */
+static void ota_storage_thread(void *p1, void *p2, void *p3)
+{
+	struct ota_pipe_buf *pbuf;
+	u32_t start;
+
+	while (1) {
+		start = k_uptime_get_32();
+		k_msgq_get(&ota_pipe_q, &pbuf, K_FOREVER);
+		ota_pipe_stats.storage_wait_ms += k_uptime_get_32() - start;
+
+		if (pbuf == NULL) {
+			/* end of transfer */
+			k_sem_give(&ota_pipe_done);
+			continue;
+		}
+
+		start = k_uptime_get_32();
+		if (!atomic_get(&ota_pipe_err) && ota_pipe_sink(pbuf->data, pbuf->len)) {
+			atomic_set(&ota_pipe_err, 1);
+		}
+		ota_pipe_stats.storage_busy_ms += k_uptime_get_32() - start;
+
+		k_mem_slab_free(&ota_pipe_slab, (void **)&pbuf);
+	}
+}
+
+K_THREAD_DEFINE(ota_storage_tid, OTA_STORAGE_STACK_SIZE, ota_storage_thread,
+		NULL, NULL, NULL, OTA_STORAGE_PRIORITY, 0, K_NO_WAIT);
+
+static void ota_pipe_start(int (*sink)(u8_t *, u16_t))
+{
+	memset(&ota_pipe_stats, 0, sizeof(ota_pipe_stats));
+	atomic_set(&ota_pipe_err, 0);
+	ota_pipe_sink = sink;
+	ota_pipe_start_time = k_uptime_get_32();
+}
+
+/* degu_coap_request() callback, a non-zero return aborts the transfer */
+static int ota_pipe_write(u8_t *buf, u16_t len)
+{
+	struct ota_pipe_buf *pbuf;
+	u32_t start;
+
+	if (atomic_get(&ota_pipe_err) || len > OTA_BLOCK_SIZE) {
+		atomic_set(&ota_pipe_err, 1);
+		return 1;
+	}
+
+	start = k_uptime_get_32();
+	k_mem_slab_alloc(&ota_pipe_slab, (void **)&pbuf, K_FOREVER);
+	ota_pipe_stats.net_wait_ms += k_uptime_get_32() - start;
+
+	/* the storage thread may have failed while every buffer was in use */
+	if (atomic_get(&ota_pipe_err)) {
+		k_mem_slab_free(&ota_pipe_slab, (void **)&pbuf);
+		return 1;
+	}
+
+	memcpy(pbuf->data, buf, len);
+	pbuf->len = len;
+	k_msgq_put(&ota_pipe_q, &pbuf, K_FOREVER);
+
+	return 0;
+}
+
+/**
+ * wait until the storage thread has drained every buffer.
+ * @return	0:success, 1:a block could not be stored
+ */
+static int ota_pipe_finish(void)
+{
+	struct ota_pipe_buf *end = NULL;
+	u32_t elapsed;
+
+	k_msgq_put(&ota_pipe_q, &end, K_FOREVER);
+	k_sem_take(&ota_pipe_done, K_FOREVER);
+
+	elapsed = k_uptime_get_32() - ota_pipe_start_time;
+	LOG_INF("pipeline: %d ms, net busy %d wait %d, storage busy %d wait %d",
+		elapsed, elapsed - ota_pipe_stats.net_wait_ms,
+		ota_pipe_stats.net_wait_ms, ota_pipe_stats.storage_busy_ms,
+		ota_pipe_stats.storage_wait_ms);
+
+	return atomic_get(&ota_pipe_err) ? 1 : 0;
+}
+
+/**
+ * compare the digest of the downloaded image with the desired version.
+ * @return	0:match, 1:mismatch
+ */
+static int verify_firmware(const char *ver)
+{
+	mbedtls_md5_context md5;
+	unsigned char output[16];
+	char md5_hex[33];
+
+	if (byte_written != ota_progress.image_size) {
+		LOG_ERR("Image size %d, expected %d", byte_written, ota_progress.image_size);
+		ota_digest_failed(ver);
+		return 1;
+	}
+
+	mbedtls_md5_init(&md5);
+	mbedtls_md5_clone(&md5, &ota_progress.md5);
+	mbedtls_md5_finish_ret(&md5, output);
+	mbedtls_md5_free(&md5);
+	md5_to_hex(output, md5_hex);
+
+	if (strcmp(md5_hex, ver) != 0) {
+		LOG_ERR("Image md5sum %s, expected %s", md5_hex, ver);
+		ota_digest_failed(ver);
+		return 1;
+	}
+
+	return 0;
+}
+
+void write_img_magic() {
+	/* slot-1 is not erased up front, so the trailer has to be */
+	if (byte_written <= SLOT1_TRAILER_OFFS) {
+		flash_write_protection_set(flash_dev, false);
+		flash_erase(flash_dev, DT_FLASH_AREA_IMAGE_1_OFFSET + SLOT1_TRAILER_OFFS,
+			    SLOT1_PAGE_SIZE);
+		flash_write_protection_set(flash_dev, true);
+	}
+	write_flash_slot1(BOOT_MAGIC_OFFS, boot_img_magic, BOOT_MAGIC_SZ);
+}
+
+/* ask the gateway to prepare an artifact, not needed with a manifest */
+static int ota_prepare(int artifact, char *request_url)
+{
+	const char *path = ota_artifacts[artifact].uri;
+
+	if (degu_coap_request(path, COAP_METHOD_PUT, "", NULL) < COAP_RESPONSE_CODE_OK) {
+		return 1;
+	}
+
+	if (degu_coap_request(path, COAP_METHOD_POST, request_url, NULL) < COAP_RESPONSE_CODE_OK) {
+		return 1;
+	}
+
+	return 0;
+}
+
+#ifdef CONFIG_DEGU_OTA_MCAST
+/*
+ * Multicast firmware session: blocks announced to the mesh are written to
+ * slot-1 in any order and recorded in a bitmap. The missing ones are
+ * fetched over unicast by do_update() once the desired version matches.
+ */
+#define MCAST_MAX_BLOCKS	(SLOT1_TRAILER_OFFS / OTA_BLOCK_SIZE)
+
+static struct mcast_session {
+	u32_t id;
+	u32_t image_size;
+	u32_t blocks;
+	u32_t received;
+	u32_t repaired;
+	char ver[33];
+	bool active;
+	bool ended;
+	u8_t map[DIV_ROUND_UP(MCAST_MAX_BLOCKS, 8)];
+} mcast;
+
+static K_MUTEX_DEFINE(mcast_lock);
+static u32_t mcast_repair_block;
+
+/*
+ * Announces are not authenticated: only a session for the firmware the
+ * last shadow or manifest desired is joined, and at most one every
+ * MCAST_REJOIN_INTERVAL, each join erasing slot-1. Both under ota_lock.
+ */
+#define MCAST_REJOIN_INTERVAL	K_MINUTES(10)
+
+static char mcast_desired_ver[33];
+static s64_t mcast_joined_at;
+static bool mcast_joined;
+
+static bool mcast_has(u32_t block)
+{
+	return mcast.map[block / 8] & BIT(block % 8);
+}
+
+/* the caller holds ota_lock and mcast_lock */
+static int mcast_store(u32_t block, const u8_t *data, u16_t len)
+{
+	static u8_t buf[OTA_BLOCK_SIZE] __aligned(4);
+	u32_t expect;
+
+	if (block >= mcast.blocks) {
+		LOG_ERR("multicast block %d past the image", block);
+		return 1;
+	}
+
+	expect = MIN(OTA_BLOCK_SIZE, mcast.image_size - block * OTA_BLOCK_SIZE);
+	if (len != expect) {
+		LOG_ERR("multicast block %d: %d bytes, expected %d", block, len, expect);
+		return 1;
+	}
+
+	memset(buf, 0xff, sizeof(buf));
+	memcpy(buf, data, len);
+	if (write_flash_slot1(block * OTA_BLOCK_SIZE, buf,
+			      ROUND_UP(len, SLOT1_WRITE_ALIGN))) {
+		return 1;
+	}
+
+	mcast.map[block / 8] |= BIT(block % 8);
+	mcast.received++;
+
+	return 0;
+}
+
+/**
+ * join the firmware session announced by the gateway.
+ * @return	0:blocks of this session are wanted, 1:ignore the session
+ */
+int degu_ota_mcast_announce(u32_t id, const char *ver, u32_t image_size)
+{
+	int ret = 1;
+
+	/* a unicast download or an update check owns slot-1 */
+	if (k_mutex_lock(&ota_lock, K_NO_WAIT)) {
+		return 1;
+	}
+	k_mutex_lock(&mcast_lock, K_FOREVER);
+
+	if (mcast.active && mcast.id == id) {
+		ret = 0;
+		goto end;
+	}
+
+	/* a verified image is waiting in slot-1 for the reboot */
+	if (ota_update_pending && ota_firmware_updated) {
+		goto end;
+	}
+
+	if (image_size == 0 || image_size > SLOT1_TRAILER_OFFS) {
+		LOG_ERR("multicast image size %d", image_size);
+		goto end;
+	}
+
+	if (!flash_dev) {
+		flash_dev = device_get_binding(DT_FLASH_DEV_NAME);
+	}
+	if (firmware_system_ver[0] == '\0') {
+		firmware_sum(firmware_system_ver);
+	}
+	if (!strcmp(ver, firmware_system_ver)) {
+		goto end;
+	}
+	if (mcast_desired_ver[0] == '\0' || strcmp(ver, mcast_desired_ver)) {
+		LOG_DBG("multicast firmware %s is not desired", ver);
+		goto end;
+	}
+	if (mcast_joined &&
+	    k_uptime_get() - mcast_joined_at < MCAST_REJOIN_INTERVAL) {
+		LOG_WRN("multicast session %x announced too soon", id);
+		goto end;
+	}
+
+	LOG_INF("Joining multicast session %x, firmware %s", id, ver);
+	mcast_joined = true;
+	mcast_joined_at = k_uptime_get();
+	memset(&mcast, 0, sizeof(mcast));
+	mcast.id = id;
+	mcast.image_size = image_size;
+	mcast.blocks = DIV_ROUND_UP(image_size, OTA_BLOCK_SIZE);
+	strncpy(mcast.ver, ver, sizeof(mcast.ver) - 1);
+
+	/* slot-1 is replaced, a unicast resume record no longer applies */
+	ota_progress_clear();
+
+	/* blocks can arrive in any order, erase the whole image first */
+	slot1_ready_end = 0;
+	flash_write_protection_set(flash_dev, false);
+	if (slot1_erase_to(image_size)) {
+		flash_write_protection_set(flash_dev, true);
+		goto end;
+	}
+	flash_write_protection_set(flash_dev, true);
+
+	mcast.active = true;
+	ret = 0;
+
+end:
+	k_mutex_unlock(&mcast_lock);
+	k_mutex_unlock(&ota_lock);
+	return ret;
+}
+
+void degu_ota_mcast_block(u32_t id, u32_t block, const u8_t *data, u16_t len)
+{
+	/* slot-1 is written under ota_lock, a block missed here is repaired */
+	if (k_mutex_lock(&ota_lock, K_NO_WAIT)) {
+		return;
+	}
+	k_mutex_lock(&mcast_lock, K_FOREVER);
+	if (mcast.active && mcast.id == id && block < mcast.blocks &&
+	    !mcast_has(block) && mcast_store(block, data, len) == 0 &&
+	    mcast.received == mcast.blocks) {
+		LOG_INF("Multicast session %x complete", id);
+		mcast.ended = true;
+		degu_ota_request_check();
+	}
+	k_mutex_unlock(&mcast_lock);
+	k_mutex_unlock(&ota_lock);
+}
+
+/* the sender is done or silent, repair the rest over unicast */
+void degu_ota_mcast_end(u32_t id)
+{
+	k_mutex_lock(&mcast_lock, K_FOREVER);
+	if (mcast.active && mcast.id == id && !mcast.ended) {
+		LOG_INF("Multicast session %x: %d of %d blocks", id,
+			mcast.received, mcast.blocks);
+		mcast.ended = true;
+		degu_ota_request_check();
+	}
+	k_mutex_unlock(&mcast_lock);
+}
+
+/* degu_coap_request() callback, stops at the first block already present */
+static int mcast_repair_write(u8_t *buf, u16_t len)
+{
+	/* the upstream artifact is longer than the announced image */
+	if (mcast_repair_block >= mcast.blocks) {
+		LOG_ERR("Repair past the multicast image");
+		ota_write_err = true;
+		return 1;
+	}
+
+	if (mcast_store(mcast_repair_block, buf, len)) {
+		ota_write_err = true;
+		return 1;
+	}
+	mcast.repaired++;
+	mcast_repair_block++;
+
+	/* the next block came over multicast, the next GET skips it */
+	if (mcast_repair_block == mcast.blocks || mcast_has(mcast_repair_block)) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * finish the multicast session of the given firmware version.
+ * @return	0:slot-1 holds the verified image, 1:failed, -1:not a session
+ *		of this version, -EAGAIN:the session is still running
+ */
+static int ota_mcast_finish(const char *ver, char *request_url)
+{
+	bool prepared = manifest_used;
+	struct image_header hdr;
+	u32_t block;
+	int err;
+	int ret = 1;
+
+	k_mutex_lock(&mcast_lock, K_FOREVER);
+	if (!mcast.active || strcmp(mcast.ver, ver) != 0) {
+		/* a unicast download takes slot-1 over */
+		mcast.active = false;
+		k_mutex_unlock(&mcast_lock);
+		return -1;
+	}
+
+	if (!mcast.ended) {
+		k_mutex_unlock(&mcast_lock);
+		return -EAGAIN;
+	}
+
+	ota_write_err = false;
+	for (block = 0; block < mcast.blocks; block++) {
+		if (mcast_has(block)) {
+			continue;
+		}
+
+		if (!prepared && ota_prepare(ARTIFACT_FIRMWARE_SYSTEM, request_url)) {
+			goto end;
+		}
+		prepared = true;
+
+		mcast_repair_block = block;
+		memset(payload, 0, 1024);
+		err = degu_coap_get(ota_artifacts[ARTIFACT_FIRMWARE_SYSTEM].uri,
+				    block * OTA_BLOCK_SIZE, payload, &mcast_repair_write);
+		if (ota_write_err ||
+		    (err < COAP_RESPONSE_CODE_OK && mcast_repair_block == block)) {
+			LOG_ERR("Failed to repair block %d", block);
+			goto end;
+		}
+		block = mcast_repair_block - 1;
+	}
+
+	if (mcast.received != mcast.blocks) {
+		goto end;
+	}
+
+	LOG_INF("multicast: %d blocks, %d repaired over unicast",
+		mcast.blocks, mcast.repaired);
+
+	memcpy(&hdr, (const void *)DT_FLASH_AREA_IMAGE_1_OFFSET, sizeof(hdr));
+	if (hdr.ih_magic != IMAGE_MAGIC ||
+	    hdr.ih_img_size + FIRMWARE_OVERHEAD != mcast.image_size) {
+		LOG_ERR("Bad multicast image header");
+		goto end;
+	}
+
+	if (strcmp(md5sum((char *)DT_FLASH_AREA_IMAGE_1_OFFSET, mcast.image_size), ver)) {
+		LOG_ERR("Multicast image md5sum mismatch");
+		goto end;
+	}
+
+	byte_written = mcast.image_size;
+	ret = 0;
+end:
+	mcast.active = false;
+	k_mutex_unlock(&mcast_lock);
+	return ret;
+}
+#endif /* CONFIG_DEGU_OTA_MCAST */
+
+/**
+ * GET an artifact from the given block on, through the cache of the parent
+ * router when there is one. The digest is checked by the caller either way.
+ * @return	CoAP response code
+ */
+static int ota_fetch(int artifact, const char *ver, u32_t block,
+		     int (*callback)(u8_t *, u16_t))
+{
+#ifdef CONFIG_DEGU_OTA_PROXY
+	bool more = true;
+	u16_t len;
+
+	while (more && strcmp(ver, proxy_rejected) != 0 &&
+	       degu_proxy_get(ver, ota_artifacts[artifact].uri, block,
+			      payload, &len, &more) == 0) {
+		if (callback(payload, len)) {
+			return COAP_FAILED_TO_RECEIVE_RESPONSE;
+		}
+		block++;
+	}
+
+	if (!more) {
+		return COAP_RESPONSE_CODE_CONTENT;
+	}
+
+	if (block > 0) {
+		LOG_INF("Getting %s from block %d from the gateway",
+			artifact_names[artifact], block);
+	}
+#endif
+
+	memset(payload, 0, 1024);
+	return degu_coap_get(ota_artifacts[artifact].uri, block * OTA_BLOCK_SIZE,
+			     payload, callback);
+}
+
+static int ota_update_file(int artifact, const char *ver)
+{
+	int err;
+
+	if (ota_file_open(artifact)) {
+		return 1;
+	}
+
+	ota_pipe_start(store_file);
+	err = ota_fetch(artifact, ver, 0, &ota_pipe_write);
+	if (ota_pipe_finish() || err < COAP_RESPONSE_CODE_OK) {
+		ota_file_abort(artifact);
+		return 1;
+	}
+
+	return ota_file_commit(artifact, ver);
+}
+
+int do_update(void)
+{
+	char request_url[1024];
+	bool firmware_done = false;
+	int err;
+
+	memset(request_url, 0, 1024);
+
+	json_obj_encode_buf(desired_descr, ARRAY_SIZE(desired_descr),
+		&shadow_recv.state.desired, request_url, sizeof(request_url));
+
+	k_mutex_lock(&ota_lock, K_FOREVER);
+	degu_coap_session_open();
+
+	if (update_flag_script_user) {
+		if (!manifest_used && ota_prepare(ARTIFACT_SCRIPT_USER, request_url)) {
+			goto error;
+		}
+
+		if (ota_update_file(ARTIFACT_SCRIPT_USER, shadow_recv.state.desired.script_user_ver)) {
+			goto error;
+		}
+	}
+
+	if (update_flag_config_user) {
+		if (!manifest_used && ota_prepare(ARTIFACT_CONFIG_USER, request_url)) {
+			goto error;
+		}
+
+		if (ota_update_file(ARTIFACT_CONFIG_USER, shadow_recv.state.desired.config_user_ver)) {
+			goto error;
+		}
+	}
+
+#ifdef CONFIG_DEGU_OTA_MCAST
+	if (update_flag_firmware_system) {
+		err = ota_mcast_finish(shadow_recv.state.desired.firmware_system_ver,
+				       request_url);
+		if (err == -EAGAIN) {
+			/* checked again when the multicast session ends */
+			LOG_INF("Waiting for the multicast session");
+			update_flag_firmware_system = false;
+			if (!update_flag_script_user && !update_flag_config_user) {
+				goto error;
+			}
+		} else if (err == 0) {
+			write_img_magic();
+			firmware_done = true;
+		} else if (err > 0) {
+			goto error;
+		}
+	}
+#endif
+
+	if (update_flag_firmware_system && !firmware_done) {
+		if (!manifest_used && ota_prepare(ARTIFACT_FIRMWARE_SYSTEM, request_url)) {
+			goto error;
+		}
+
+		if (ota_artifacts[ARTIFACT_FIRMWARE_SYSTEM].size > SLOT1_TRAILER_OFFS) {
+			LOG_ERR("Firmware too large: %d", ota_artifacts[ARTIFACT_FIRMWARE_SYSTEM].size);
+			goto error;
+		}
+
+		if (ota_firmware_begin(shadow_recv.state.desired.firmware_system_ver)) {
+			goto error;
+		}
+
+		ota_pipe_start(store_firmware);
+		err = ota_fetch(ARTIFACT_FIRMWARE_SYSTEM,
+				shadow_recv.state.desired.firmware_system_ver,
+				byte_written / OTA_BLOCK_SIZE, &ota_pipe_write);
+		if (ota_pipe_finish()) {
+			ota_write_err = true;
+		}
+		slot1_end(err >= COAP_RESPONSE_CODE_OK);
+		if (ota_write_err) {
+			/* inconsistent image, start over next time */
+			ota_progress_clear();
+			goto error;
+		}
+
+		if (err < COAP_RESPONSE_CODE_OK) {
+			goto error;
+		}
+
+		if (verify_firmware(shadow_recv.state.desired.firmware_system_ver)) {
+			ota_progress_clear();
+			goto error;
+		}
+
+		write_img_magic();
+		ota_progress_clear();
+	}
+
+	degu_coap_session_close();
+	k_mutex_unlock(&ota_lock);
+	return DEGU_OTA_OK;
+
+error:
+	degu_coap_session_close();
+	k_mutex_unlock(&ota_lock);
+	return DEGU_OTA_ERR;
+}
+
+static void ota_artifacts_reset(void)
+{
+	int i;
+
+	memset(ota_artifacts, 0, sizeof(ota_artifacts));
+	for (i = 0; i < ARTIFACT_NUM; i++) {
+		snprintf(ota_artifacts[i].uri, sizeof(ota_artifacts[i].uri),
+			 "update/%s", artifact_names[i]);
+	}
+}
+
+static int compare_desired(void)
+{
+	int diff;
+	int ret = DEGU_OTA_ERR;
+
+	if (shadow_recv.state.desired.script_user_ver != NULL) {
+		diff = strcmp(shadow_recv.state.desired.script_user_ver,
+				shadow_send.state.reported.script_user_ver);
+		if (diff && !strcmp(shadow_recv.state.desired.script_user_ver,
+				    script_sel.rejected)) {
+			LOG_WRN("Script %s has been rolled back, not updating",
+				script_sel.rejected);
+		} else if (diff) {
+			update_flag_script_user = true;
+			ret = DEGU_OTA_OK;
+		}
+	}
+	if (shadow_recv.state.desired.config_user_ver != NULL) {
+		diff = strcmp(shadow_recv.state.desired.config_user_ver,
+				shadow_send.state.reported.config_user_ver);
+		if (diff) {
+			update_flag_config_user = true;
+			ret = DEGU_OTA_OK;
+		}
+	}
+	mcast_desired_ver[0] = '\0';
+	if (shadow_recv.state.desired.firmware_system_ver != NULL) {
+		diff = strcmp(shadow_recv.state.desired.firmware_system_ver,
+				shadow_send.state.reported.firmware_system_ver);
+		if (diff) {
+			update_flag_firmware_system = true;
+			ret = DEGU_OTA_OK;
+			strncpy(mcast_desired_ver,
+				shadow_recv.state.desired.firmware_system_ver,
+				sizeof(mcast_desired_ver) - 1);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * get every pending artifact in a single request.
+ * @return	DEGU_OTA_OK:update available, DEGU_OTA_ERR:none or failed,
+ *		-1:the gateway serves no manifest (4.04)
+ */
+static int check_manifest(void)
+{
+	struct manifest manifest;
+	struct manifest_artifact *desc;
+	struct ota_artifact *artifact;
+	char **desired_ver[ARTIFACT_NUM] = {
+		&shadow_recv.state.desired.script_user_ver,
+		&shadow_recv.state.desired.config_user_ver,
+		&shadow_recv.state.desired.firmware_system_ver,
+	};
+	int code;
+	int i, j;
+
+	memset(payload, 0, MAX_COAP_MSG_LEN);
+	code = degu_coap_request("update/manifest", COAP_METHOD_GET, payload, NULL);
+	if (code == COAP_RESOURCE_NOT_FOUND) {
+		return -1;
+	} else if (code < COAP_RESPONSE_CODE_OK) {
+		/* the gateway is unreachable, update/status would time out too */
+		return DEGU_OTA_ERR;
+	}
+
+	memset(&manifest, 0, sizeof(manifest));
+	if (json_obj_parse(payload, strlen(payload), manifest_descr,
+			   ARRAY_SIZE(manifest_descr), &manifest) < 0) {
+		LOG_ERR("Invalid update manifest");
+		return -1;
+	}
+
+	memset(&shadow_recv, 0, sizeof(shadow_recv));
+	ota_artifacts_reset();
+
+	for (i = 0; i < manifest.artifacts_len; i++) {
+		desc = &manifest.artifacts[i];
+		if (desc->name == NULL || desc->ver == NULL) {
+			continue;
+		}
+
+		for (j = 0; j < ARTIFACT_NUM; j++) {
+			if (!strcmp(desc->name, artifact_names[j])) {
+				break;
+			}
+		}
+		if (j == ARTIFACT_NUM) {
+			LOG_INF("Unknown artifact: %s", desc->name);
+			continue;
+		}
+
+		/* a truncated uri would fetch another resource */
+		if (desc->uri != NULL && strlen(desc->uri) >= sizeof(ota_artifacts[j].uri)) {
+			LOG_ERR("%s: uri too long: %s", desc->name, desc->uri);
+			continue;
+		}
+
+		artifact = &ota_artifacts[j];
+		strncpy(artifact->ver, desc->ver, sizeof(artifact->ver) - 1);
+		if (desc->uri != NULL) {
+			strcpy(artifact->uri, desc->uri);
+		}
+		artifact->size = desc->size;
+		*desired_ver[j] = artifact->ver;
+	}
+
+	manifest_used = true;
+
+	return compare_desired();
+}
+
+static int check_status(void)
+{
+	if (degu_coap_request("update/status", COAP_METHOD_PUT, "", NULL) < COAP_RESPONSE_CODE_OK) {
+		return DEGU_OTA_ERR;
+	}
+
+	memset(payload, 0, 1024);
+	if (degu_coap_request("update/status", COAP_METHOD_GET, payload, NULL) < COAP_RESPONSE_CODE_OK) {
+		return DEGU_OTA_ERR;
+	}
+
+	if (!payload) {
+		return DEGU_OTA_ERR;
+	}
+
+	json_obj_parse(payload, strlen(payload), shadow_recv_descr,
+			ARRAY_SIZE(shadow_recv_descr), &shadow_recv);
+
+	ota_artifacts_reset();
+	manifest_used = false;
+
+	return compare_desired();
+}
+
+int check_update(void)
+{
+	int ret;
+
+	k_mutex_lock(&ota_lock, K_FOREVER);
+	degu_coap_session_open();
+
+	update_flag_script_user = false;
+	update_flag_config_user = false;
+	update_flag_firmware_system = false;
+
+	/* the reported state is needed to compare with */
+	if (!ota_initialized) {
+		ota_initialized = update_init() == DEGU_OTA_OK;
+	}
+
+	if (!ota_initialized) {
+		ret = DEGU_OTA_ERR;
+	} else {
+		ret = check_manifest();
+		if (ret < 0) {
+			/* the gateway does not serve a manifest */
+			ret = check_status();
+		}
+	}
+
+	degu_coap_session_close();
+	k_mutex_unlock(&ota_lock);
+
+	return ret;
+}
+
+static void ota_check(void)
+{
+	k_mutex_lock(&ota_lock, K_FOREVER);
+	degu_coap_session_open();
+
+	if (check_update() == DEGU_OTA_OK) {
+		LOG_INF("Trying to update...");
+		if (do_update() == DEGU_OTA_OK) {
+			ota_firmware_updated = update_flag_firmware_system;
+			ota_update_pending = true;
+		}
+	}
+
+	degu_coap_session_close();
+	k_mutex_unlock(&ota_lock);
+}
+
+static void ota_check_thread(void *p1, void *p2, void *p3)
+{
+	s32_t interval = CONFIG_DEGU_OTA_CHECK_INTERVAL ?
+		K_SECONDS(CONFIG_DEGU_OTA_CHECK_INTERVAL) : K_FOREVER;
+
+	if (!IS_ENABLED(CONFIG_DEGU_OTA_CHECK_BOOT)) {
+		k_sem_take(&ota_check_sem, interval);
+	}
+
+	while (1) {
+		ota_check();
+		if (!ota_update_pending) {
+			k_sem_take(&ota_check_sem, interval);
+			continue;
+		}
+
+		LOG_INF("Update is ready, waiting for a safe point");
+		k_sem_take(&ota_safe_sem, CONFIG_DEGU_OTA_REBOOT_TIMEOUT ?
+			   K_SECONDS(CONFIG_DEGU_OTA_REBOOT_TIMEOUT) : K_FOREVER);
+
+		if (ota_firmware_updated || ota_vm_state == OTA_VM_NONE) {
+			degu_ota_reboot();
+		}
+
+		if (ota_vm_state == OTA_VM_RUNNING) {
+			/* timed out, stop the script like CTRL-C */
+			mp_keyboard_interrupt();
+			if (k_sem_take(&ota_safe_sem, OTA_STOP_TIMEOUT)) {
+				/* KeyboardInterrupt was caught, the files are in place */
+				LOG_WRN("Script did not stop, rebooting");
+				degu_ota_reboot();
+			}
+		}
+
+		/* script and config only, restart the VM instead of rebooting */
+		ota_update_pending = false;
+		ota_initialized = false;
+		script_trial_begin(false);
+		ota_vm_state = OTA_VM_RUNNING;
+		k_sem_give(&ota_restart_sem);
+	}
+}
+
+K_THREAD_DEFINE(ota_check_tid, CONFIG_DEGU_OTA_THREAD_STACK_SIZE,
+		ota_check_thread, NULL, NULL, NULL,
+		CONFIG_DEGU_OTA_THREAD_PRIORITY, 0, K_FOREVER);
+
+void degu_ota_start(void)
+{
+	boot_cause_load();
+	ota_file_recover();
+	k_delayed_work_init(&script_health_work, script_health_handler);
+	script_sel_load();
+	script_trial_begin(true);
+	k_thread_start(ota_check_tid);
+#ifdef CONFIG_DEGU_OTA_MCAST
+	degu_mcast_start();
+#endif
+}
+
+/* keep the script on trial, from degu.confirm() and the health check */
+void degu_ota_confirm(void)
+{
+	k_mutex_lock(&script_lock, K_FOREVER);
+	if (script_sel.state == SCRIPT_TRIAL) {
+		LOG_INF("Script confirmed");
+		k_delayed_work_cancel(&script_health_work);
+		script_sel.state = SCRIPT_CONFIRMED;
+		script_sel_save();
+	}
+	k_mutex_unlock(&script_lock);
+}
+
+/**
+ * called by main() when the user script has ended.
+ * @param	status	0:ended normally, otherwise an exception was raised
+ */
+void degu_ota_script_exited(int status)
+{
+	if (status == 0) {
+		degu_ota_confirm();
+		return;
+	}
+
+	/* stopped for an update, which starts a trial of its own */
+	if (ota_update_pending) {
+		return;
+	}
+
+	script_rolled_back = script_trial_rollback();
+}
+
+/* wake the update thread for an extra check */
+void degu_ota_request_check(void)
+{
+	k_sem_give(&ota_check_sem);
+}
+
+bool degu_ota_update_pending(void)
+{
+	return ota_update_pending;
+}
+
+/* nothing is running that a reboot would interrupt, from now on */
+void degu_ota_safe_point(void)
+{
+	ota_vm_state = OTA_VM_NONE;
+	k_sem_give(&ota_safe_sem);
+}
+
+/**
+ * called by main() after the user script has ended.
+ * Blocks until a script or config update asks to run the script again.
+ * @return	true:restart the script
+ */
+bool degu_ota_wait_restart(void)
+{
+	if (script_rolled_back) {
+		script_rolled_back = false;
+		return true;
+	}
+
+	ota_vm_state = OTA_VM_WAITING;
+	k_sem_give(&ota_safe_sem);
+	k_sem_take(&ota_restart_sem, K_FOREVER);
+
+	return true;
+}
+
+/**
+ * apply a downloaded update from the user script.
+ * @return	true:the script must exit for the VM to be restarted
+ */
+bool degu_ota_apply(void)
+{
+	if (!ota_update_pending) {
+		return false;
+	}
+
+	if (ota_firmware_updated) {
+		k_sem_give(&ota_safe_sem);
+		return false;
+	}
+
+	return true;
+}
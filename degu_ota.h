@@ -28,3 +28,17 @@
 int update_init(void);
 int check_update(void);
 int do_update(void);
+
+void degu_ota_start(void);
+void degu_ota_request_check(void);
+bool degu_ota_update_pending(void);
+void degu_ota_safe_point(void);
+bool degu_ota_wait_restart(void);
+bool degu_ota_apply(void);
+void degu_ota_confirm(void);
+void degu_ota_script_exited(int status);
+void degu_ota_reboot(void);
+
+int degu_ota_mcast_announce(u32_t id, const char *ver, u32_t image_size);
+void degu_ota_mcast_block(u32_t id, u32_t block, const u8_t *data, u16_t len);
+void degu_ota_mcast_end(u32_t id);
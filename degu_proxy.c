@@ -0,0 +1,487 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <zephyr.h>
+#include <stdio.h>
+#include <string.h>
+#include <flash.h>
+#include <net/socket.h>
+#include <net/net_if.h>
+#include <net/net_ip.h>
+#include <net/coap.h>
+#include <net/openthread.h>
+#include <openthread/thread.h>
+#include <logging/log.h>
+#include "mbedtls/md5.h"
+#include "zcoap.h"
+#include "degu_utils.h"
+#include "degu_proxy.h"
+
+LOG_MODULE_REGISTER(degu_proxy);
+
+/*
+ * OTA block cache of ROUTER_ONLY builds.
+ *
+ * Children POST "<digest> <path>" to "ota" on their parent router, with a
+ * Block2 option for the block they want. CoAP options are limited to 12
+ * bytes here, so the digest and the gateway path, which ends with the
+ * EUI64 of the child, go in the payload.
+ *
+ * Blocks are served once the whole artifact is in the cache and matches
+ * the digest. Until then the router answers 4.04 and the child asks the
+ * gateway at once, while the fill thread downloads the artifact from the
+ * path given by the child over the shared DTLS session. An artifact which
+ * does not match its digest is dropped and not fetched again. The
+ * children still check the digest as with a direct download.
+ *
+ * Slot-1 is not used for updates on a router and holds the cache of one
+ * artifact. A request for another digest starts a new cache once the
+ * running download is over.
+ */
+#define PROXY_BLOCK_SIZE	1024
+#define PROXY_BLOCK_SZX		COAP_BLOCK_1024
+#define PROXY_PAGE_SIZE		4096
+#define PROXY_CACHE_SIZE	(DT_FLASH_AREA_IMAGE_1_SIZE - PROXY_PAGE_SIZE)
+#define PROXY_MAX_BLOCKS	(PROXY_CACHE_SIZE / PROXY_BLOCK_SIZE)
+#define PROXY_MAX_PAGES		(PROXY_CACHE_SIZE / PROXY_PAGE_SIZE)
+#define PROXY_STACK_SIZE	4096
+#define PROXY_PRIORITY		10
+#define PROXY_FILL_STACK_SIZE	4096
+#define PROXY_FILL_PRIORITY	11
+/* the path of a child, "update/..." and its EUI64 */
+#define PROXY_PATH_MAX		(DEGU_COAP_PATH_MAX + 17)
+/* a child gives up on the router quickly and asks the gateway */
+#define PROXY_TIMEOUT_MS	3000
+
+static struct proxy_cache {
+	char digest[33];
+	u32_t size;
+	bool valid;		/* complete and matching the digest */
+	u32_t hits;
+	u32_t misses;
+	u8_t map[DIV_ROUND_UP(PROXY_MAX_BLOCKS, 8)];
+	u8_t erased[DIV_ROUND_UP(PROXY_MAX_PAGES, 8)];
+} cache;
+
+/* the cache is served by proxy_thread and filled by proxy_fill_thread */
+static K_MUTEX_DEFINE(cache_lock);
+static K_SEM_DEFINE(fill_sem, 0, 1);
+static bool filling;
+static char fill_path[PROXY_PATH_MAX + 1];
+static char fill_rejected[33];	/* digest of the last mismatching artifact */
+static mbedtls_md5_context fill_md5;
+static u32_t fill_block;
+static u8_t fill_buf[PROXY_BLOCK_SIZE] __aligned(4);
+
+static struct device *flash_dev;
+/* the cache serves on routers and degu_proxy_get() runs on children */
+static u8_t proxy_msg[MAX_COAP_MSG_LEN];
+static u8_t proxy_block[PROXY_BLOCK_SIZE] __aligned(4);
+
+static bool map_test(u8_t *map, u32_t n)
+{
+	return map[n / 8] & BIT(n % 8);
+}
+
+static void map_set(u8_t *map, u32_t n)
+{
+	map[n / 8] |= BIT(n % 8);
+}
+
+static void cache_reset(const char *digest)
+{
+	LOG_INF("cache %s: %d hits, %d misses", cache.digest, cache.hits,
+		cache.misses);
+	memset(&cache, 0, sizeof(cache));
+	strncpy(cache.digest, digest, sizeof(cache.digest) - 1);
+}
+
+static bool cache_get(u32_t num, u16_t *len)
+{
+	if (num >= PROXY_MAX_BLOCKS || !map_test(cache.map, num)) {
+		return false;
+	}
+
+	if ((num + 1) * PROXY_BLOCK_SIZE >= cache.size) {
+		*len = cache.size - num * PROXY_BLOCK_SIZE;
+	} else {
+		*len = PROXY_BLOCK_SIZE;
+	}
+	memcpy(proxy_block, (const void *)(DT_FLASH_AREA_IMAGE_1_OFFSET +
+					   num * PROXY_BLOCK_SIZE), *len);
+
+	return true;
+}
+
+/* fill thread only, the cache is not valid until the artifact is complete */
+static int cache_put(u32_t num, u16_t len)
+{
+	u32_t offset = num * PROXY_BLOCK_SIZE;
+	u32_t page = offset / PROXY_PAGE_SIZE;
+	int err = 0;
+
+	if (num >= PROXY_MAX_BLOCKS) {
+		return 1;
+	}
+
+	flash_write_protection_set(flash_dev, false);
+	if (!map_test(cache.erased, page)) {
+		/* pages are erased when their first block is cached */
+		err = flash_erase(flash_dev, DT_FLASH_AREA_IMAGE_1_OFFSET +
+				  page * PROXY_PAGE_SIZE, PROXY_PAGE_SIZE);
+		map_set(cache.erased, page);
+	}
+	if (!err) {
+		memset(fill_buf + len, 0xff, ROUND_UP(len, 4) - len);
+		err = flash_write(flash_dev, DT_FLASH_AREA_IMAGE_1_OFFSET + offset,
+				  fill_buf, ROUND_UP(len, 4));
+	}
+	flash_write_protection_set(flash_dev, true);
+
+	if (err) {
+		LOG_ERR("Failed to cache block %d", num);
+		return 1;
+	}
+
+	map_set(cache.map, num);
+	cache.size = offset + len;
+
+	return 0;
+}
+
+/* degu_coap_request() callback, caches the blocks in order */
+static int proxy_fill_write(u8_t *buf, u16_t len)
+{
+	if (len > PROXY_BLOCK_SIZE) {
+		return 1;
+	}
+
+	memcpy(fill_buf, buf, len);
+	mbedtls_md5_update_ret(&fill_md5, fill_buf, len);
+	if (cache_put(fill_block, len)) {
+		return 1;
+	}
+	fill_block++;
+
+	return 0;
+}
+
+/* download the artifact asked for by proxy_handle() and check its digest */
+static void proxy_fill_thread(void *p1, void *p2, void *p3)
+{
+	unsigned char output[16];
+	char md5[33];
+	u8_t *payload;
+	int code;
+	int i;
+
+	while (1) {
+		k_sem_take(&fill_sem, K_FOREVER);
+
+		code = 0;
+		fill_block = 0;
+		mbedtls_md5_init(&fill_md5);
+		mbedtls_md5_starts_ret(&fill_md5);
+
+		payload = k_malloc(MAX_COAP_MSG_LEN);
+		if (payload) {
+			degu_coap_session_open();
+			code = degu_coap_get_path((u8_t *)fill_path, 0, payload,
+						  &proxy_fill_write);
+			degu_coap_session_close();
+			k_free(payload);
+		}
+
+		mbedtls_md5_finish_ret(&fill_md5, output);
+		mbedtls_md5_free(&fill_md5);
+		for (i = 0; i < 16; i++) {
+			sprintf(md5 + i * 2, "%02x", output[i]);
+		}
+
+		k_mutex_lock(&cache_lock, K_FOREVER);
+		if (code >= COAP_RESPONSE_CODE_OK && !strcmp(md5, cache.digest)) {
+			LOG_INF("cache %s: %d bytes", cache.digest, cache.size);
+			cache.valid = true;
+		} else {
+			if (code >= COAP_RESPONSE_CODE_OK) {
+				LOG_ERR("cache %s: got %s, dropped", cache.digest, md5);
+				strcpy(fill_rejected, cache.digest);
+			} else {
+				LOG_ERR("cache %s: download failed", cache.digest);
+			}
+			cache_reset("");
+		}
+		filling = false;
+		k_mutex_unlock(&cache_lock);
+	}
+}
+
+K_THREAD_DEFINE(degu_proxy_fill_tid, PROXY_FILL_STACK_SIZE, proxy_fill_thread,
+		NULL, NULL, NULL, PROXY_FILL_PRIORITY, 0, K_FOREVER);
+
+static int proxy_reply(int sock, struct sockaddr *addr, socklen_t addrlen,
+		       struct coap_packet *req, u8_t code, u32_t num, u16_t len)
+{
+	struct coap_packet reply;
+	u8_t token[8];
+	u8_t tkl;
+	bool more;
+	int r;
+
+	tkl = coap_header_get_token(req, token);
+	r = coap_packet_init(&reply, proxy_msg, sizeof(proxy_msg), 1,
+			     COAP_TYPE_ACK, tkl, token, code,
+			     coap_header_get_id(req));
+	if (r < 0) {
+		return r;
+	}
+
+	if (code == COAP_RESPONSE_CODE_CONTENT) {
+		more = len == PROXY_BLOCK_SIZE &&
+		       (cache.size == 0 || (num + 1) * PROXY_BLOCK_SIZE < cache.size);
+		r = coap_append_option_int(&reply, COAP_OPTION_BLOCK2,
+					   (num << 4) | (more << 3) | PROXY_BLOCK_SZX);
+		if (r < 0) {
+			return r;
+		}
+		r = coap_packet_append_payload_marker(&reply);
+		if (r < 0) {
+			return r;
+		}
+		r = coap_packet_append_payload(&reply, proxy_block, len);
+		if (r < 0) {
+			return r;
+		}
+	}
+
+	return sendto(sock, reply.data, reply.offset, 0, addr, addrlen);
+}
+
+static void proxy_handle(int sock, struct sockaddr *addr, socklen_t addrlen,
+			 struct coap_packet *req)
+{
+	struct coap_option path;
+	const u8_t *data;
+	char digest[33];
+	char uri[PROXY_PATH_MAX + 1];
+	u16_t len;
+	int block2;
+	u32_t num;
+	bool hit;
+
+	data = coap_packet_get_payload(req, &len);
+	if (coap_header_get_code(req) != COAP_METHOD_POST ||
+	    coap_find_options(req, COAP_OPTION_URI_PATH, &path, 1) != 1 ||
+	    path.len != 3 || memcmp(path.value, "ota", 3) ||
+	    !data || len <= 33 + 7 || len - 33 >= sizeof(uri) ||
+	    data[32] != ' ' || memcmp(data + 33, "update/", 7)) {
+		proxy_reply(sock, addr, addrlen, req, COAP_RESPONSE_CODE_BAD_REQUEST, 0, 0);
+		return;
+	}
+
+	memcpy(digest, data, 32);
+	digest[32] = '\0';
+	memcpy(uri, data + 33, len - 33);
+	uri[len - 33] = '\0';
+
+	block2 = coap_get_option_int(req, COAP_OPTION_BLOCK2);
+	num = block2 > 0 ? block2 >> 4 : 0;
+	if (block2 > 0 && (block2 & 0x7) != PROXY_BLOCK_SZX) {
+		proxy_reply(sock, addr, addrlen, req, COAP_RESPONSE_CODE_BAD_REQUEST, 0, 0);
+		return;
+	}
+
+	k_mutex_lock(&cache_lock, K_FOREVER);
+	if (strcmp(digest, cache.digest) != 0 && !filling &&
+	    strcmp(digest, fill_rejected) != 0) {
+		/* this child asks the gateway, the next ones get the cache */
+		cache_reset(digest);
+		strcpy(fill_path, uri);
+		filling = true;
+		k_sem_give(&fill_sem);
+	}
+
+	hit = cache.valid && !strcmp(digest, cache.digest) && cache_get(num, &len);
+	if (hit) {
+		cache.hits++;
+	} else {
+		cache.misses++;
+	}
+	k_mutex_unlock(&cache_lock);
+
+	if (!hit) {
+		proxy_reply(sock, addr, addrlen, req, COAP_RESPONSE_CODE_NOT_FOUND, 0, 0);
+		return;
+	}
+
+	proxy_reply(sock, addr, addrlen, req, COAP_RESPONSE_CODE_CONTENT, num, len);
+}
+
+static void proxy_thread(void *p1, void *p2, void *p3)
+{
+	struct sockaddr_in6 addr = {
+		.sin6_family = AF_INET6,
+		.sin6_port = htons(COAP_PORT),
+	};
+	struct sockaddr_in6 from;
+	socklen_t fromlen;
+	struct coap_packet req;
+	int sock;
+	int r;
+
+	flash_dev = device_get_binding(DT_FLASH_DEV_NAME);
+
+	sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+	if (!flash_dev || sock < 0 ||
+	    bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		LOG_ERR("Can't start the OTA block cache");
+		return;
+	}
+
+	while (1) {
+		fromlen = sizeof(from);
+		r = recvfrom(sock, proxy_msg, sizeof(proxy_msg), 0,
+			     (struct sockaddr *)&from, &fromlen);
+		if (r <= 0 || coap_packet_parse(&req, proxy_msg, r, NULL, 0) < 0 ||
+		    coap_header_get_type(&req) != COAP_TYPE_CON) {
+			continue;
+		}
+
+		/* the reply is built in proxy_msg, the request is no longer needed */
+		proxy_handle(sock, (struct sockaddr *)&from, fromlen, &req);
+	}
+}
+
+K_THREAD_DEFINE(degu_proxy_tid, PROXY_STACK_SIZE, proxy_thread,
+		NULL, NULL, NULL, PROXY_PRIORITY, 0, K_FOREVER);
+
+void degu_proxy_start(void)
+{
+	k_thread_start(degu_proxy_fill_tid);
+	k_thread_start(degu_proxy_tid);
+}
+
+/* mesh-local RLOC of the parent router, false on a router */
+static bool proxy_parent_addr(struct in6_addr *addr)
+{
+	struct net_if *iface = net_if_get_default();
+	struct openthread_context *ot_context = net_if_l2_data(iface);
+	const otMeshLocalPrefix *prefix;
+	otRouterInfo parent;
+
+	if (otThreadGetDeviceRole(ot_context->instance) != OT_DEVICE_ROLE_CHILD ||
+	    otThreadGetParentInfo(ot_context->instance, &parent) != OT_ERROR_NONE) {
+		return false;
+	}
+
+	prefix = otThreadGetMeshLocalPrefix(ot_context->instance);
+	memset(addr, 0, sizeof(*addr));
+	memcpy(addr->s6_addr, prefix->m8, 8);
+	addr->s6_addr[11] = 0xff;
+	addr->s6_addr[12] = 0xfe;
+	addr->s6_addr[14] = parent.mRloc16 >> 8;
+	addr->s6_addr[15] = parent.mRloc16 & 0xff;
+
+	return true;
+}
+
+/**
+ * get one block of an artifact from the cache of the parent router.
+ * @return	0:success, -1:no parent or no answer, ask the gateway instead
+ */
+int degu_proxy_get(const char *digest, const char *uri, u32_t num,
+		   u8_t *buf, u16_t *len, bool *more)
+{
+	struct sockaddr_in6 addr = {
+		.sin6_family = AF_INET6,
+		.sin6_port = htons(COAP_PORT),
+	};
+	struct coap_packet pkt;
+	struct timeval tv;
+	char body[33 + PROXY_PATH_MAX + 1];
+	char eui64[17];
+	const u8_t *data;
+	fd_set fds;
+	int block2;
+	int ret = -1;
+	int sock;
+	int r;
+
+	if (!proxy_parent_addr(&addr.sin6_addr)) {
+		return -1;
+	}
+
+	sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0) {
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		goto end;
+	}
+
+	/* the router fetches the path of this device */
+	get_eui64(eui64);
+	eui64[16] = '\0';
+	snprintf(body, sizeof(body), "%s %s/%s", digest, uri, eui64);
+	r = coap_packet_init(&pkt, proxy_msg, sizeof(proxy_msg), 1, COAP_TYPE_CON,
+			     0, NULL, COAP_METHOD_POST, coap_next_id());
+	if (r < 0 ||
+	    coap_packet_append_option(&pkt, COAP_OPTION_URI_PATH, "ota", 3) < 0 ||
+	    coap_append_option_int(&pkt, COAP_OPTION_BLOCK2,
+				   (num << 4) | PROXY_BLOCK_SZX) < 0 ||
+	    coap_packet_append_payload_marker(&pkt) < 0 ||
+	    coap_packet_append_payload(&pkt, body, strlen(body)) < 0) {
+		goto end;
+	}
+
+	if (send(sock, pkt.data, pkt.offset, 0) < 0) {
+		goto end;
+	}
+
+	FD_ZERO(&fds);
+	FD_SET(sock, &fds);
+	tv.tv_sec = PROXY_TIMEOUT_MS / 1000;
+	tv.tv_usec = (PROXY_TIMEOUT_MS % 1000) * 1000;
+	if (select(sock + 1, &fds, NULL, NULL, &tv) <= 0) {
+		goto end;
+	}
+
+	r = recv(sock, proxy_msg, sizeof(proxy_msg), 0);
+	if (r <= 0 || coap_packet_parse(&pkt, proxy_msg, r, NULL, 0) < 0 ||
+	    coap_header_get_code(&pkt) != COAP_RESPONSE_CODE_CONTENT) {
+		goto end;
+	}
+
+	block2 = coap_get_option_int(&pkt, COAP_OPTION_BLOCK2);
+	data = coap_packet_get_payload(&pkt, len);
+	if (block2 < 0 || (block2 >> 4) != num || !data || *len > PROXY_BLOCK_SIZE) {
+		goto end;
+	}
+
+	memcpy(buf, data, *len);
+	*more = (block2 & 0x8) != 0;
+	ret = 0;
+end:
+	close(sock);
+	return ret;
+}
@@ -0,0 +1,376 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <zephyr.h>
+#include <stdio.h>
+#include <string.h>
+#include <fs.h>
+#include <net/coap.h>
+#include <logging/log.h>
+#include "zcoap.h"
+#include "degu_utils.h"
+#include "degu_shadow.h"
+
+LOG_MODULE_REGISTER(degu_shadow);
+
+/*
+ * Reported state is sent as a partial update. A digest of each key of
+ * "state":{"reported":{...}} is kept once the gateway has acknowledged it,
+ * and only the keys whose value has changed since are sent again.
+ * Documents of any other shape are sent as they are.
+ */
+#define SHADOW_PATH		"/NAND:/SHADOW.DAT"
+#define SHADOW_MAGIC		0x53484431
+#define SHADOW_MAX_KEYS		32
+#define SHADOW_MAX_CHANGED	SHADOW_MAX_KEYS
+
+struct shadow_key {
+	u32_t key;
+	u32_t value;
+};
+
+static struct shadow_table {
+	u32_t magic;
+	u32_t used;
+	struct shadow_key keys[SHADOW_MAX_KEYS];
+} table;
+
+static struct degu_shadow_stats stats;
+static K_MUTEX_DEFINE(shadow_lock);
+static bool table_loaded;
+
+/* FNV-1a */
+static u32_t digest(const char *p, size_t len)
+{
+	u32_t h = 0x811c9dc5;
+
+	while (len--) {
+		h = (h ^ (u8_t)*p++) * 0x01000193;
+	}
+
+	return h;
+}
+
+static const char *skip_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+		p++;
+	}
+
+	return p;
+}
+
+/* end of the JSON value at p, NULL if it is malformed */
+static const char *skip_value(const char *p)
+{
+	int depth = 0;
+
+	do {
+		switch (*p) {
+		case '\0':
+			return NULL;
+		case '"':
+			for (p++; *p != '"'; p++) {
+				if (*p == '\0') {
+					return NULL;
+				}
+				if (*p == '\\' && *++p == '\0') {
+					return NULL;
+				}
+			}
+			p++;
+			break;
+		case '{':
+		case '[':
+			depth++;
+			p++;
+			break;
+		case '}':
+		case ']':
+			if (--depth < 0) {
+				return NULL;
+			}
+			p++;
+			break;
+		default:
+			if (depth == 0) {
+				/* number, true, false or null */
+				while (*p && !strchr(",}] \t\r\n", *p)) {
+					p++;
+				}
+				return p;
+			}
+			p++;
+			break;
+		}
+	} while (depth > 0);
+
+	return p;
+}
+
+struct member {
+	const char *key;	/* with its quotes */
+	size_t key_len;
+	const char *value;
+	size_t value_len;
+};
+
+/*
+ * walk the members of the object at p.
+ * @return	the number of members, -1 if it is not an object
+ */
+static int members(const char *p, struct member *m, int max, const char **end)
+{
+	const char *v;
+	int n = 0;
+
+	p = skip_ws(p);
+	if (*p++ != '{') {
+		return -1;
+	}
+
+	p = skip_ws(p);
+	if (*p == '}') {
+		*end = p + 1;
+		return 0;
+	}
+
+	while (1) {
+		if (*p != '"' || n >= max) {
+			return -1;
+		}
+		m[n].key = p;
+		p = skip_value(p);
+		if (!p) {
+			return -1;
+		}
+		m[n].key_len = p - m[n].key;
+
+		p = skip_ws(p);
+		if (*p++ != ':') {
+			return -1;
+		}
+		v = skip_ws(p);
+		p = skip_value(v);
+		if (!p) {
+			return -1;
+		}
+		m[n].value = v;
+		m[n].value_len = p - v;
+		n++;
+
+		p = skip_ws(p);
+		if (*p == '}') {
+			*end = p + 1;
+			return n;
+		}
+		if (*p++ != ',') {
+			return -1;
+		}
+		p = skip_ws(p);
+	}
+}
+
+static bool is_key(const struct member *m, const char *key)
+{
+	size_t len = strlen(key);
+
+	return m->key_len == len + 2 && !memcmp(m->key + 1, key, len);
+}
+
+static void table_load(void)
+{
+	struct fs_file_t fp;
+
+	table_loaded = true;
+	if (fs_open(&fp, SHADOW_PATH)) {
+		return;
+	}
+
+	if (fs_read(&fp, &table, sizeof(table)) != sizeof(table) ||
+	    table.magic != SHADOW_MAGIC || table.used > SHADOW_MAX_KEYS) {
+		memset(&table, 0, sizeof(table));
+	}
+	fs_close(&fp);
+}
+
+static void table_save(void)
+{
+	struct fs_file_t fp;
+
+	table.magic = SHADOW_MAGIC;
+	if (fs_open(&fp, SHADOW_PATH)) {
+		LOG_ERR("Can't open %s", SHADOW_PATH);
+		return;
+	}
+	fs_write(&fp, &table, sizeof(table));
+	fs_close(&fp);
+}
+
+static struct shadow_key *table_find(u32_t key)
+{
+	int i;
+
+	for (i = 0; i < table.used; i++) {
+		if (table.keys[i].key == key) {
+			return &table.keys[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* the gateway has acknowledged the value, unknown keys are added if room */
+static bool table_update(u32_t key, u32_t value)
+{
+	struct shadow_key *k = table_find(key);
+
+	if (!k) {
+		if (table.used == SHADOW_MAX_KEYS) {
+			return false;
+		}
+		k = &table.keys[table.used++];
+		k->key = key;
+	}
+
+	if (k->value == value) {
+		return false;
+	}
+	k->value = value;
+
+	return true;
+}
+
+static int shadow_post(const char *doc)
+{
+	return degu_coap_request("thing", COAP_METHOD_POST, (u8_t *)doc, NULL);
+}
+
+/**
+ * POST the reported state to "thing", leaving out unchanged keys.
+ * @param	doc	shadow document
+ * @param	persist	keep the digests across reboots
+ * @return	CoAP response code, COAP_RESPONSE_CODE_CHANGED if nothing was sent
+ */
+int degu_shadow_report(const char *doc, bool persist)
+{
+	struct member top, state, reported[SHADOW_MAX_CHANGED];
+	u32_t keys[SHADOW_MAX_CHANGED], values[SHADOW_MAX_CHANGED];
+	struct shadow_key *k;
+	const char *end;
+	bool changed[SHADOW_MAX_CHANGED];
+	bool dirty = false;
+	size_t full = strlen(doc);
+	size_t sent;
+	char *partial;
+	char *p;
+	int n, i, count = 0;
+	int code;
+
+	if (!IS_ENABLED(CONFIG_DEGU_SHADOW_DELTA)) {
+		return shadow_post(doc);
+	}
+
+	k_mutex_lock(&shadow_lock, K_FOREVER);
+	if (!table_loaded) {
+		table_load();
+	}
+	stats.reports++;
+	stats.bytes_full += full;
+
+	/* {"state":{"reported":{...}}} and nothing else */
+	if (members(doc, &top, 1, &end) != 1 || !is_key(&top, "state") ||
+	    *skip_ws(end) != '\0' ||
+	    members(top.value, &state, 1, &end) != 1 || !is_key(&state, "reported") ||
+	    (n = members(state.value, reported, SHADOW_MAX_CHANGED, &end)) < 0) {
+		stats.bytes_sent += full;
+		k_mutex_unlock(&shadow_lock);
+		return shadow_post(doc);
+	}
+
+	for (i = 0; i < n; i++) {
+		keys[i] = digest(reported[i].key, reported[i].key_len);
+		values[i] = digest(reported[i].value, reported[i].value_len);
+		k = table_find(keys[i]);
+		changed[i] = !k || k->value != values[i];
+		if (changed[i]) {
+			count++;
+		}
+	}
+
+	if (count == 0) {
+		stats.skipped++;
+		k_mutex_unlock(&shadow_lock);
+		return COAP_RESPONSE_CODE_CHANGED;
+	}
+
+	partial = k_malloc(full + 1);
+	if (!partial) {
+		stats.bytes_sent += full;
+		k_mutex_unlock(&shadow_lock);
+		return shadow_post(doc);
+	}
+
+	p = partial + sprintf(partial, "{\"state\":{\"reported\":{");
+	for (i = 0; i < n; i++) {
+		if (!changed[i]) {
+			continue;
+		}
+		memcpy(p, reported[i].key, reported[i].key_len);
+		p += reported[i].key_len;
+		*p++ = ':';
+		memcpy(p, reported[i].value, reported[i].value_len);
+		p += reported[i].value_len;
+		*p++ = ',';
+	}
+	strcpy(p - 1, "}}}");
+
+	/* the lock keeps two reports from acknowledging each other's keys */
+	code = shadow_post(partial);
+	sent = strlen(partial);
+	stats.bytes_sent += sent;
+	k_free(partial);
+
+	if (code >= COAP_RESPONSE_CODE_OK && code < COAP_RESPONSE_CODE_BAD_REQUEST) {
+		for (i = 0; i < n; i++) {
+			if (changed[i] && table_update(keys[i], values[i])) {
+				dirty = true;
+			}
+		}
+		if (dirty && persist) {
+			table_save();
+		}
+	}
+
+	LOG_DBG("%d of %d keys, %d of %d bytes", count, n, sent, full);
+	k_mutex_unlock(&shadow_lock);
+
+	return code;
+}
+
+void degu_shadow_get_stats(struct degu_shadow_stats *out)
+{
+	k_mutex_lock(&shadow_lock, K_FOREVER);
+	*out = stats;
+	k_mutex_unlock(&shadow_lock);
+}
@@ -90,23 +90,34 @@ static char *get_gw_addr(unsigned int prefix)
 int degu_send_asset(void);
 int degu_connect(void);
 
-int degu_coap_request(u8_t *path, u8_t method, u8_t *payload, void (*callback)(u8_t *, u16_t))
+/*
+ * DTLS session shared by consecutive requests, see degu_coap_session_open().
+ * Without an open session every request makes its own handshake.
+ *
+ * coap_lock is held for one exchange on the session, not for a whole
+ * request, so that the short requests of the script and the workqueue go
+ * between the blocks of a firmware download. Handshakes are made outside
+ * the lock.
+ */
+static K_MUTEX_DEFINE(coap_lock);
+static int coap_session_sock = -1;
+static int coap_session_refs;
+static bool coap_session_stale;
+static bool coap_session_opening;
+static int coap_depth;
+
+static int degu_coap_open(void)
 {
 	int sock;
 	struct sockaddr_in6 sockaddr;
-	u16_t payload_len;
-	bool last_block = false;
 	char gw_addr[NET_IPV6_ADDR_LEN];
-	char eui64[17];
-	char coap_path[40];
 	int ret;
-	int code = 0;
 
 	while (!net_if_is_up(net_if_get_by_index(1)));
 
 	sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_DTLS_1_2);
 	if (sock == -1) {
-		goto end;
+		return -1;
 	}
 
 	sockaddr.sin6_family = AF_INET6;
@@ -114,36 +125,166 @@ int degu_coap_request(u8_t *path, u8_t method, u8_t *payload, void (*callback)(u
 	strcpy(gw_addr, get_gw_addr(64));
 	ret = zsock_inet_pton(AF_INET6, gw_addr, &sockaddr.sin6_addr);
 	if (ret <= 0) {
-		goto end;
+		close(sock);
+		return -1;
 	}
 
 	sockaddr.sin6_port = htons(COAPS_PORT);
 	ret = zsock_connect(sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
 	if (ret < 0) {
-		goto end;
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/* make the handshake of the shared session if it is wanted and not open */
+static void coap_session_connect(void)
+{
+	int sock;
+
+	k_mutex_lock(&coap_lock, K_FOREVER);
+	if (coap_session_refs == 0 || coap_session_sock >= 0 || coap_session_opening) {
+		k_mutex_unlock(&coap_lock);
+		return;
+	}
+	coap_session_opening = true;
+	k_mutex_unlock(&coap_lock);
+
+	sock = degu_coap_open();
+
+	k_mutex_lock(&coap_lock, K_FOREVER);
+	coap_session_opening = false;
+	if (coap_session_refs > 0) {
+		coap_session_sock = sock;
+		coap_session_stale = false;
+		sock = -1;
+	}
+	k_mutex_unlock(&coap_lock);
+
+	/* closed by the last user during the handshake */
+	if (sock >= 0) {
+		close(sock);
 	}
+}
+
+/**
+ * keep one DTLS session for the requests until degu_coap_session_close().
+ * Calls may be nested, the session is closed by the outermost one.
+ * @return	0:success, -1:fail (requests open their own session)
+ */
+int degu_coap_session_open(void)
+{
+	int ret;
+
+	k_mutex_lock(&coap_lock, K_FOREVER);
+	coap_session_refs++;
+	k_mutex_unlock(&coap_lock);
+
+	coap_session_connect();
 
-	get_eui64(eui64);
-	eui64[16] = '\0';
+	k_mutex_lock(&coap_lock, K_FOREVER);
+	ret = coap_session_sock < 0 ? -1 : 0;
+	k_mutex_unlock(&coap_lock);
 
-	snprintf(coap_path, sizeof(coap_path), "%s/%s", path, eui64);
+	return ret;
+}
+
+void degu_coap_session_close(void)
+{
+	k_mutex_lock(&coap_lock, K_FOREVER);
+	if (coap_session_refs > 0 && --coap_session_refs == 0 &&
+	    coap_session_sock >= 0) {
+		close(coap_session_sock);
+		coap_session_sock = -1;
+	}
+	k_mutex_unlock(&coap_lock);
+}
+
+static int coap_exchange(int sock, struct zcoap_xfer *xfer, u8_t *path, u8_t method,
+			 u8_t *payload, u16_t *payload_len, bool *last_block)
+{
+	switch (method) {
+	case COAP_METHOD_POST:
+		*payload_len = strlen((char*)payload);
+		return zcoap_request_post(sock, xfer, path, payload, payload_len, last_block);
+	case COAP_METHOD_PUT:
+		*payload_len = strlen((char*)payload);
+		return zcoap_request_put(sock, xfer, path, payload, payload_len, last_block);
+	case COAP_METHOD_GET:
+		return zcoap_request_get(sock, xfer, path, payload, payload_len, last_block);
+	case COAP_METHOD_DELETE:
+		return zcoap_request_delete(sock, xfer, path);
+	default:
+		return 0;
+	}
+}
+
+/**
+ * send a request to the gateway, over the shared session when one is open.
+ * @param	device	true:the EUI64 of this device is appended to the path
+ * @param	offset	block2 offset of a GET
+ * @return	CoAP response code
+ */
+static int coap_request(u8_t *path, bool device, u8_t method, u8_t *payload,
+			size_t offset, int (*callback)(u8_t *, u16_t))
+{
+	struct zcoap_xfer xfer;
+	int own_sock = -1;
+	int sock;
+	bool locked;
+	bool reopen;
+	u16_t payload_len;
+	bool last_block = false;
+	char eui64[17];
+	char coap_path[DEGU_COAP_PATH_MAX + 17];
+	int code = 0;
+
+	if (strlen(path) > (device ? DEGU_COAP_PATH_MAX : sizeof(coap_path) - 1)) {
+		return COAP_FAILED_TO_RECEIVE_RESPONSE;
+	}
+
+	if (device) {
+		get_eui64(eui64);
+		eui64[16] = '\0';
+		snprintf(coap_path, sizeof(coap_path), "%s/%s", path, eui64);
+	} else {
+		strcpy(coap_path, path);
+	}
+
+	zcoap_xfer_init(&xfer, offset);
+
+	k_mutex_lock(&coap_lock, K_FOREVER);
+	coap_depth++;
+	k_mutex_unlock(&coap_lock);
 
 	while (1) {
-		switch (method) {
-		case COAP_METHOD_POST:
-			payload_len = strlen((char*)payload);
-			code = zcoap_request_post(sock, coap_path, payload, &payload_len, &last_block);
-			break;
-		case COAP_METHOD_PUT:
-			payload_len = strlen((char*)payload);
-			code = zcoap_request_put(sock, coap_path, payload, &payload_len, &last_block);
-			break;
-		case COAP_METHOD_GET:
-			code = zcoap_request_get(sock, coap_path, payload, &payload_len, &last_block);
-			break;
-		case COAP_METHOD_DELETE:
-			code = zcoap_request_delete(sock, coap_path);
-		default:
+		/* requests come from the script, the update thread and the workqueue */
+		k_mutex_lock(&coap_lock, K_FOREVER);
+		locked = coap_session_sock >= 0;
+		if (locked) {
+			sock = coap_session_sock;
+		} else {
+			/* a socket of this request alone needs no lock */
+			k_mutex_unlock(&coap_lock);
+			if (own_sock < 0) {
+				own_sock = degu_coap_open();
+				if (own_sock < 0) {
+					goto end;
+				}
+			}
+			sock = own_sock;
+		}
+
+		code = coap_exchange(sock, &xfer, coap_path, method, payload,
+				     &payload_len, &last_block);
+		if (locked) {
+			k_mutex_unlock(&coap_lock);
+		}
+
+		if (method != COAP_METHOD_POST && method != COAP_METHOD_PUT &&
+		    method != COAP_METHOD_GET) {
 			goto end;
 		}
 
@@ -157,7 +298,11 @@ int degu_coap_request(u8_t *path, u8_t method, u8_t *payload, void (*callback)(u
 			/* In progress of GET */
 			if (callback != NULL) {
 				/* Process a block of payload*/
-				callback(payload, payload_len);
+				if (callback(payload, payload_len)) {
+					/* abort the transfer */
+					code = COAP_FAILED_TO_RECEIVE_RESPONSE;
+					goto end;
+				}
 			}
 			else {
 				payload += 1024;
@@ -179,6 +324,7 @@ int degu_coap_request(u8_t *path, u8_t method, u8_t *payload, void (*callback)(u
 			/* illigal or expired certificate */
 		case COAP_RESPONSE_CODE_FORBIDDEN:
 			/* invalid or duplex certificate */
+			coap_session_stale = true;
 			degu_get_asset();
 			/* Need to send the asset again */
 			code = degu_send_asset();
@@ -215,7 +361,7 @@ int degu_coap_request(u8_t *path, u8_t method, u8_t *payload, void (*callback)(u
 					goto end;
 				} else if (strstr(path, "update") != NULL) {
 					/* ota, bad url. */
-					code = COAP_FAILED_TO_RECEIVE_RESPONSE;
+					code = COAP_RESOURCE_NOT_FOUND;
 					goto end;
 				}
 			}
@@ -234,11 +380,44 @@ int degu_coap_request(u8_t *path, u8_t method, u8_t *payload, void (*callback)(u
 	}
 
 end:
-	close(sock);
+	if (own_sock >= 0) {
+		close(own_sock);
+	}
+
+	k_mutex_lock(&coap_lock, K_FOREVER);
+	coap_depth--;
+	/* the asset has changed, make a new handshake once no request runs */
+	reopen = coap_session_stale && coap_depth == 0 && coap_session_sock >= 0;
+	if (reopen) {
+		close(coap_session_sock);
+		coap_session_sock = -1;
+	}
+	k_mutex_unlock(&coap_lock);
+
+	if (reopen) {
+		coap_session_connect();
+	}
 
 	return code;
 }
 
+int degu_coap_request(u8_t *path, u8_t method, u8_t *payload, int (*callback)(u8_t *, u16_t))
+{
+	return coap_request(path, true, method, payload, 0, callback);
+}
+
+/* GET from the given byte offset on, to resume a download */
+int degu_coap_get(u8_t *path, size_t offset, u8_t *payload, int (*callback)(u8_t *, u16_t))
+{
+	return coap_request(path, true, COAP_METHOD_GET, payload, offset, callback);
+}
+
+/* GET a path which already names a device, for the OTA block cache */
+int degu_coap_get_path(u8_t *path, size_t offset, u8_t *payload, int (*callback)(u8_t *, u16_t))
+{
+	return coap_request(path, false, COAP_METHOD_GET, payload, offset, callback);
+}
+
 /**
  * check A71CH has asset.
  * @return	1:has asset, 0:no asset
@@ -283,6 +462,8 @@ static int a71ch_update_asset(const char *key, const char *cert)
 		goto a71ch_end;
 	}
 
+	coap_session_stale = true;
+
 	/* send DELETE x509/key command, Degu GW delete key and cert both. */
 	code_delete = degu_coap_request("x509/key", COAP_METHOD_DELETE, NULL, NULL);
 	if (code_delete < COAP_RESPONSE_CODE_OK) {
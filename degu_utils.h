@@ -22,6 +22,13 @@
  * THE SOFTWARE.
  */
 
+/* longest resource path, the EUI64 of the device is appended to it */
+#define DEGU_COAP_PATH_MAX 48
+
 void get_eui64(char *eui64);
-int degu_coap_request(u8_t *path, u8_t method, u8_t *payload, void (*callback)(u8_t *, u16_t));
+int degu_coap_session_open(void);
+void degu_coap_session_close(void);
+int degu_coap_request(u8_t *path, u8_t method, u8_t *payload, int (*callback)(u8_t *, u16_t));
+int degu_coap_get(u8_t *path, size_t offset, u8_t *payload, int (*callback)(u8_t *, u16_t));
+int degu_coap_get_path(u8_t *path, size_t offset, u8_t *payload, int (*callback)(u8_t *, u16_t));
 int degu_get_asset(void);
@@ -36,6 +36,7 @@
 #include "py/gc.h"
 #include "py/mphal.h"
 #include "modmachine.h"
+#include "zephyr_poll.h"
 
 const mp_obj_base_t machine_pin_obj_template = {&machine_pin_type};
 
@@ -44,6 +45,9 @@ STATIC void machine_pin_print(const mp_print_t *print, mp_obj_t self_in, mp_prin
     mp_printf(print, "<Pin %p %d>", self->port, self->pin);
 }
 
+STATIC machine_pin_irq_obj_t *machine_pin_irq_find(machine_pin_obj_t *self);
+STATIC u32_t machine_pin_irq_flags(mp_uint_t trigger);
+
 // pin.init(mode, pull=None, *, value)
 STATIC mp_obj_t machine_pin_obj_init_helper(machine_pin_obj_t *self, size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args) {
     enum { ARG_mode, ARG_pull, ARG_value };
@@ -66,10 +70,18 @@ STATIC mp_obj_t machine_pin_obj_init_helper(machine_pin_obj_t *self, size_t n_ar
         pull = mp_obj_get_int(args[ARG_pull].u_obj);
     }
 
-    int ret = gpio_pin_configure(self->port, self->pin, mode | pull);
+    // an IRQ set up with pin.irq() keeps firing
+    u32_t irq_flags = 0;
+    machine_pin_irq_obj_t *irq = machine_pin_irq_find(self);
+    if (irq != NULL && irq->handler != mp_const_none) {
+        irq_flags = machine_pin_irq_flags(irq->trigger);
+    }
+
+    int ret = gpio_pin_configure(self->port, self->pin, mode | pull | irq_flags);
     if (ret) {
         mp_raise_ValueError("invalid pin");
     }
+    self->flags = mode | pull;
 
     // get initial value
     if (args[ARG_value].u_obj != MP_OBJ_NULL) {
@@ -100,6 +112,7 @@ mp_obj_t mp_pin_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw,
     pin->base = machine_pin_obj_template;
     pin->port = wanted_port;
     pin->pin = wanted_pin;
+    pin->flags = GPIO_DIR_IN;
 
     if (n_args > 1 || n_kw > 0) {
         // pin mode given, so configure this GPIO
@@ -151,6 +164,226 @@ STATIC mp_obj_t machine_pin_on(mp_obj_t self_in) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_1(machine_pin_on_obj, machine_pin_on);
 
+/******************************************************************************/
+// Pin.irq()
+//
+// Edges are stamped with the cycle counter in the GPIO interrupt and put
+// in a ring, which a scheduled callback drains into the Python handlers.
+// The interrupt is the only producer and the VM the only consumer, so
+// the ring needs no lock.
+
+#define PIN_IRQ_RISING  (1)
+#define PIN_IRQ_FALLING (2)
+
+#define PIN_RING_SIZE (16) // power of two
+
+STATIC struct {
+    struct {
+        machine_pin_irq_obj_t *irq;
+        u32_t stamp;
+    } ev[PIN_RING_SIZE];
+    volatile unsigned int head; // written by the interrupt
+    volatile unsigned int tail; // written by the VM
+    volatile bool scheduled;
+} pin_ring;
+
+STATIC const mp_obj_type_t machine_pin_irq_type;
+
+STATIC u32_t cycles_to_us(u32_t cycles) {
+    return (u32_t)(SYS_CLOCK_HW_CYCLES_TO_NS64(cycles) / 1000);
+}
+
+STATIC mp_obj_t machine_pin_irq_drain(mp_obj_t arg) {
+    (void)arg;
+
+    // an edge coming after this schedules another drain
+    pin_ring.scheduled = false;
+    compiler_barrier();
+
+    while (pin_ring.tail != pin_ring.head) {
+        unsigned int i = pin_ring.tail % PIN_RING_SIZE;
+        machine_pin_irq_obj_t *irq = pin_ring.ev[i].irq;
+        u32_t stamp = pin_ring.ev[i].stamp;
+        compiler_barrier();
+        pin_ring.tail++;
+
+        u32_t latency = cycles_to_us(k_cycle_get_32() - stamp);
+        irq->events++;
+        irq->latency_sum += latency;
+        if (latency > irq->latency_max) {
+            irq->latency_max = latency;
+        }
+        irq->stamp = stamp;
+        if (irq->handler != mp_const_none) {
+            // an exception is printed and the next edges still handled
+            mp_call_function_1_protected(irq->handler, MP_OBJ_FROM_PTR(irq->pin));
+        }
+    }
+
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(machine_pin_irq_drain_obj, machine_pin_irq_drain);
+
+STATIC void machine_pin_isr(struct device *port, struct gpio_callback *cb, u32_t pins) {
+    machine_pin_irq_obj_t *irq = CONTAINER_OF(cb, machine_pin_irq_obj_t, cb);
+    u32_t stamp = k_cycle_get_32();
+    unsigned int head = pin_ring.head;
+
+    if (head - pin_ring.tail == PIN_RING_SIZE) {
+        irq->dropped++;
+        return;
+    }
+    pin_ring.ev[head % PIN_RING_SIZE].irq = irq;
+    pin_ring.ev[head % PIN_RING_SIZE].stamp = stamp;
+    compiler_barrier();
+    pin_ring.head = head + 1;
+
+    if (!pin_ring.scheduled) {
+        pin_ring.scheduled = mp_sched_schedule(MP_OBJ_FROM_PTR(&machine_pin_irq_drain_obj), mp_const_none);
+    }
+    // end utime.sleep() or uselect.poll() so the handler runs now
+    mp_zephyr_wake_up();
+}
+
+STATIC machine_pin_irq_obj_t *machine_pin_irq_find(machine_pin_obj_t *self) {
+    machine_pin_irq_obj_t *irq;
+
+    for (irq = MP_STATE_PORT(machine_pin_irq_list); irq != NULL; irq = irq->next) {
+        if (irq->pin->port == self->port && irq->pin->pin == self->pin) {
+            return irq;
+        }
+    }
+    return NULL;
+}
+
+STATIC u32_t machine_pin_irq_flags(mp_uint_t trigger) {
+    switch (trigger) {
+        case PIN_IRQ_RISING:
+            return GPIO_INT | GPIO_INT_EDGE | GPIO_INT_ACTIVE_HIGH;
+        case PIN_IRQ_FALLING:
+            return GPIO_INT | GPIO_INT_EDGE | GPIO_INT_ACTIVE_LOW;
+        case PIN_IRQ_RISING | PIN_IRQ_FALLING:
+            return GPIO_INT | GPIO_INT_EDGE | GPIO_INT_DOUBLE_EDGE;
+    }
+    mp_raise_ValueError("invalid trigger");
+}
+
+// pin.irq(handler=None, trigger=IRQ_RISING|IRQ_FALLING, *, hard=False)
+STATIC mp_obj_t machine_pin_irq(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args) {
+    enum { ARG_handler, ARG_trigger, ARG_hard };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_handler, MP_ARG_OBJ, {.u_obj = mp_const_none} },
+        { MP_QSTR_trigger, MP_ARG_INT, {.u_int = PIN_IRQ_RISING | PIN_IRQ_FALLING} },
+        { MP_QSTR_hard, MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = false} },
+    };
+    machine_pin_obj_t *self = MP_OBJ_TO_PTR(pos_args[0]);
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args - 1, pos_args + 1, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    machine_pin_irq_obj_t *irq = machine_pin_irq_find(self);
+
+    if (n_args == 1 && kw_args->used == 0) {
+        // pin.irq() returns the current one
+        if (irq == NULL) {
+            return mp_const_none;
+        }
+        return MP_OBJ_FROM_PTR(irq);
+    }
+
+    // The VM can't run in an interrupt, whichever thread it preempted
+    if (args[ARG_hard].u_bool) {
+        mp_raise_ValueError("hard IRQs not supported");
+    }
+
+    u32_t flags = machine_pin_irq_flags(args[ARG_trigger].u_int);
+
+    if (irq == NULL) {
+        irq = m_new_obj(machine_pin_irq_obj_t);
+        memset(irq, 0, sizeof(*irq));
+        irq->base.type = &machine_pin_irq_type;
+        irq->pin = self;
+        gpio_init_callback(&irq->cb, machine_pin_isr, BIT(self->pin));
+        if (gpio_add_callback(self->port, &irq->cb)) {
+            mp_raise_ValueError("invalid pin");
+        }
+        irq->next = MP_STATE_PORT(machine_pin_irq_list);
+        MP_STATE_PORT(machine_pin_irq_list) = irq;
+    }
+
+    gpio_pin_disable_callback(self->port, self->pin);
+    irq->pin = self;
+    irq->handler = args[ARG_handler].u_obj;
+    irq->trigger = args[ARG_trigger].u_int;
+    if (irq->handler != mp_const_none) {
+        if (gpio_pin_configure(self->port, self->pin, self->flags | flags)) {
+            mp_raise_ValueError("invalid pin");
+        }
+        gpio_pin_enable_callback(self->port, self->pin);
+    }
+
+    return MP_OBJ_FROM_PTR(irq);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(machine_pin_irq_obj, 1, machine_pin_irq);
+
+// The callbacks live on the heap, remove them before it goes away
+void machine_pin_deinit(void) {
+    machine_pin_irq_obj_t *irq;
+
+    for (irq = MP_STATE_PORT(machine_pin_irq_list); irq != NULL; irq = irq->next) {
+        gpio_pin_disable_callback(irq->pin->port, irq->pin->pin);
+        gpio_remove_callback(irq->pin->port, &irq->cb);
+    }
+    MP_STATE_PORT(machine_pin_irq_list) = NULL;
+    pin_ring.head = pin_ring.tail = 0;
+    pin_ring.scheduled = false;
+}
+
+// irq.timestamp(): utime.ticks_us() of the edge being handled
+STATIC mp_obj_t machine_pin_irq_timestamp(mp_obj_t self_in) {
+    machine_pin_irq_obj_t *irq = MP_OBJ_TO_PTR(self_in);
+    // computed as mp_hal_ticks_us() does
+    mp_uint_t us = SYS_CLOCK_HW_CYCLES_TO_NS(irq->stamp) / 1000;
+    return MP_OBJ_NEW_SMALL_INT(us & (MICROPY_PY_UTIME_TICKS_PERIOD - 1));
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(machine_pin_irq_timestamp_obj, machine_pin_irq_timestamp);
+
+// irq.stats(): (events, dropped, max latency us, mean latency us), the
+// latency being from the edge to the call of the handler
+STATIC mp_obj_t machine_pin_irq_stats(mp_obj_t self_in) {
+    machine_pin_irq_obj_t *irq = MP_OBJ_TO_PTR(self_in);
+    mp_obj_t items[4];
+
+    items[0] = mp_obj_new_int_from_uint(irq->events);
+    items[1] = mp_obj_new_int_from_uint(irq->dropped);
+    items[2] = mp_obj_new_int_from_uint(irq->latency_max);
+    items[3] = mp_obj_new_int_from_uint(irq->events ? (u32_t)(irq->latency_sum / irq->events) : 0);
+
+    return mp_obj_new_tuple(4, items);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(machine_pin_irq_stats_obj, machine_pin_irq_stats);
+
+STATIC mp_obj_t machine_pin_irq_call(mp_obj_t self_in, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+    machine_pin_irq_obj_t *irq = MP_OBJ_TO_PTR(self_in);
+    mp_arg_check_num(n_args, n_kw, 0, 0, false);
+    if (irq->handler != mp_const_none) {
+        mp_call_function_1(irq->handler, MP_OBJ_FROM_PTR(irq->pin));
+    }
+    return mp_const_none;
+}
+
+STATIC const mp_rom_map_elem_t machine_pin_irq_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_timestamp), MP_ROM_PTR(&machine_pin_irq_timestamp_obj) },
+    { MP_ROM_QSTR(MP_QSTR_stats),     MP_ROM_PTR(&machine_pin_irq_stats_obj) },
+};
+STATIC MP_DEFINE_CONST_DICT(machine_pin_irq_locals_dict, machine_pin_irq_locals_dict_table);
+
+STATIC const mp_obj_type_t machine_pin_irq_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_IRQ,
+    .call = machine_pin_irq_call,
+    .locals_dict = (mp_obj_dict_t*)&machine_pin_irq_locals_dict,
+};
+
 STATIC mp_uint_t machine_pin_ioctl(mp_obj_t self_in, mp_uint_t request, uintptr_t arg, int *errcode) {
     (void)errcode;
     machine_pin_obj_t *self = self_in;
@@ -175,12 +408,15 @@ STATIC const mp_rom_map_elem_t machine_pin_locals_dict_table[] = {
     { MP_ROM_QSTR(MP_QSTR_value),   MP_ROM_PTR(&machine_pin_value_obj) },
     { MP_ROM_QSTR(MP_QSTR_off),     MP_ROM_PTR(&machine_pin_off_obj) },
     { MP_ROM_QSTR(MP_QSTR_on),      MP_ROM_PTR(&machine_pin_on_obj) },
+    { MP_ROM_QSTR(MP_QSTR_irq),     MP_ROM_PTR(&machine_pin_irq_obj) },
 
     // class constants
     { MP_ROM_QSTR(MP_QSTR_IN),        MP_ROM_INT(GPIO_DIR_IN) },
     { MP_ROM_QSTR(MP_QSTR_OUT),       MP_ROM_INT(GPIO_DIR_OUT) },
     { MP_ROM_QSTR(MP_QSTR_PULL_UP),   MP_ROM_INT(GPIO_PUD_PULL_UP) },
     { MP_ROM_QSTR(MP_QSTR_PULL_DOWN), MP_ROM_INT(GPIO_PUD_PULL_DOWN) },
+    { MP_ROM_QSTR(MP_QSTR_IRQ_RISING),  MP_ROM_INT(PIN_IRQ_RISING) },
+    { MP_ROM_QSTR(MP_QSTR_IRQ_FALLING), MP_ROM_INT(PIN_IRQ_FALLING) },
 };
 
 STATIC MP_DEFINE_CONST_DICT(machine_pin_locals_dict, machine_pin_locals_dict_table);
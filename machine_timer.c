@@ -0,0 +1,235 @@
+/*
+ * This file is part of the MicroPython project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// machine.Timer on k_timer. Expiries are counted in the kernel timer
+// interrupt, which schedules the callback with mp_sched_schedule(); a
+// periodic timer does not drift with the time its callback takes.
+
+#include <zephyr.h>
+
+#include "py/runtime.h"
+#include "modmachine.h"
+#include "zephyr_poll.h"
+
+#define TIMER_ONE_SHOT (0)
+#define TIMER_PERIODIC (1)
+
+typedef struct _machine_timer_obj_t {
+    mp_obj_base_t base;
+    struct _machine_timer_obj_t *next;
+    bool linked; // on machine_timer_list, i.e. started and not deinit()ed
+    struct k_timer timer;
+    mp_obj_t callback;
+    mp_uint_t mode;
+    mp_uint_t period; // ms
+    // updated from the interrupt
+    volatile bool scheduled;
+    volatile uint32_t overruns;
+} machine_timer_obj_t;
+
+STATIC void machine_timer_link(machine_timer_obj_t *self) {
+    if (!self->linked) {
+        self->next = MP_STATE_PORT(machine_timer_list);
+        MP_STATE_PORT(machine_timer_list) = self;
+        self->linked = true;
+    }
+}
+
+STATIC void machine_timer_unlink(machine_timer_obj_t *self) {
+    machine_timer_obj_t **p;
+
+    for (p = &MP_STATE_PORT(machine_timer_list); *p != NULL; p = &(*p)->next) {
+        if (*p == self) {
+            *p = self->next;
+            break;
+        }
+    }
+    self->next = NULL;
+    self->linked = false;
+}
+
+STATIC mp_obj_t machine_timer_dispatch(mp_obj_t self_in) {
+    machine_timer_obj_t *self = MP_OBJ_TO_PTR(self_in);
+
+    self->scheduled = false;
+    if (!self->linked) {
+        // deinit() while the callback was scheduled
+        return mp_const_none;
+    }
+    if (self->mode == TIMER_ONE_SHOT) {
+        // done unless the callback starts it again
+        machine_timer_unlink(self);
+    }
+    if (self->callback != mp_const_none) {
+        mp_call_function_1_protected(self->callback, self_in);
+    }
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(machine_timer_dispatch_obj, machine_timer_dispatch);
+
+STATIC void machine_timer_expiry(struct k_timer *timer) {
+    machine_timer_obj_t *self = CONTAINER_OF(timer, machine_timer_obj_t, timer);
+
+    // the callback of the previous expiry has not run yet
+    if (self->scheduled) {
+        self->overruns++;
+        return;
+    }
+    self->scheduled = mp_sched_schedule(MP_OBJ_FROM_PTR(&machine_timer_dispatch_obj), MP_OBJ_FROM_PTR(self));
+    if (!self->scheduled) {
+        self->overruns++;
+    }
+    mp_zephyr_wake_up();
+}
+
+STATIC void machine_timer_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+    machine_timer_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_printf(print, "Timer(mode=%s, period=%u)",
+              self->mode == TIMER_PERIODIC ? "PERIODIC" : "ONE_SHOT", self->period);
+}
+
+// timer.init(*, mode=Timer.PERIODIC, period=-1, freq=-1, callback=None)
+STATIC mp_obj_t machine_timer_init_helper(machine_timer_obj_t *self, size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args) {
+    enum { ARG_mode, ARG_period, ARG_freq, ARG_callback };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_mode,     MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = TIMER_PERIODIC} },
+        { MP_QSTR_period,   MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
+        { MP_QSTR_freq,     MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = -1} },
+        { MP_QSTR_callback, MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_obj = mp_const_none} },
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    mp_int_t period = args[ARG_period].u_int;
+    if (args[ARG_freq].u_int > 0) {
+        period = 1000 / args[ARG_freq].u_int;
+    }
+    if (period <= 0) {
+        mp_raise_ValueError("period must be at least 1 ms");
+    }
+    if (args[ARG_mode].u_int != TIMER_ONE_SHOT && args[ARG_mode].u_int != TIMER_PERIODIC) {
+        mp_raise_ValueError("invalid mode");
+    }
+
+    k_timer_stop(&self->timer);
+    self->mode = args[ARG_mode].u_int;
+    self->period = period;
+    self->callback = args[ARG_callback].u_obj;
+    self->overruns = 0;
+
+    // running timers are kept alive by the list, whether referenced or not
+    machine_timer_link(self);
+    k_timer_start(&self->timer, period, self->mode == TIMER_PERIODIC ? period : 0);
+
+    return mp_const_none;
+}
+
+// Timer(id=-1, ...): timers are virtual, the id is not used
+STATIC mp_obj_t machine_timer_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+    mp_arg_check_num(n_args, n_kw, 0, 1, true);
+
+    machine_timer_obj_t *self = m_new_obj(machine_timer_obj_t);
+    self->base.type = &machine_timer_type;
+    self->next = NULL;
+    self->linked = false;
+    self->callback = mp_const_none;
+    self->mode = TIMER_PERIODIC;
+    self->period = 0;
+    self->scheduled = false;
+    self->overruns = 0;
+    k_timer_init(&self->timer, machine_timer_expiry, NULL);
+
+    if (n_kw > 0) {
+        mp_map_t kw_args;
+        mp_map_init_fixed_table(&kw_args, n_kw, args + n_args);
+        machine_timer_init_helper(self, 0, args + n_args, &kw_args);
+    }
+
+    return MP_OBJ_FROM_PTR(self);
+}
+
+STATIC mp_obj_t machine_timer_init(size_t n_args, const mp_obj_t *args, mp_map_t *kw_args) {
+    return machine_timer_init_helper(MP_OBJ_TO_PTR(args[0]), n_args - 1, args + 1, kw_args);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(machine_timer_init_obj, 1, machine_timer_init);
+
+STATIC mp_obj_t machine_timer_deinit(mp_obj_t self_in) {
+    machine_timer_obj_t *self = MP_OBJ_TO_PTR(self_in);
+
+    k_timer_stop(&self->timer);
+    machine_timer_unlink(self);
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(machine_timer_deinit_obj, machine_timer_deinit);
+
+// timer.overruns(): expiries whose callback was dropped because the one
+// of the previous expiry had not run yet
+STATIC mp_obj_t machine_timer_overruns(mp_obj_t self_in) {
+    machine_timer_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    return mp_obj_new_int_from_uint(self->overruns);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_1(machine_timer_overruns_obj, machine_timer_overruns);
+
+s32_t machine_timer_next_ms(void) {
+    s32_t next = K_FOREVER;
+    machine_timer_obj_t *self;
+
+    for (self = MP_STATE_PORT(machine_timer_list); self != NULL; self = self->next) {
+        s32_t left = k_timer_remaining_get(&self->timer);
+        if (next == K_FOREVER || left < next) {
+            next = left;
+        }
+    }
+    return next;
+}
+
+// The timers live on the heap, stop them before it goes away
+void machine_timer_deinit_all(void) {
+    machine_timer_obj_t *self;
+
+    for (self = MP_STATE_PORT(machine_timer_list); self != NULL; self = self->next) {
+        k_timer_stop(&self->timer);
+    }
+    MP_STATE_PORT(machine_timer_list) = NULL;
+}
+
+STATIC const mp_rom_map_elem_t machine_timer_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_init),     MP_ROM_PTR(&machine_timer_init_obj) },
+    { MP_ROM_QSTR(MP_QSTR_deinit),   MP_ROM_PTR(&machine_timer_deinit_obj) },
+    { MP_ROM_QSTR(MP_QSTR_overruns), MP_ROM_PTR(&machine_timer_overruns_obj) },
+
+    { MP_ROM_QSTR(MP_QSTR_ONE_SHOT), MP_ROM_INT(TIMER_ONE_SHOT) },
+    { MP_ROM_QSTR(MP_QSTR_PERIODIC), MP_ROM_INT(TIMER_PERIODIC) },
+};
+STATIC MP_DEFINE_CONST_DICT(machine_timer_locals_dict, machine_timer_locals_dict_table);
+
+const mp_obj_type_t machine_timer_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_Timer,
+    .print = machine_timer_print,
+    .make_new = machine_timer_make_new,
+    .locals_dict = (mp_obj_dict_t*)&machine_timer_locals_dict,
+};
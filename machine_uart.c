@@ -29,7 +29,9 @@
 #include "py/runtime.h"
 #include "py/mphal.h"
 #include "py/stream.h"
+#include "py/mperrno.h"
 #include "modmachine.h"
+#include "zephyr_poll.h"
 
 const mp_obj_base_t machine_uart_obj_template = {&machine_uart_type};
 
@@ -47,6 +49,7 @@ volatile int uart_rxbuf_read_cursor = 0;
 u8_t uart_txbuffer[BUF_SIZE];
 volatile int uart_txbuf_write_cursor = 0;
 volatile int uart_txbuf_read_cursor = 0;
+static struct k_poll_signal uart_rx_signal = K_POLL_SIGNAL_INITIALIZER(uart_rx_signal);
 
 static void uart_cb(struct device *dev){
 	uart_irq_update(dev);
@@ -56,6 +59,7 @@ static void uart_cb(struct device *dev){
 		if(uart_rxbuf_write_cursor == uart_rxbuf_read_cursor){
 			uart_rxbuf_read_cursor = (uart_rxbuf_read_cursor + 1) % BUF_SIZE;
 		}
+		k_poll_signal_raise(&uart_rx_signal, 0);
 	}
 
 	if(uart_irq_tx_ready(dev) && (uart_txbuf_read_cursor != uart_txbuf_write_cursor)){		
@@ -300,10 +304,41 @@ STATIC mp_uint_t machine_uart_write(mp_obj_t self_in, const void *buf_in, mp_uin
 	return write_size;
 }
 
+STATIC mp_uint_t machine_uart_ioctl(mp_obj_t self_in, mp_uint_t request, uintptr_t arg, int *errcode) {
+	struct mp_zephyr_kpoll *kp;
+	mp_uint_t ret = 0;
+
+	switch (request) {
+	case MP_STREAM_POLL:
+		if ((arg & MP_STREAM_POLL_RD) && uart_rxbuf_read_cursor != uart_rxbuf_write_cursor) {
+			ret |= MP_STREAM_POLL_RD;
+		}
+		if ((arg & MP_STREAM_POLL_WR) && (uart_txbuf_write_cursor + 1) % BUF_SIZE != uart_txbuf_read_cursor) {
+			ret |= MP_STREAM_POLL_WR;
+		}
+		return ret;
+
+	case MP_STREAM_KPOLL:
+		/* only the reception is signalled, writers are polled */
+		kp = (struct mp_zephyr_kpoll *)arg;
+		if ((kp->events & MP_STREAM_POLL_WR) || kp->max == 0) {
+			*errcode = MP_EINVAL;
+			return MP_STREAM_ERROR;
+		}
+		k_poll_signal_reset(&uart_rx_signal);
+		k_poll_event_init(kp->ev, K_POLL_TYPE_SIGNAL, K_POLL_MODE_NOTIFY_ONLY, &uart_rx_signal);
+		return 1;
+
+	default:
+		*errcode = MP_EINVAL;
+		return MP_STREAM_ERROR;
+	}
+}
+
 STATIC const mp_stream_p_t uart_stream_p = {
 	.read = machine_uart_read,
 	.write = machine_uart_write,
-	.ioctl = false,
+	.ioctl = machine_uart_ioctl,
 	.is_text = false,
 };
 
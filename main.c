@@ -30,17 +30,35 @@
 #include <string.h>
 
 #include <zephyr.h>
+#include <fs.h>
+#ifdef CONFIG_ARM_MPU
+#include <arch/arm/cortex_m/cmsis.h>
+#endif
 #ifdef CONFIG_NETWORKING
 #include <net/net_context.h>
 #endif
+#include "mbedtls/md5.h"
 
 #include "py/compile.h"
 #include "py/runtime.h"
 #include "py/repl.h"
 #include "py/gc.h"
 #include "py/stackctrl.h"
+#include "py/persistentcode.h"
+#include "py/reader.h"
+#include "py/mperrno.h"
+#include "py/mpthread.h"
 #include "lib/utils/pyexec.h"
 #include "lib/mp-readline/readline.h"
+#include "main.h"
+#include "modmachine.h"
+#include "zephyr_fs.h"
+#ifdef CONFIG_DEGU_HEAP
+#include "degu_heap.h"
+#endif
+#ifdef CONFIG_DEGU_GC_STATS
+#include "zephyr_gc.h"
+#endif
 
 #ifdef TEST
 #include "lib/upytesthelper/upytesthelper.h"
@@ -49,8 +67,28 @@
 #include TEST
 #endif
 
-static char *stack_top;
+#ifdef CONFIG_DEGU_HEAP
+// The heap is taken from the pool shared with mbedTLS when the VM starts
+// and given back when it stops, see degu_heap.c
+static char *heap;
+static size_t heap_size;
+
+// Never fails, the first CONFIG_DEGU_MPY_HEAP_MIN bytes of the pool are
+// kept for the VM
+static void heap_start(void) {
+    heap = degu_heap_mpy_arena(&heap_size);
+}
+
+static void heap_stop(void) {
+    degu_heap_mpy_release();
+    heap = NULL;
+}
+#else
 static char heap[MICROPY_HEAP_SIZE];
+static const size_t heap_size = sizeof(heap);
+#define heap_start()
+#define heap_stop()
+#endif
 
 void init_zephyr(void) {
     // We now rely on CONFIG_NET_APP_SETTINGS to set up bootstrap
@@ -79,54 +117,334 @@ void init_zephyr(void) {
 #endif
 }
 
-int exec_from_buffer(char* buf, size_t len) {
-		nlr_buf_t nlr;
+struct mp_boot_stats mp_boot_stats;
+
+static void heap_mark(void) {
+    gc_info_t info;
+
+    gc_info(&info);
+    if (info.used > mp_boot_stats.heap_peak) {
+        mp_boot_stats.heap_peak = info.used;
+    }
+}
+
+#if MICROPY_EMIT_NATIVE
+// Zephyr maps SRAM execute-never, native and viper code is emitted into
+// a pool which the last MPU region makes executable. The pool is
+// emptied every time the VM starts.
+static byte native_pool[CONFIG_DEGU_MPY_NATIVE_POOL_SIZE] __aligned(CONFIG_DEGU_MPY_NATIVE_POOL_SIZE);
+static size_t native_pool_used;
+
+static void native_pool_init(void) {
+    #if defined(CONFIG_ARM_MPU)
+    u32_t region = ((MPU->TYPE & MPU_TYPE_DREGION_Msk) >> MPU_TYPE_DREGION_Pos) - 1;
+
+    // normal non-cacheable memory, read/write and executable
+    MPU->RNR = region;
+    MPU->RBAR = (u32_t)native_pool & MPU_RBAR_ADDR_Msk;
+    MPU->RASR = ((30 - __builtin_clz(sizeof(native_pool))) << MPU_RASR_SIZE_Pos)
+        | (0x3 << MPU_RASR_AP_Pos) | (0x1 << MPU_RASR_TEX_Pos)
+        | MPU_RASR_ENABLE_Msk;
+    __DSB();
+    __ISB();
+    #endif
+    native_pool_used = 0;
+}
+
+void mp_zephyr_alloc_exec(size_t min_size, void **ptr, size_t *size) {
+    size_t len = (min_size + 3) & ~3;
+
+    if (len > sizeof(native_pool) - native_pool_used) {
+        mp_raise_msg(&mp_type_MemoryError, "native code pool full");
+    }
+    *ptr = native_pool + native_pool_used;
+    *size = len;
+    native_pool_used += len;
+}
+#endif
+
+#if MICROPY_PERSISTENT_CODE_SAVE
+// The compiled main.py is kept on /NAND: with the digest of its source and
+// its own length
+#define MPY_CACHE_PATH      "/NAND:/MAIN.MPY"
+#define MPY_CACHE_SUM_PATH  "/NAND:/MAIN.SUM"
+
+// A script delivered as .mpy starts with 'M' and the bytecode version
+static bool is_mpy(const byte *buf, size_t len) {
+    return len >= 4 && buf[0] == 'M' && buf[1] == MPY_VERSION;
+}
+
+// digest of the script, read in small chunks like the lexer does
+static int script_sum(const char *path, char *sum, bool *mpy) {
+    struct fs_file_t file;
+    mbedtls_md5_context ctx;
+    unsigned char digest[16];
+    byte buf[64];
+    ssize_t read;
+    int i;
+
+    if (fs_open(&file, path)) {
+        return -1;
+    }
+
+    mbedtls_md5_init(&ctx);
+    mbedtls_md5_starts_ret(&ctx);
+    *mpy = false;
+    for (i = 0; (read = fs_read(&file, buf, sizeof(buf))) > 0; i++) {
+        if (i == 0) {
+            *mpy = is_mpy(buf, read);
+        }
+        mbedtls_md5_update_ret(&ctx, buf, read);
+    }
+    mbedtls_md5_finish_ret(&ctx, digest);
+    mbedtls_md5_free(&ctx);
+    fs_close(&file);
+
+    for (i = 0; i < 16; i++) {
+        sprintf(sum + i * 2, "%02x", digest[i]);
+    }
+    return 0;
+}
+
+static void mpy_cache_print_strn(void *data, const char *str, size_t len) {
+    if (fs_write((struct fs_file_t *)data, str, len) != len) {
+        mp_boot_stats.cache_err = true;
+    }
+}
+
+static void mpy_cache_drop(void) {
+    struct fs_dirent dirent;
+
+    if (!fs_stat(MPY_CACHE_SUM_PATH, &dirent)) {
+        fs_unlink(MPY_CACHE_SUM_PATH);
+    }
+    if (!fs_stat(MPY_CACHE_PATH, &dirent)) {
+        fs_unlink(MPY_CACHE_PATH);
+    }
+}
+
+// A cache which can't be written is skipped, the script runs regardless
+static void mpy_cache_save(mp_raw_code_t *rc, const char *sum) {
+    struct fs_file_t file;
+    struct fs_dirent dirent;
+    mp_print_t print = { &file, mpy_cache_print_strn };
+    nlr_buf_t nlr;
+
+    // the digest is written last, a partial cache is never used
+    mpy_cache_drop();
+
+    if (fs_open(&file, MPY_CACHE_PATH)) {
+        return;
+    }
+    mp_boot_stats.cache_err = false;
+    if (nlr_push(&nlr) == 0) {
+        mp_raw_code_save(rc, &print);
+        nlr_pop();
+    } else {
+        // MemoryError, or code that can't be saved
+        mp_boot_stats.cache_err = true;
+    }
+    fs_close(&file);
+    if (mp_boot_stats.cache_err) {
+        fs_unlink(MPY_CACHE_PATH);
+        return;
+    }
+
+    // the length tells a cache cut short by a reset from a complete one
+    if (fs_stat(MPY_CACHE_PATH, &dirent)
+        || fs_open(&file, MPY_CACHE_SUM_PATH)) {
+        return;
+    }
+    u32_t size = dirent.size;
+    fs_write(&file, sum, 32);
+    fs_write(&file, &size, sizeof(size));
+    fs_close(&file);
+}
+
+static mp_raw_code_t *mpy_load(const char *path) {
+    mp_reader_t reader;
+    mp_raw_code_t *rc;
+    nlr_buf_t nlr;
+
+    mp_reader_new_file(&reader, path);
+    // mp_raw_code_load() closes the reader only when it succeeds
+    if (nlr_push(&nlr) == 0) {
+        rc = mp_raw_code_load(&reader);
+        nlr_pop();
+    } else {
+        reader.close(reader.data);
+        nlr_jump(nlr.ret_val);
+    }
+    return rc;
+}
+
+static mp_raw_code_t *mpy_cache_load(const char *sum) {
+    struct fs_file_t file;
+    struct fs_dirent dirent;
+    mp_raw_code_t *rc = NULL;
+    struct {
+        char sum[32];
+        u32_t size;
+    } cached;
+    ssize_t read;
+    nlr_buf_t nlr;
+
+    if (fs_open(&file, MPY_CACHE_SUM_PATH)) {
+        return NULL;
+    }
+    read = fs_read(&file, &cached, sizeof(cached));
+    fs_close(&file);
+    if (read != sizeof(cached) || memcmp(cached.sum, sum, sizeof(cached.sum))) {
+        return NULL;
+    }
+    if (fs_stat(MPY_CACHE_PATH, &dirent) || dirent.size != cached.size) {
+        return NULL;
+    }
 
-	const mp_parse_input_kind_t input_kind = MP_PARSE_FILE_INPUT;
-	mp_lexer_t *lex = mp_lexer_new_from_str_len(MP_QSTR__lt_stdin_gt_, buf, len, 0);
-	if (lex == NULL) {
-		printf("MemoryError: lexer could not allocate memory\n");
-		return -1;
-	}
+    // an unusable cache is rebuilt from the source
+    if (nlr_push(&nlr) == 0) {
+        rc = mpy_load(MPY_CACHE_PATH);
+        nlr_pop();
+    }
+
+    return rc;
+}
+
+static mp_raw_code_t *compile_source(const char *path, const char *sum) {
+    mp_lexer_t *lex = mp_lexer_new_from_file(path);
+
+    qstr source_name = lex->source_name;
+    mp_parse_tree_t pn = mp_parse(lex, MP_PARSE_FILE_INPUT);
+    heap_mark();
+    #if MICROPY_EMIT_NATIVE
+    size_t native_used = native_pool_used;
+    #endif
+    mp_raw_code_t *rc = mp_compile_to_raw_code(&pn, source_name, MP_EMIT_OPT_NONE, false);
+    heap_mark();
+    #if MICROPY_EMIT_NATIVE
+    // native and viper code can't be saved as .mpy, such a script is
+    // compiled on every boot
+    if (native_pool_used != native_used) {
+        mpy_cache_drop();
+        return rc;
+    }
+    #endif
+    mpy_cache_save(rc, sum);
 
-	if (nlr_push(&nlr) == 0) {
-		qstr source_name = lex->source_name;
-		mp_parse_tree_t pn = mp_parse(lex, input_kind);
-		mp_obj_t module_fun = mp_compile(&pn, source_name, MP_EMIT_OPT_NONE, true);
-		mp_call_function_0(module_fun);
-		nlr_pop();
-	} else {
-		return -1;
-	}
-	return 0;
+    return rc;
 }
 
-int bg_main(char *src, size_t len) {
+static mp_obj_t load_main(const char *path) {
+    mp_raw_code_t *rc;
+    char sum[33];
+    bool mpy;
+
+    if (script_sum(path, sum, &mpy)) {
+        mp_raise_OSError(MP_ENOENT);
+    }
+
+    if (mpy) {
+        mp_boot_stats.kind = MP_BOOT_MPY;
+        rc = mpy_load(path);
+    } else {
+        rc = mpy_cache_load(sum);
+        if (rc != NULL) {
+            mp_boot_stats.kind = MP_BOOT_CACHED;
+        } else {
+            mp_boot_stats.kind = MP_BOOT_SOURCE;
+            rc = compile_source(path, sum);
+        }
+    }
+    heap_mark();
+
+    return mp_make_function_from_raw_code(rc, MP_OBJ_NULL, MP_OBJ_NULL);
+}
+#else
+static mp_obj_t load_main(const char *path) {
+    mp_lexer_t *lex = mp_lexer_new_from_file(path);
+
+    mp_boot_stats.kind = MP_BOOT_SOURCE;
+    qstr source_name = lex->source_name;
+    mp_parse_tree_t pn = mp_parse(lex, MP_PARSE_FILE_INPUT);
+    heap_mark();
+    mp_obj_t module_fun = mp_compile(&pn, source_name, MP_EMIT_OPT_NONE, true);
+    heap_mark();
+
+    return module_fun;
+}
+#endif
+
+// The script is streamed from the file system, it is never loaded whole
+int exec_from_file(const char *path) {
+    nlr_buf_t nlr;
+    uint32_t start = k_uptime_get_32();
+
+    memset(&mp_boot_stats, 0, sizeof(mp_boot_stats));
+
+    if (nlr_push(&nlr) == 0) {
+        mp_obj_t module_fun = load_main(path);
+        mp_boot_stats.first_ms = k_uptime_get_32();
+        mp_boot_stats.load_ms = mp_boot_stats.first_ms - start;
+        mp_call_function_0(module_fun);
+        nlr_pop();
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int bg_main(const char *path) {
     int stack_dummy;
 
-    stack_top = (char*)&stack_dummy;
-    mp_stack_set_top(stack_top);
+    #if MICROPY_PY_THREAD
+    mp_thread_init();
+    #endif
+    mp_stack_set_top(&stack_dummy);
     // Make MicroPython's stack limit somewhat smaller than full stack available
     mp_stack_set_limit(CONFIG_MAIN_STACK_SIZE - 512);
 
     init_zephyr();
 
     #if MICROPY_ENABLE_GC
-    gc_init(heap, heap + sizeof(heap));
+    heap_start();
+    gc_init(heap, heap + heap_size);
+    #ifdef CONFIG_DEGU_GC_STATS
+    mp_zephyr_gc_init();
+    #endif
+    #endif
+    #if MICROPY_EMIT_NATIVE
+    native_pool_init();
     #endif
     mp_init();
     mp_obj_list_init(mp_sys_path, 0);
     mp_obj_list_append(mp_sys_path, MP_OBJ_NEW_QSTR(MP_QSTR_)); // current dir (or base dir of the script)
+    mp_obj_list_append(mp_sys_path, MP_OBJ_NEW_QSTR(MP_QSTR_lib)); // /NAND:/lib
     mp_obj_list_init(mp_sys_argv, 0);
-    exec_from_buffer(src, len);
-    return 0;
+    int ret = exec_from_file(path);
+    // The VM may be started again with an updated script
+    machine_pin_deinit();
+    machine_timer_deinit_all();
+    mp_zephyr_fs_close_all();
+    #ifdef CONFIG_DEGU_PROFILE
+    mp_zephyr_prof_deinit();
+    #endif
+    #if MICROPY_PY_THREAD
+    mp_thread_deinit();
+    #endif
+    mp_deinit();
+    #if MICROPY_ENABLE_GC
+    heap_stop();
+    #endif
+    return ret;
 }
 
 
 int real_main(void) {
     int stack_dummy;
-    stack_top = (char*)&stack_dummy;
-    mp_stack_set_top(stack_top);
+    #if MICROPY_PY_THREAD
+    mp_thread_init();
+    #endif
+    mp_stack_set_top(&stack_dummy);
     // Make MicroPython's stack limit somewhat smaller than full stack available
     mp_stack_set_limit(CONFIG_MAIN_STACK_SIZE - 512);
 
@@ -134,14 +452,23 @@ int real_main(void) {
 
     #ifdef TEST
     static const char *argv[] = {"test"};
-    upytest_set_heap(heap, heap + sizeof(heap));
+    heap_start();
+    upytest_set_heap(heap, heap + heap_size);
     int r = tinytest_main(1, argv, groups);
+    heap_stop();
     printf("status: %d\n", r);
     #endif
 
 soft_reset:
     #if MICROPY_ENABLE_GC
-    gc_init(heap, heap + sizeof(heap));
+    heap_start();
+    gc_init(heap, heap + heap_size);
+    #ifdef CONFIG_DEGU_GC_STATS
+    mp_zephyr_gc_init();
+    #endif
+    #endif
+    #if MICROPY_EMIT_NATIVE
+    native_pool_init();
     #endif
     mp_init();
     mp_obj_list_init(mp_sys_path, 0);
@@ -161,6 +488,18 @@ soft_reset:
     }
 
     printf("soft reboot\n");
+    machine_pin_deinit();
+    machine_timer_deinit_all();
+    mp_zephyr_fs_close_all();
+    #ifdef CONFIG_DEGU_PROFILE
+    mp_zephyr_prof_deinit();
+    #endif
+    #if MICROPY_PY_THREAD
+    mp_thread_deinit();
+    #endif
+    #if MICROPY_ENABLE_GC
+    heap_stop();
+    #endif
     goto soft_reset;
 
     return 0;
@@ -170,24 +509,23 @@ void gc_collect(void) {
     // WARNING: This gc_collect implementation doesn't try to get root
     // pointers from CPU registers, and thus may function incorrectly.
     void *dummy;
+    #ifdef CONFIG_DEGU_GC_STATS
+    u32_t start = k_cycle_get_32();
+    #endif
     gc_collect_start();
-    gc_collect_root(&dummy, ((mp_uint_t)stack_top - (mp_uint_t)&dummy) / sizeof(mp_uint_t));
+    gc_collect_root(&dummy, ((mp_uint_t)MP_STATE_THREAD(stack_top) - (mp_uint_t)&dummy) / sizeof(mp_uint_t));
+    #if MICROPY_PY_THREAD
+    // The stacks and saved registers of the other threads
+    mp_thread_gc_others();
+    #endif
     gc_collect_end();
+    #ifdef CONFIG_DEGU_GC_STATS
+    mp_zephyr_gc_collected(k_cycle_get_32() - start);
+    #endif
     //gc_dump_info();
 }
 
-mp_lexer_t *mp_lexer_new_from_file(const char *filename) {
-    mp_raise_OSError(ENOENT);
-}
-
-mp_import_stat_t mp_import_stat(const char *path) {
-    return MP_IMPORT_STAT_NO_EXIST;
-}
-
-mp_obj_t mp_builtin_open(size_t n_args, const mp_obj_t *args, mp_map_t *kwargs) {
-    return mp_const_none;
-}
-MP_DEFINE_CONST_FUN_OBJ_KW(mp_builtin_open_obj, 1, mp_builtin_open);
+// mp_lexer_new_from_file(), mp_import_stat() and open() are in zephyr_fs.c
 
 NORETURN void nlr_jump_fail(void *val) {
     while (1);
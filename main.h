@@ -0,0 +1,46 @@
+/*
+ * This file is part of the MicroPython project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef MICROPY_INCLUDED_ZEPHYR_MAIN_H
+#define MICROPY_INCLUDED_ZEPHYR_MAIN_H
+
+// How main.py was brought up, see zephyr.boot_stats()
+enum {
+    MP_BOOT_SOURCE,     // compiled from source
+    MP_BOOT_CACHED,     // loaded from the .mpy cache of the source
+    MP_BOOT_MPY,        // delivered as .mpy
+};
+
+struct mp_boot_stats {
+    int kind;
+    uint32_t first_ms;  // uptime at the first instruction of the script
+    uint32_t load_ms;   // from the VM start to the first instruction
+    size_t heap_peak;   // largest heap use seen while loading
+    bool cache_err;
+};
+
+extern struct mp_boot_stats mp_boot_stats;
+
+#endif // MICROPY_INCLUDED_ZEPHYR_MAIN_H
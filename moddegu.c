@@ -18,19 +18,60 @@
 #include "degu_utils.h"
 #include "degu_ota.h"
 #include "degu_pm.h"
+#include "degu_shadow.h"
 
 STATIC mp_obj_t degu_check_update(void) {
 	return mp_obj_new_int(check_update());
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_0(degu_check_update_obj, degu_check_update);
 
+STATIC mp_obj_t degu_update_pending(void) {
+	return mp_obj_new_bool(degu_ota_update_pending());
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(degu_update_pending_obj, degu_update_pending);
+
+STATIC mp_obj_t degu_apply_update(void) {
+	if (degu_ota_apply()) {
+		/* script or config update, leave the script to restart the VM */
+		nlr_raise(mp_obj_new_exception(&mp_type_SystemExit));
+	}
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(degu_apply_update_obj, degu_apply_update);
+
+STATIC mp_obj_t degu_confirm(void) {
+	degu_ota_confirm();
+	return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(degu_confirm_obj, degu_confirm);
+
 STATIC mp_obj_t degu_update_shadow(mp_obj_t shadow) {
-	int ret = degu_coap_request("thing", COAP_METHOD_POST, (u8_t *)mp_obj_str_get_str(shadow), NULL);
+	const char *doc = mp_obj_str_get_str(shadow);
+	int ret;
+
+	/* other threads keep running during the CoAP exchange */
+	MP_THREAD_GIL_EXIT();
+	ret = degu_shadow_report(doc, false);
+	MP_THREAD_GIL_ENTER();
 
 	return mp_obj_new_int(ret);
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_1(degu_update_shadow_obj, degu_update_shadow);
 
+STATIC mp_obj_t degu_shadow_stats(void) {
+	struct degu_shadow_stats stats;
+	mp_obj_t items[4];
+
+	degu_shadow_get_stats(&stats);
+	items[0] = mp_obj_new_int(stats.reports);
+	items[1] = mp_obj_new_int(stats.skipped);
+	items[2] = mp_obj_new_int(stats.bytes_full);
+	items[3] = mp_obj_new_int(stats.bytes_sent);
+
+	return mp_obj_new_tuple(4, items);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(degu_shadow_stats_obj, degu_shadow_stats);
+
 STATIC mp_obj_t degu_get_shadow(void) {
 	vstr_t vstr;
 	int ret;
@@ -42,9 +83,16 @@ STATIC mp_obj_t degu_get_shadow(void) {
 	}
 	memset(payload, 0, MAX_COAP_MSG_LEN);
 
+	MP_THREAD_GIL_EXIT();
 	ret = degu_coap_request("thing", COAP_METHOD_GET, payload, NULL);
+	MP_THREAD_GIL_ENTER();
 
 	if (payload != NULL && ret >= COAP_RESPONSE_CODE_OK) {
+#ifdef CONFIG_DEGU_OTA_CHECK_DELTA
+		if (strstr(payload, "\"delta\"") != NULL) {
+			degu_ota_request_check();
+		}
+#endif
 		vstr_init_len(&vstr, strlen(payload));
 		strcpy(vstr.buf, payload);
 		m_free(payload);
@@ -111,7 +159,11 @@ STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_powerdown_obj, mod_powerdown);
 STATIC const mp_rom_map_elem_t degu_globals_table[] = {
 	{MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_degu) },
 	{ MP_ROM_QSTR(MP_QSTR_check_update), MP_ROM_PTR(&degu_check_update_obj) },
+	{ MP_ROM_QSTR(MP_QSTR_update_pending), MP_ROM_PTR(&degu_update_pending_obj) },
+	{ MP_ROM_QSTR(MP_QSTR_apply_update), MP_ROM_PTR(&degu_apply_update_obj) },
+	{ MP_ROM_QSTR(MP_QSTR_confirm), MP_ROM_PTR(&degu_confirm_obj) },
 	{ MP_ROM_QSTR(MP_QSTR_update_shadow), MP_ROM_PTR(&degu_update_shadow_obj) },
+	{ MP_ROM_QSTR(MP_QSTR_shadow_stats), MP_ROM_PTR(&degu_shadow_stats_obj) },
 	{ MP_ROM_QSTR(MP_QSTR_get_shadow), MP_ROM_PTR(&degu_get_shadow_obj) },
 	{ MP_ROM_QSTR(MP_QSTR_suspend), MP_ROM_PTR(&mod_suspend_obj) },
 	{ MP_ROM_QSTR(MP_QSTR_powerdown), MP_ROM_PTR(&mod_powerdown_obj) },
@@ -28,6 +28,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <zephyr.h>
 #include <misc/reboot.h>
 
 #include "py/obj.h"
@@ -37,11 +38,13 @@
 #include "extmod/machine_pulse.h"
 #include "extmod/machine_i2c.h"
 #include "modmachine.h"
+#include "degu_ota.h"
 
 #if MICROPY_PY_MACHINE
 
 STATIC mp_obj_t machine_reset(void) {
-    sys_reboot(SYS_REBOOT_COLD);
+    // not taken for a crash of a script on trial
+    degu_ota_reboot();
     // Won't get here, Zephyr has infiniloop on its side
     return mp_const_none;
 }
@@ -65,6 +68,7 @@ STATIC const mp_rom_map_elem_t machine_module_globals_table[] = {
     { MP_ROM_QSTR(MP_QSTR_Pin), MP_ROM_PTR(&machine_pin_type) },
     { MP_ROM_QSTR(MP_QSTR_Signal), MP_ROM_PTR(&machine_signal_type) },
     { MP_ROM_QSTR(MP_QSTR_UART), MP_ROM_PTR(&machine_uart_type) },
+    { MP_ROM_QSTR(MP_QSTR_Timer), MP_ROM_PTR(&machine_timer_type) },
 
     // reset causes
     /*{ MP_ROM_QSTR(MP_QSTR_PWRON_RESET), MP_ROM_INT(REASON_DEFAULT_RST) },*/
@@ -3,11 +3,13 @@
 
 #include "py/obj.h"
 #include "uart.h"
+#include <gpio.h>
 
 extern const mp_obj_type_t machine_pin_type;
 extern const mp_obj_type_t machine_adc_type;
 extern const mp_obj_type_t machine_i2c_type;
 extern const mp_obj_type_t machine_uart_type;
+extern const mp_obj_type_t machine_timer_type;
 
 MP_DECLARE_CONST_FUN_OBJ_0(machine_info_obj);
 
@@ -15,8 +17,32 @@ typedef struct _machine_pin_obj_t {
     mp_obj_base_t base;
     struct device *port;
     uint32_t pin;
+    uint32_t flags; // as last configured, without the interrupt flags
 } machine_pin_obj_t;
 
+// Pin.irq(), kept on machine_pin_irq_list until the VM stops
+typedef struct _machine_pin_irq_obj_t {
+    mp_obj_base_t base;
+    struct _machine_pin_irq_obj_t *next;
+    machine_pin_obj_t *pin;
+    mp_obj_t handler;
+    struct gpio_callback cb;
+    uint32_t trigger;
+    uint32_t stamp; // cycle count of the edge being handled
+    // updated from the interrupt
+    volatile uint32_t dropped;
+    // updated when the handler is called
+    uint32_t events;
+    uint32_t latency_max; // us
+    uint64_t latency_sum;
+} machine_pin_irq_obj_t;
+
+void machine_pin_deinit(void);
+
+// ms to the next expiry of a machine.Timer, K_FOREVER if none is running
+s32_t machine_timer_next_ms(void);
+void machine_timer_deinit_all(void);
+
 typedef struct _machine_adc_obj_t {
 	mp_obj_base_t base;
 	struct device *dev;
@@ -0,0 +1,87 @@
+#
+# Copyright (c) 2019 Atmark Techno, Inc.
+#
+# SPDX-License-Identifier: MIT
+
+"""Helpers for Grove modules connected to Degu.
+
+Frozen into the firmware as bytecode, see FROZEN_MPY_DIR in the Makefile.
+"""
+
+import machine
+import utime
+
+
+class Analog:
+    """Analog module on a Grove ADC connector."""
+
+    def __init__(self, channel):
+        self.adc = machine.ADC(channel)
+
+    def read(self):
+        return self.adc.read()
+
+    def mv(self):
+        # 12-bit sample, internal 0.6V reference with the default 1/6 gain
+        return self.adc.read() * 3600 // 4096
+
+
+class Digital:
+    """Digital module (button, relay, LED...) on a Grove GPIO connector."""
+
+    def __init__(self, port, pin, mode=machine.Pin.IN, pull=None):
+        self.pin = machine.Pin((port, pin), mode, pull)
+
+    def value(self, v=None):
+        if v is None:
+            return self.pin.value()
+        self.pin.value(v)
+
+
+class I2CDevice:
+    """Register access to a module on a Grove I2C connector."""
+
+    def __init__(self, bus, addr):
+        self.i2c = machine.I2C(bus)
+        self.addr = addr
+
+    def write(self, buf):
+        self.i2c.writeto(self.addr, buf)
+
+    def read(self, n):
+        return self.i2c.readfrom(self.addr, n)
+
+    def read_reg(self, reg, n):
+        self.i2c.writeto(self.addr, bytes((reg,)))
+        return self.i2c.readfrom(self.addr, n)
+
+    def write_reg(self, reg, buf):
+        self.i2c.writeto(self.addr, bytes((reg,)) + buf)
+
+
+def _crc8(buf):
+    crc = 0xff
+    for b in buf:
+        crc ^= b
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x31 if crc & 0x80 else crc << 1) & 0xff
+    return crc
+
+
+class SHT31(I2CDevice):
+    """Grove Temperature & Humidity Sensor (SHT31)."""
+
+    def __init__(self, bus=0, addr=0x44):
+        super().__init__(bus, addr)
+
+    def measure(self):
+        """Return (temperature in 0.01 C, humidity in 0.01 %RH)."""
+        # single shot, high repeatability, no clock stretching
+        self.write(b'\x24\x00')
+        utime.sleep_ms(16)
+        buf = self.read(6)
+        if _crc8(buf[0:2]) != buf[2] or _crc8(buf[3:5]) != buf[5]:
+            raise OSError('crc')
+        t = buf[0] << 8 | buf[1]
+        h = buf[3] << 8 | buf[4]
+        return (t * 17500 >> 16) - 4500, h * 10000 >> 16
@@ -0,0 +1,58 @@
+#
+# Copyright (c) 2019 Atmark Techno, Inc.
+#
+# SPDX-License-Identifier: MIT
+
+"""Periodic reporting of sensor values to the thing shadow.
+
+    import telemetry
+    t = telemetry.Telemetry(interval=60)
+    while True:
+        t.set('temp', read_temp())
+        t.poll()
+
+Frozen into the firmware as bytecode, see FROZEN_MPY_DIR in the Makefile.
+"""
+
+import degu
+import ujson
+import utime
+
+
+def _ok(code):
+    # CoAP 2.xx, errors from the stack are negative
+    return 0x40 <= code < 0x60
+
+
+class Telemetry:
+
+    def __init__(self, interval=60):
+        self.interval = interval * 1000
+        self.values = {}
+        self.last = None
+        self.sent = 0
+        self.failed = 0
+
+    def set(self, key, value):
+        self.values[key] = value
+
+    def report(self):
+        """Send the values now, return the CoAP response code."""
+        doc = ujson.dumps({'state': {'reported': self.values}})
+        code = degu.update_shadow(doc)
+        self.last = utime.ticks_ms()
+        if _ok(code):
+            self.sent += 1
+        else:
+            self.failed += 1
+        return code
+
+    def due(self):
+        return (self.last is None or
+                utime.ticks_diff(utime.ticks_ms(), self.last) >= self.interval)
+
+    def poll(self):
+        """Report if the interval has elapsed, return True if it was sent."""
+        if not self.due():
+            return False
+        return _ok(self.report())
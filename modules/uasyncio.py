@@ -0,0 +1,326 @@
+#
+# Copyright (c) 2019 Atmark Techno, Inc.
+#
+# SPDX-License-Identifier: MIT
+
+"""Cooperative scheduler for async/await scripts.
+
+While every task waits, the loop blocks in uselect.poll() until the next
+timer expires, i.e. in a single k_poll() over the streams the tasks wait
+for, and the system may sleep instead of spinning.
+
+    import uasyncio
+
+    async def blink(led):
+        while True:
+            led.value(not led.value())
+            await uasyncio.sleep_ms(500)
+
+    uasyncio.run(blink(led))
+
+Frozen into the firmware as bytecode, see FROZEN_MPY_DIR in the Makefile.
+"""
+
+import sys
+import uselect
+from utime import ticks_ms, ticks_add, ticks_diff
+
+
+class CancelledError(Exception):
+    pass
+
+
+class TimeoutError(Exception):
+    pass
+
+
+# what a coroutine yields to the loop, with an argument
+_SLEEP = 0      # ms
+_READ = 1       # stream
+_WRITE = 2      # stream
+_WAIT = 3       # task or event, woken through its waiters
+
+
+class Task:
+
+    def __init__(self, coro):
+        self.coro = coro
+        self.done = False
+        self.result = None
+        self.exc = None
+        self.waiters = []
+        self.wait = None        # what the task is blocked on
+        self.pending = None     # exception thrown in at its next step
+
+    def cancel(self):
+        if self.done:
+            return
+        self.pending = CancelledError()
+        if self.wait is not None:
+            _loop._unblock(self)
+
+    def __iter__(self):
+        while not self.done:
+            yield (_WAIT, self)
+        if self.exc is not None:
+            raise self.exc
+        return self.result
+
+    __await__ = __iter__
+
+
+class Event:
+
+    def __init__(self):
+        self.state = False
+        self.waiters = []
+
+    def is_set(self):
+        return self.state
+
+    def set(self):
+        self.state = True
+        while self.waiters:
+            _loop._unblock(self.waiters[0])
+
+    def clear(self):
+        self.state = False
+
+    def wait(self):
+        while not self.state:
+            yield (_WAIT, self)
+        return True
+
+
+class Loop:
+
+    def __init__(self):
+        self.runq = []
+        self.sleeping = []      # (deadline, task), soonest first
+        self.io = {}            # stream -> [reader, writer]
+        self.poller = uselect.poll()
+        self.main = None
+        self.stopped = False
+
+    def create_task(self, coro):
+        t = coro if isinstance(coro, Task) else Task(coro)
+        self.runq.append(t)
+        return t
+
+    def _register(self, s, rw):
+        mask = 0
+        if rw[0] is not None:
+            mask |= uselect.POLLIN
+        if rw[1] is not None:
+            mask |= uselect.POLLOUT
+        if mask:
+            self.poller.register(s, mask)
+        else:
+            self.poller.unregister(s)
+            del self.io[s]
+
+    def _block(self, t, req):
+        kind, arg = req
+        t.wait = req
+        if kind == _SLEEP:
+            deadline = ticks_add(ticks_ms(), arg)
+            i = 0
+            while (i < len(self.sleeping) and
+                   ticks_diff(self.sleeping[i][0], deadline) <= 0):
+                i += 1
+            self.sleeping.insert(i, (deadline, t))
+        elif kind == _WAIT:
+            arg.waiters.append(t)
+        else:
+            rw = self.io.get(arg)
+            if rw is None:
+                rw = self.io[arg] = [None, None]
+            rw[kind - _READ] = t
+            self._register(arg, rw)
+
+    def _unblock(self, t):
+        kind, arg = t.wait
+        t.wait = None
+        if kind == _SLEEP:
+            for i in range(len(self.sleeping)):
+                if self.sleeping[i][1] is t:
+                    del self.sleeping[i]
+                    break
+        elif kind == _WAIT:
+            arg.waiters.remove(t)
+        else:
+            rw = self.io[arg]
+            rw[kind - _READ] = None
+            self._register(arg, rw)
+        self.runq.append(t)
+
+    def _finish(self, t, result, exc):
+        t.done = True
+        t.result = result
+        t.exc = exc
+        if (exc is not None and t is not self.main and not t.waiters and
+                not isinstance(exc, CancelledError)):
+            print('task raised:')
+            sys.print_exception(exc)
+        while t.waiters:
+            self._unblock(t.waiters[0])
+
+    def _step(self, t):
+        try:
+            if t.pending is not None:
+                exc, t.pending = t.pending, None
+                req = t.coro.throw(exc)
+            else:
+                req = t.coro.send(None)
+        except StopIteration as e:
+            self._finish(t, e.args[0] if e.args else None, None)
+            return
+        except Exception as e:
+            self._finish(t, None, e)
+            return
+        if req is None:
+            self.runq.append(t)
+        else:
+            self._block(t, req)
+
+    def _run_once(self):
+        now = ticks_ms()
+        while self.sleeping and ticks_diff(self.sleeping[0][0], now) <= 0:
+            self._unblock(self.sleeping[0][1])
+
+        if self.runq:
+            timeout = 0
+        elif self.sleeping:
+            # min() and max() are not built in
+            timeout = ticks_diff(self.sleeping[0][0], ticks_ms())
+            if timeout < 0:
+                timeout = 0
+        elif self.io:
+            timeout = -1
+        else:
+            # nothing can wake the remaining tasks
+            return False
+
+        for s, ev in self.poller.poll(timeout):
+            rw = self.io.get(s)
+            if rw is None:
+                continue
+            reader, writer = rw
+            if reader is not None and ev & ~uselect.POLLOUT:
+                self._unblock(reader)
+            if writer is not None and ev & ~uselect.POLLIN:
+                self._unblock(writer)
+
+        runq, self.runq = self.runq, []
+        for t in runq:
+            self._step(t)
+        return True
+
+    def run_until_complete(self, coro):
+        t = self.main = self.create_task(coro)
+        while not t.done and self._run_once():
+            pass
+        if t.exc is not None:
+            raise t.exc
+        return t.result
+
+    def run_forever(self):
+        self.stopped = False
+        while not self.stopped and self._run_once():
+            pass
+
+    def stop(self):
+        self.stopped = True
+
+
+_loop = Loop()
+
+
+def get_event_loop():
+    return _loop
+
+
+def create_task(coro):
+    return _loop.create_task(coro)
+
+
+def run(coro):
+    return _loop.run_until_complete(coro)
+
+
+def sleep_ms(ms):
+    yield (_SLEEP, ms)
+
+
+def sleep(s):
+    yield (_SLEEP, int(s * 1000))
+
+
+def _cancel_after(t, ms, fired):
+    yield (_SLEEP, ms)
+    fired[0] = True
+    t.cancel()
+
+
+def wait_for_ms(aw, ms):
+    t = aw if isinstance(aw, Task) else create_task(aw)
+    fired = [False]
+    timer = create_task(_cancel_after(t, ms, fired))
+    try:
+        return (yield from t)
+    except CancelledError:
+        if fired[0]:
+            raise TimeoutError()
+        # the waiting task itself was cancelled, t goes with it
+        t.cancel()
+        raise
+    finally:
+        timer.cancel()
+
+
+def wait_for(aw, s):
+    return wait_for_ms(aw, int(s * 1000))
+
+
+class StreamReader:
+    """Reads a socket or a UART once data has arrived."""
+
+    def __init__(self, s):
+        self.s = s
+
+    def read(self, n=-1):
+        while True:
+            yield (_READ, self.s)
+            if hasattr(self.s, 'any'):
+                avail = self.s.any()
+                if not avail:
+                    continue
+                if n < 0 or n > avail:
+                    n = avail
+            data = self.s.read(n) if n >= 0 else self.s.read()
+            if data is not None:
+                return data
+
+    def readline(self):
+        buf = b''
+        while True:
+            c = yield from self.read(1)
+            if not c:
+                return buf
+            buf += c
+            if c == b'\n':
+                return buf
+
+
+class StreamWriter:
+
+    def __init__(self, s):
+        self.s = s
+
+    def awrite(self, buf):
+        off = 0
+        while off < len(buf):
+            yield (_WRITE, self.s)
+            n = self.s.write(buf[off:])
+            if n:
+                off += n
@@ -0,0 +1,379 @@
+/*
+ * This file is part of the MicroPython project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// uselect.poll() which blocks in a single k_poll() over the registered
+// streams and the wake signal of the thread, instead of spinning, so that
+// the idle thread runs and may enter a sleep state while a script waits.
+
+#include <zephyr.h>
+#include <init.h>
+#include "py/mpconfig.h"
+#include "py/mpthread.h"
+#include "zephyr_poll.h"
+
+// One wake signal per Python thread, each resets only its own: a wake
+// raised for one waiter is never cleared by another.
+#if MICROPY_PY_THREAD
+#define WAKE_SIGNALS (CONFIG_DEGU_MPY_THREAD_COUNT + 1)
+#else
+#define WAKE_SIGNALS (1)
+#endif
+
+STATIC struct k_poll_signal wake_signal[WAKE_SIGNALS];
+
+STATIC int wake_init(struct device *unused) {
+    ARG_UNUSED(unused);
+    for (size_t i = 0; i < WAKE_SIGNALS; i++) {
+        k_poll_signal_init(&wake_signal[i]);
+    }
+    return 0;
+}
+SYS_INIT(wake_init, POST_KERNEL, 0);
+
+struct k_poll_signal *mp_zephyr_wake_signal(void) {
+    #if MICROPY_PY_THREAD
+    return &wake_signal[mp_thread_index()];
+    #else
+    return &wake_signal[0];
+    #endif
+}
+
+void mp_zephyr_wake_up(void) {
+    for (size_t i = 0; i < WAKE_SIGNALS; i++) {
+        k_poll_signal_raise(&wake_signal[i], 0);
+    }
+}
+
+#if MICROPY_PY_ZEPHYR_USELECT
+
+#ifdef CONFIG_SYS_POWER_MANAGEMENT
+#include <power.h>
+#endif
+
+#include "py/runtime.h"
+#include "py/stream.h"
+#include "py/mperrno.h"
+#include "modmachine.h"
+
+// Streams without MP_STREAM_KPOLL are checked on this period
+#define POLL_PERIOD_MS 20
+#define POLL_MAX_EVENTS 8
+
+typedef struct _mp_obj_poll_t {
+    mp_obj_base_t base;
+    mp_map_t map; // stream -> event mask
+} mp_obj_poll_t;
+
+STATIC mp_uint_t poll_ioctl(mp_obj_t obj, mp_uint_t request, uintptr_t arg, int *errcode) {
+    const mp_stream_p_t *stream_p = mp_get_stream_raise(obj, MP_STREAM_OP_IOCTL);
+    return stream_p->ioctl(obj, request, arg, errcode);
+}
+
+STATIC bool poll_pending(void) {
+    #if MICROPY_ENABLE_SCHEDULER
+    if (MP_STATE_VM(sched_state) == MP_SCHED_PENDING) {
+        return true;
+    }
+    #endif
+    return MP_STATE_VM(mp_pending_exception) != MP_OBJ_NULL;
+}
+
+STATIC void poll_handle_pending(void) {
+    #if MICROPY_ENABLE_SCHEDULER
+    mp_handle_pending();
+    #else
+    mp_obj_t obj = MP_STATE_VM(mp_pending_exception);
+    if (obj != MP_OBJ_NULL) {
+        MP_STATE_VM(mp_pending_exception) = MP_OBJ_NULL;
+        nlr_raise(obj);
+    }
+    #endif
+}
+
+// Add the k_poll events of every stream, the wake signal first
+STATIC int poll_prepare(mp_obj_poll_t *self, struct k_poll_event *ev, bool *periodic) {
+    struct k_poll_signal *wake = mp_zephyr_wake_signal();
+    int n = 0;
+
+    k_poll_signal_reset(wake);
+    k_poll_event_init(&ev[n++], K_POLL_TYPE_SIGNAL, K_POLL_MODE_NOTIFY_ONLY, wake);
+
+    for (size_t i = 0; i < self->map.alloc; ++i) {
+        if (!mp_map_slot_is_filled(&self->map, i)) {
+            continue;
+        }
+        struct mp_zephyr_kpoll kp = {
+            .ev = ev + n,
+            .max = POLL_MAX_EVENTS - n,
+            .events = MP_OBJ_SMALL_INT_VALUE(self->map.table[i].value),
+        };
+        int errcode;
+        mp_uint_t ret = poll_ioctl(self->map.table[i].key, MP_STREAM_KPOLL, (uintptr_t)&kp, &errcode);
+        if (ret == MP_STREAM_ERROR) {
+            *periodic = true;
+        } else {
+            n += ret;
+        }
+    }
+
+    return n;
+}
+
+// Check every stream, append (stream, events) to list for the ready ones
+STATIC size_t poll_check(mp_obj_poll_t *self, mp_obj_t list) {
+    size_t n_ready = 0;
+
+    for (size_t i = 0; i < self->map.alloc; ++i) {
+        if (!mp_map_slot_is_filled(&self->map, i)) {
+            continue;
+        }
+        mp_obj_t obj = self->map.table[i].key;
+        mp_uint_t events = MP_OBJ_SMALL_INT_VALUE(self->map.table[i].value);
+        int errcode;
+        mp_uint_t ret = poll_ioctl(obj, MP_STREAM_POLL, events, &errcode);
+        if (ret == MP_STREAM_ERROR) {
+            ret = MP_STREAM_POLL_ERR;
+        }
+        if (ret == 0) {
+            continue;
+        }
+        n_ready++;
+        if (list != MP_OBJ_NULL) {
+            mp_obj_t tuple[2] = { obj, MP_OBJ_NEW_SMALL_INT(ret) };
+            mp_obj_list_append(list, mp_obj_new_tuple(2, tuple));
+        }
+    }
+
+    return n_ready;
+}
+
+#ifdef CONFIG_DEGU_ASYNC_SLEEP_2
+// ms to the earliest of the timeout and the next machine.Timer expiry
+STATIC s32_t poll_wake_in(s32_t timeout) {
+    s32_t next = machine_timer_next_ms();
+
+    if (timeout == K_FOREVER || (next != K_FOREVER && next < timeout)) {
+        return next;
+    }
+    return timeout;
+}
+#endif
+
+#ifdef CONFIG_SYS_POWER_MANAGEMENT
+// The sleep states are enabled once for all the waiting threads, the
+// pm_ctrl counts are not stacked per waiter. Updated under the GIL.
+STATIC struct {
+    size_t waiters;
+    size_t timer_only;
+    bool sleep_1;
+    bool sleep_2;
+} pm;
+
+STATIC void pm_state_set(enum power_states state, bool *enabled, bool enable) {
+    if (enable != *enabled) {
+        if (enable) {
+            sys_pm_ctrl_enable_state(state);
+        } else {
+            sys_pm_ctrl_disable_state(state);
+        }
+        *enabled = enable;
+    }
+}
+
+STATIC void pm_update(int waiters, bool timer_only) {
+    pm.waiters += waiters;
+    if (timer_only) {
+        pm.timer_only += waiters;
+    }
+    pm_state_set(SYS_POWER_STATE_SLEEP_1, &pm.sleep_1, pm.waiters > 0);
+    #ifdef CONFIG_DEGU_ASYNC_SLEEP_2
+    // devices are powered down only when every Python thread waits for
+    // time alone, none is blocked on a socket, the UART...
+    #if MICROPY_PY_THREAD
+    size_t threads = mp_thread_count();
+    #else
+    size_t threads = 1;
+    #endif
+    pm_state_set(SYS_POWER_STATE_SLEEP_2, &pm.sleep_2,
+        pm.timer_only > 0 && pm.timer_only == threads);
+    #endif
+}
+#endif
+
+STATIC void poll_sleep(struct k_poll_event *ev, int n, s32_t timeout, bool timer_only) {
+    #ifdef CONFIG_DEGU_ASYNC_SLEEP_2
+    // devices are powered down only when nothing but time is waited for,
+    // and long enough to be worth powering them up again
+    s32_t wake = poll_wake_in(timeout);
+    timer_only = timer_only &&
+        (wake == K_FOREVER || wake >= CONFIG_DEGU_ASYNC_SLEEP_2_MIN_TIME);
+    #endif
+
+    #ifdef CONFIG_SYS_POWER_MANAGEMENT
+    pm_update(1, timer_only);
+    #endif
+
+    MP_THREAD_GIL_EXIT();
+    k_poll(ev, n, timeout);
+    MP_THREAD_GIL_ENTER();
+
+    #ifdef CONFIG_SYS_POWER_MANAGEMENT
+    pm_update(-1, timer_only);
+    #endif
+}
+
+// utime.sleep() and mp_hal_delay_ms(): scheduled callbacks, such as
+// Pin.irq() handlers, and Ctrl-C are handled when they are raised rather
+// than after the delay. Devices are never powered down here.
+void mp_hal_delay_ms(mp_uint_t delay) {
+    struct k_poll_signal *wake = mp_zephyr_wake_signal();
+    struct k_poll_event ev;
+    s64_t end = k_uptime_get() + delay;
+
+    for (;;) {
+        k_poll_signal_reset(wake);
+        // what was raised before the reset
+        poll_handle_pending();
+        s64_t left = end - k_uptime_get();
+        if (left <= 0) {
+            break;
+        }
+        k_poll_event_init(&ev, K_POLL_TYPE_SIGNAL, K_POLL_MODE_NOTIFY_ONLY, wake);
+        poll_sleep(&ev, 1, (s32_t)left, false);
+    }
+}
+
+STATIC mp_obj_t poll_register(size_t n_args, const mp_obj_t *args) {
+    mp_obj_poll_t *self = MP_OBJ_TO_PTR(args[0]);
+    mp_uint_t events = MP_STREAM_POLL_RD | MP_STREAM_POLL_WR;
+    if (n_args == 3) {
+        events = mp_obj_get_int(args[2]);
+    }
+    mp_get_stream_raise(args[1], MP_STREAM_OP_IOCTL);
+    mp_map_lookup(&self->map, args[1], MP_MAP_LOOKUP_ADD_IF_NOT_FOUND)->value = MP_OBJ_NEW_SMALL_INT(events);
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(poll_register_obj, 2, 3, poll_register);
+
+STATIC mp_obj_t poll_unregister(mp_obj_t self_in, mp_obj_t obj_in) {
+    mp_obj_poll_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_map_lookup(&self->map, obj_in, MP_MAP_LOOKUP_REMOVE_IF_FOUND);
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_2(poll_unregister_obj, poll_unregister);
+
+STATIC mp_obj_t poll_modify(mp_obj_t self_in, mp_obj_t obj_in, mp_obj_t eventmask_in) {
+    mp_obj_poll_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_map_elem_t *elem = mp_map_lookup(&self->map, obj_in, MP_MAP_LOOKUP);
+    if (elem == NULL) {
+        mp_raise_OSError(MP_ENOENT);
+    }
+    elem->value = MP_OBJ_NEW_SMALL_INT(mp_obj_get_int(eventmask_in));
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_3(poll_modify_obj, poll_modify);
+
+// poll(timeout_ms=-1), returns a list of (stream, events)
+STATIC mp_obj_t poll_poll(size_t n_args, const mp_obj_t *args) {
+    mp_obj_poll_t *self = MP_OBJ_TO_PTR(args[0]);
+    struct k_poll_event ev[POLL_MAX_EVENTS];
+    mp_int_t timeout = -1;
+    uint32_t start = k_uptime_get_32();
+
+    if (n_args == 2 && args[1] != mp_const_none) {
+        timeout = mp_obj_get_int(args[1]);
+    }
+
+    mp_obj_t list = mp_obj_new_list(0, NULL);
+    for (;;) {
+        bool periodic = false;
+        int n_ev = poll_prepare(self, ev, &periodic);
+        // checked after the events are armed, nothing is missed in between
+        if (poll_check(self, list) || timeout == 0) {
+            break;
+        }
+        if (poll_pending()) {
+            poll_handle_pending();
+            continue;
+        }
+
+        s32_t wait = K_FOREVER;
+        if (timeout > 0) {
+            uint32_t elapsed = k_uptime_get_32() - start;
+            if (elapsed >= (uint32_t)timeout) {
+                break;
+            }
+            wait = timeout - elapsed;
+        }
+        if (periodic && (wait == K_FOREVER || wait > POLL_PERIOD_MS)) {
+            wait = POLL_PERIOD_MS;
+        }
+        poll_sleep(ev, n_ev, wait, self->map.used == 0);
+        poll_handle_pending();
+    }
+
+    return list;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(poll_poll_obj, 1, 2, poll_poll);
+
+STATIC const mp_rom_map_elem_t poll_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_register), MP_ROM_PTR(&poll_register_obj) },
+    { MP_ROM_QSTR(MP_QSTR_unregister), MP_ROM_PTR(&poll_unregister_obj) },
+    { MP_ROM_QSTR(MP_QSTR_modify), MP_ROM_PTR(&poll_modify_obj) },
+    { MP_ROM_QSTR(MP_QSTR_poll), MP_ROM_PTR(&poll_poll_obj) },
+};
+STATIC MP_DEFINE_CONST_DICT(poll_locals_dict, poll_locals_dict_table);
+
+STATIC const mp_obj_type_t mp_type_poll = {
+    { &mp_type_type },
+    .name = MP_QSTR_poll,
+    .locals_dict = (void*)&poll_locals_dict,
+};
+
+STATIC mp_obj_t select_poll(void) {
+    mp_obj_poll_t *poll = m_new_obj(mp_obj_poll_t);
+    poll->base.type = &mp_type_poll;
+    mp_map_init(&poll->map, 0);
+    return MP_OBJ_FROM_PTR(poll);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mp_select_poll_obj, select_poll);
+
+STATIC const mp_rom_map_elem_t mp_module_select_globals_table[] = {
+    { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_uselect) },
+    { MP_ROM_QSTR(MP_QSTR_poll), MP_ROM_PTR(&mp_select_poll_obj) },
+    { MP_ROM_QSTR(MP_QSTR_POLLIN), MP_ROM_INT(MP_STREAM_POLL_RD) },
+    { MP_ROM_QSTR(MP_QSTR_POLLOUT), MP_ROM_INT(MP_STREAM_POLL_WR) },
+    { MP_ROM_QSTR(MP_QSTR_POLLERR), MP_ROM_INT(MP_STREAM_POLL_ERR) },
+    { MP_ROM_QSTR(MP_QSTR_POLLHUP), MP_ROM_INT(MP_STREAM_POLL_HUP) },
+};
+STATIC MP_DEFINE_CONST_DICT(mp_module_select_globals, mp_module_select_globals_table);
+
+const mp_obj_module_t mp_module_uselect = {
+    .base = { &mp_type_module },
+    .globals = (mp_obj_dict_t*)&mp_module_select_globals,
+};
+
+#endif // MICROPY_PY_ZEPHYR_USELECT
@@ -39,7 +39,9 @@
 #include <net/dns_resolve.h>
 #ifdef CONFIG_NET_SOCKETS
 #include <net/socket.h>
+#include <sys/fdtable.h>
 #endif
+#include "zephyr_poll.h"
 
 #define DEBUG_PRINT 0
 #if DEBUG_PRINT // print debugging info
@@ -177,7 +179,9 @@ STATIC mp_obj_t socket_connect(mp_obj_t self_in, mp_obj_t addr_in) {
     struct sockaddr sockaddr;
     parse_inet_addr(socket, addr_in, &sockaddr);
 
+    MP_THREAD_GIL_EXIT();
     int res = zsock_connect(socket->ctx, &sockaddr, sizeof(sockaddr));
+    MP_THREAD_GIL_ENTER();
     RAISE_SOCK_ERRNO(res);
 
     return mp_const_none;
@@ -202,7 +206,9 @@ STATIC mp_obj_t socket_accept(mp_obj_t self_in) {
 
     struct sockaddr sockaddr;
     socklen_t addrlen = sizeof(sockaddr);
+    MP_THREAD_GIL_EXIT();
     int ctx = zsock_accept(socket->ctx, &sockaddr, &addrlen);
+    MP_THREAD_GIL_ENTER();
 
     socket_obj_t *socket2 = socket_new();
     socket2->ctx = ctx;
@@ -224,7 +230,9 @@ STATIC mp_uint_t sock_write(mp_obj_t self_in, const void *buf, mp_uint_t size, i
         return MP_STREAM_ERROR;
     }
 
+    MP_THREAD_GIL_EXIT();
     ssize_t len = zsock_send(socket->ctx, buf, size, 0);
+    MP_THREAD_GIL_ENTER();
     if (len == -1) {
         *errcode = errno;
         return MP_STREAM_ERROR;
@@ -299,10 +307,51 @@ STATIC mp_obj_t socket_makefile(size_t n_args, const mp_obj_t *args) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(socket_makefile_obj, 1, 3, socket_makefile);
 
+// The k_poll events zsock_poll() would wait for on this socket
+STATIC mp_uint_t sock_kpoll(socket_obj_t *socket, struct mp_zephyr_kpoll *kp, int *errcode) {
+    struct zsock_pollfd pfd = { .fd = socket->ctx, .events = kp->events };
+    struct k_poll_event *pev = kp->ev;
+    const struct fd_op_vtable *vtable;
+    void *obj;
+
+    obj = z_get_fd_obj_and_vtable(socket->ctx, &vtable);
+    if (obj == NULL || kp->max == 0) {
+        *errcode = MP_EINVAL;
+        return MP_STREAM_ERROR;
+    }
+    if (z_fdtable_call_ioctl(vtable, obj, ZFD_IOCTL_POLL_PREPARE, &pfd, &pev, kp->ev + kp->max) < 0) {
+        if (errno == EALREADY) {
+            // ready already, the check that follows will see it
+            return 0;
+        }
+        *errcode = errno;
+        return MP_STREAM_ERROR;
+    }
+    return pev - kp->ev;
+}
+
 STATIC mp_uint_t sock_ioctl(mp_obj_t o_in, mp_uint_t request, uintptr_t arg, int *errcode) {
     socket_obj_t *socket = o_in;
-    (void)arg;
     switch (request) {
+        case MP_STREAM_POLL: {
+            // ZSOCK_POLL* have the values of MP_STREAM_POLL_*
+            struct zsock_pollfd pfd = { .fd = socket->ctx, .events = arg };
+            if (socket->ctx == -1) {
+                return MP_STREAM_POLL_HUP;
+            }
+            if (zsock_poll(&pfd, 1, 0) < 0) {
+                *errcode = errno;
+                return MP_STREAM_ERROR;
+            }
+            return pfd.revents;
+        }
+
+        case MP_STREAM_KPOLL:
+            if (socket->ctx == -1) {
+                return 0;
+            }
+            return sock_kpoll(socket, (struct mp_zephyr_kpoll *)arg, errcode);
+
         case MP_STREAM_CLOSE:
             if (socket->ctx != -1) {
                 int res = zsock_close(socket->ctx);
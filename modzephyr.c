@@ -31,6 +31,15 @@
 #include <misc/stack.h>
 
 #include "py/runtime.h"
+#include "py/builtin.h"
+#include "main.h"
+#ifdef CONFIG_DEGU_HEAP
+#include "degu_heap.h"
+#endif
+#ifdef CONFIG_DEGU_GC_STATS
+#include "py/gc.h"
+#include "zephyr_gc.h"
+#endif
 
 STATIC void mp_stack_dump(const struct k_thread *thread, void *user_data) {
 	stack_analyze((char *)user_data, (char *)thread->stack_info.start,
@@ -53,6 +62,222 @@ STATIC mp_obj_t mod_stacks_analyze(void) {
 }
 STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_stacks_analyze_obj, mod_stacks_analyze);
 
+// (how main.py was loaded, uptime at its first instruction in ms,
+//  ms from the VM start to the first instruction, peak heap while loading)
+STATIC mp_obj_t mod_boot_stats(void) {
+    static const qstr kinds[] = { MP_QSTR_source, MP_QSTR_cache, MP_QSTR_mpy };
+    mp_obj_t items[4] = {
+        MP_OBJ_NEW_QSTR(kinds[mp_boot_stats.kind]),
+        mp_obj_new_int_from_uint(mp_boot_stats.first_ms),
+        mp_obj_new_int_from_uint(mp_boot_stats.load_ms),
+        mp_obj_new_int_from_uint(mp_boot_stats.heap_peak),
+    };
+    return mp_obj_new_tuple(4, items);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_boot_stats_obj, mod_boot_stats);
+
+#ifdef CONFIG_DEGU_HEAP
+STATIC mp_obj_t heap_owner_stats(enum degu_heap_owner owner) {
+    struct degu_heap_stats stats;
+
+    degu_heap_get_stats(owner, &stats);
+    mp_obj_t items[4] = {
+        mp_obj_new_int_from_uint(stats.used),
+        mp_obj_new_int_from_uint(stats.peak),
+        mp_obj_new_int_from_uint(stats.allocs),
+        mp_obj_new_int_from_uint(stats.failures),
+    };
+    return mp_obj_new_tuple(4, items);
+}
+
+// (free bytes of the shared pool, largest free block,
+//  (used, peak, allocs, failures) of the MicroPython heap, same for mbedTLS)
+STATIC mp_obj_t mod_heap_stats(void) {
+    mp_obj_t items[4] = {
+        mp_obj_new_int_from_uint(degu_heap_total_free()),
+        mp_obj_new_int_from_uint(degu_heap_largest_free()),
+        heap_owner_stats(DEGU_HEAP_MPY),
+        heap_owner_stats(DEGU_HEAP_TLS),
+    };
+    return mp_obj_new_tuple(4, items);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_heap_stats_obj, mod_heap_stats);
+#endif // CONFIG_DEGU_HEAP
+
+#ifdef CONFIG_DEGU_PROFILE
+STATIC mp_int_t prof_period;
+
+// zephyr.profile_start(period_ms=10): sample the running code, until
+// profile_dump()
+STATIC mp_obj_t mod_profile_start(size_t n_args, const mp_obj_t *args) {
+    mp_int_t period = n_args > 0 ? mp_obj_get_int(args[0]) : 10;
+
+    if (period <= 0) {
+        mp_raise_ValueError("period must be at least 1 ms");
+    }
+    prof_period = period;
+    mp_zephyr_prof_start(period);
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(mod_profile_start_obj, 0, 1, mod_profile_start);
+
+STATIC void prof_count(mp_obj_t dict, mp_obj_t key) {
+    mp_map_elem_t *elem = mp_map_lookup(mp_obj_dict_get_map(dict), key, MP_MAP_LOOKUP_ADD_IF_NOT_FOUND);
+    mp_int_t n = elem->value == MP_OBJ_NULL ? 0 : MP_OBJ_SMALL_INT_VALUE(elem->value);
+    elem->value = MP_OBJ_NEW_SMALL_INT(n + 1);
+}
+
+// [(samples, native samples, *key)], most samples first
+STATIC mp_obj_t prof_sorted(mp_obj_t total, mp_obj_t native) {
+    mp_map_t *map = mp_obj_dict_get_map(total);
+    mp_obj_t list = mp_obj_new_list(0, NULL);
+
+    for (size_t i = 0; i < map->alloc; i++) {
+        if (!mp_map_slot_is_filled(map, i)) {
+            continue;
+        }
+        mp_obj_t *key;
+        mp_obj_get_array_fixed_n(map->table[i].key, 2, &key);
+        mp_map_elem_t *in_c = mp_map_lookup(mp_obj_dict_get_map(native), map->table[i].key, MP_MAP_LOOKUP);
+        mp_obj_t items[4] = {
+            map->table[i].value,
+            in_c != NULL ? in_c->value : MP_OBJ_NEW_SMALL_INT(0),
+            key[0],
+            key[1],
+        };
+        mp_obj_list_append(list, mp_obj_new_tuple(4, items));
+    }
+
+    mp_obj_t args[3] = { list, MP_OBJ_NEW_QSTR(MP_QSTR_reverse), mp_const_true };
+    return mp_call_function_n_kw(MP_OBJ_FROM_PTR(&mp_builtin_sorted_obj), 1, 1, args);
+}
+
+// Stop sampling and return a dict of
+//  functions: [(samples, native, file, function)]
+//  lines: [(samples, native, file, line)]
+// native being the samples taken while the VM was in a C function called
+// from there, with the counts of samples, native ones, samples whose code
+// was collected (lost) or didn't fit (dropped), samples of the idle
+// thread and of other threads, and the sampling period in ms.
+STATIC mp_obj_t mod_profile_dump(void) {
+    struct mp_zephyr_prof_counts counts;
+    const struct mp_zephyr_prof_sample *buf;
+    mp_obj_t funcs = mp_obj_new_dict(0);
+    mp_obj_t funcs_native = mp_obj_new_dict(0);
+    mp_obj_t lines = mp_obj_new_dict(0);
+    mp_obj_t lines_native = mp_obj_new_dict(0);
+    mp_int_t native = 0;
+    mp_int_t lost = 0;
+
+    mp_zephyr_prof_stop();
+    buf = mp_zephyr_prof_samples(&counts);
+
+    for (size_t i = 0; i < counts.n_samples; i++) {
+        size_t file, block, line;
+        if (!mp_zephyr_prof_locate(&buf[i], &file, &block, &line)) {
+            lost++;
+            continue;
+        }
+        mp_obj_t fkey[2] = { MP_OBJ_NEW_QSTR(file), MP_OBJ_NEW_QSTR(block) };
+        mp_obj_t lkey[2] = { MP_OBJ_NEW_QSTR(file), MP_OBJ_NEW_SMALL_INT(line) };
+        mp_obj_t f = mp_obj_new_tuple(2, fkey);
+        mp_obj_t l = mp_obj_new_tuple(2, lkey);
+        prof_count(funcs, f);
+        prof_count(lines, l);
+        if (buf[i].fun & 1) {
+            native++;
+            prof_count(funcs_native, f);
+            prof_count(lines_native, l);
+        }
+    }
+
+    mp_obj_t dump = mp_obj_new_dict(0);
+    mp_obj_dict_store(dump, MP_OBJ_NEW_QSTR(MP_QSTR_samples), mp_obj_new_int_from_uint(counts.n_samples));
+    mp_obj_dict_store(dump, MP_OBJ_NEW_QSTR(MP_QSTR_native), MP_OBJ_NEW_SMALL_INT(native));
+    mp_obj_dict_store(dump, MP_OBJ_NEW_QSTR(MP_QSTR_lost), MP_OBJ_NEW_SMALL_INT(lost));
+    mp_obj_dict_store(dump, MP_OBJ_NEW_QSTR(MP_QSTR_dropped), mp_obj_new_int_from_uint(counts.dropped));
+    mp_obj_dict_store(dump, MP_OBJ_NEW_QSTR(MP_QSTR_idle), mp_obj_new_int_from_uint(counts.idle));
+    mp_obj_dict_store(dump, MP_OBJ_NEW_QSTR(MP_QSTR_other), mp_obj_new_int_from_uint(counts.other));
+    mp_obj_dict_store(dump, MP_OBJ_NEW_QSTR(MP_QSTR_period), MP_OBJ_NEW_SMALL_INT(prof_period));
+    mp_obj_dict_store(dump, MP_OBJ_NEW_QSTR(MP_QSTR_functions), prof_sorted(funcs, funcs_native));
+    mp_obj_dict_store(dump, MP_OBJ_NEW_QSTR(MP_QSTR_lines), prof_sorted(lines, lines_native));
+    return dump;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_profile_dump_obj, mod_profile_dump);
+#endif // CONFIG_DEGU_PROFILE
+
+#ifdef CONFIG_DEGU_GC_STATS
+// (collections, last pause in us, max pause in us, bytes allocated since
+// the last collection, free bytes, largest free block, fragmentation in %)
+// fragmentation being the part of the free heap not in the largest block
+STATIC mp_obj_t mod_gc_stats(void) {
+    gc_info_t info;
+    gc_info(&info);
+    size_t largest = info.max_free * MICROPY_BYTES_PER_GC_BLOCK;
+    mp_int_t frag = info.free ? 100 - (mp_int_t)(100 * (uint64_t)largest / info.free) : 0;
+
+    mp_obj_t tuple[7] = {
+        mp_obj_new_int_from_uint(mp_zephyr_gc_stats.collections),
+        mp_obj_new_int_from_uint(mp_zephyr_gc_stats.last_us),
+        mp_obj_new_int_from_uint(mp_zephyr_gc_stats.max_us),
+        mp_obj_new_int_from_uint(mp_zephyr_gc_stats.since_gc),
+        mp_obj_new_int_from_uint(info.free),
+        mp_obj_new_int_from_uint(largest),
+        MP_OBJ_NEW_SMALL_INT(frag),
+    };
+    return mp_obj_new_tuple(7, tuple);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_gc_stats_obj, mod_gc_stats);
+#endif // CONFIG_DEGU_GC_STATS
+
+#ifdef CONFIG_DEGU_GC_TRACE
+// zephyr.gc_trace_start(threshold=256): record allocations of at least
+// threshold bytes and those which made the heap collect, until
+// gc_trace_dump()
+STATIC mp_obj_t mod_gc_trace_start(size_t n_args, const mp_obj_t *args) {
+    mp_int_t threshold = n_args > 0 ? mp_obj_get_int(args[0]) : 256;
+    if (threshold < 0) {
+        mp_raise_ValueError(NULL);
+    }
+    mp_zephyr_gc_trace_start(threshold);
+    return mp_const_none;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(mod_gc_trace_start_obj, 0, 1, mod_gc_trace_start);
+
+// Stop tracing and return [(size, pause in us, file, function, line)],
+// oldest first, pause being that of the collection the allocation made
+// or 0. The location is None, None, 0 outside Python code or when its
+// code has been collected since. It is the position the profiler keeps,
+// see zephyr_prof.h: the function is the one allocating, the line that
+// of its last jump or branch, or of its start when it has none before
+// the allocation.
+STATIC mp_obj_t mod_gc_trace_dump(void) {
+    size_t n = mp_zephyr_gc_trace_stop();
+    mp_obj_t list = mp_obj_new_list(0, NULL);
+
+    for (size_t i = 0; i < n; i++) {
+        const struct mp_zephyr_gc_trace *rec = mp_zephyr_gc_trace_at(i);
+        struct mp_zephyr_prof_sample s = { (uintptr_t)rec->fun, rec->ip };
+        size_t file, block, line;
+        mp_obj_t items[5] = {
+            mp_obj_new_int_from_uint(rec->size),
+            mp_obj_new_int_from_uint(rec->pause_us),
+            mp_const_none,
+            mp_const_none,
+            MP_OBJ_NEW_SMALL_INT(0),
+        };
+        if (mp_zephyr_prof_locate(&s, &file, &block, &line)) {
+            items[2] = MP_OBJ_NEW_QSTR(file);
+            items[3] = MP_OBJ_NEW_QSTR(block);
+            items[4] = MP_OBJ_NEW_SMALL_INT(line);
+        }
+        mp_obj_list_append(list, mp_obj_new_tuple(5, items));
+    }
+    return list;
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(mod_gc_trace_dump_obj, mod_gc_trace_dump);
+#endif // CONFIG_DEGU_GC_TRACE
+
 #ifdef CONFIG_NET_SHELL
 
 //int net_shell_cmd_iface(int argc, char *argv[]);
@@ -70,6 +295,21 @@ STATIC const mp_rom_map_elem_t mp_module_time_globals_table[] = {
     { MP_ROM_QSTR(MP_QSTR_is_preempt_thread), MP_ROM_PTR(&mod_is_preempt_thread_obj) },
     { MP_ROM_QSTR(MP_QSTR_current_tid), MP_ROM_PTR(&mod_current_tid_obj) },
     { MP_ROM_QSTR(MP_QSTR_stacks_analyze), MP_ROM_PTR(&mod_stacks_analyze_obj) },
+    { MP_ROM_QSTR(MP_QSTR_boot_stats), MP_ROM_PTR(&mod_boot_stats_obj) },
+    #ifdef CONFIG_DEGU_HEAP
+    { MP_ROM_QSTR(MP_QSTR_heap_stats), MP_ROM_PTR(&mod_heap_stats_obj) },
+    #endif
+    #ifdef CONFIG_DEGU_PROFILE
+    { MP_ROM_QSTR(MP_QSTR_profile_start), MP_ROM_PTR(&mod_profile_start_obj) },
+    { MP_ROM_QSTR(MP_QSTR_profile_dump), MP_ROM_PTR(&mod_profile_dump_obj) },
+    #endif
+    #ifdef CONFIG_DEGU_GC_STATS
+    { MP_ROM_QSTR(MP_QSTR_gc_stats), MP_ROM_PTR(&mod_gc_stats_obj) },
+    #endif
+    #ifdef CONFIG_DEGU_GC_TRACE
+    { MP_ROM_QSTR(MP_QSTR_gc_trace_start), MP_ROM_PTR(&mod_gc_trace_start_obj) },
+    { MP_ROM_QSTR(MP_QSTR_gc_trace_dump), MP_ROM_PTR(&mod_gc_trace_dump_obj) },
+    #endif
 
     #ifdef CONFIG_NET_SHELL
     { MP_ROM_QSTR(MP_QSTR_shell_net_iface), MP_ROM_PTR(&mod_shell_net_iface_obj) },
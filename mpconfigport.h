@@ -41,8 +41,10 @@
 #define MICROPY_HELPER_REPL         (1)
 #define MICROPY_REPL_AUTO_INDENT    (1)
 #define MICROPY_KBD_EXCEPTION       (1)
+#define MICROPY_ENABLE_SCHEDULER    (1)
+#define MICROPY_SCHEDULER_DEPTH     (8)
 #define MICROPY_CPYTHON_COMPAT      (0)
-#define MICROPY_PY_ASYNC_AWAIT      (0)
+#define MICROPY_PY_ASYNC_AWAIT      (1)
 #define MICROPY_PY_ATTRTUPLE        (0)
 #define MICROPY_PY_BUILTINS_ENUMERATE (0)
 #define MICROPY_PY_BUILTINS_FILTER  (0)
@@ -74,17 +76,53 @@
 #define MICROPY_PY_UTIME            (1)
 #define MICROPY_PY_UTIME_MP_HAL     (1)
 #define MICROPY_PY_ZEPHYR           (1)
+#define MICROPY_PY_ZEPHYR_USELECT   (1)
 #define MICROPY_PY_ZSENSOR          (0)
 #define MICROPY_PY_SYS_MODULES      (0)
 #define MICROPY_LONGINT_IMPL (MICROPY_LONGINT_IMPL_LONGLONG)
 #define MICROPY_FLOAT_IMPL (MICROPY_FLOAT_IMPL_FLOAT)
 #define MICROPY_PY_BUILTINS_COMPLEX (0)
 
-// Saving extra crumbs to make sure binary fits in 128K
-#define MICROPY_COMP_CONST_FOLDING  (0)
-#define MICROPY_COMP_CONST (0)
+// The nRF52840 image has a 440K MCUboot slot, see SLOT_SIZE and
+// "make flash-budget". const() is worth its few hundred bytes there.
+#define MICROPY_COMP_CONST_FOLDING  (1)
+#define MICROPY_COMP_CONST (1)
 #define MICROPY_COMP_DOUBLE_TUPLE_ASSIGN (0)
 
+// @micropython.native and @micropython.viper, emitted into a pool in main.c
+#ifdef CONFIG_DEGU_MPY_NATIVE
+#define MICROPY_EMIT_THUMB          (1)
+#define MICROPY_MAKE_POINTER_CALLABLE(p) ((void*)((mp_uint_t)(p) | 1))
+void mp_zephyr_alloc_exec(size_t min_size, void **ptr, size_t *size);
+#define MP_PLAT_ALLOC_EXEC(min_size, ptr, size) mp_zephyr_alloc_exec(min_size, ptr, size)
+#endif
+
+// _thread on Zephyr threads, see mpthreadport.c
+#ifdef CONFIG_DEGU_MPY_THREAD
+#define MICROPY_PY_THREAD           (1)
+#define MICROPY_PY_THREAD_GIL       (1)
+#endif
+
+// zephyr.profile_start(), see zephyr_prof.c. The VM position is noted
+// when a function is entered, at jumps and branches (HOOK_LOOP) and when
+// it returns, where the caller's position noted at the entry is put back.
+// Straight-line code between those is seen at the last point noted.
+// HOOK_INIT runs again when the function catches an exception, so the
+// callers are kept by zephyr_prof.c rather than in locals of the VM.
+#ifdef CONFIG_DEGU_PROFILE
+#include "zephyr_prof.h"
+#define MICROPY_VM_HOOK_INIT \
+    mp_zephyr_prof_enter(code_state, code_state->fun_bc, ip);
+#define MICROPY_VM_HOOK_LOOP { \
+    volatile struct mp_zephyr_prof_vm *prof = mp_zephyr_prof_cur; \
+    prof->fun = code_state->fun_bc; \
+    prof->ip = ip; \
+    prof->ops++; \
+}
+#define MICROPY_VM_HOOK_RETURN \
+    mp_zephyr_prof_return(code_state);
+#endif
+
 #define MICROPY_PY_SYS_PLATFORM "zephyr"
 
 #ifdef CONFIG_BOARD
@@ -100,6 +138,15 @@
 #endif
 
 #define MICROPY_MODULE_FROZEN_STR   (1)
+// MICROPY_MODULE_FROZEN_MPY comes from the Makefile, with FROZEN_MPY_DIR
+
+// main.py is compiled once and cached as .mpy on /NAND:
+#define MICROPY_PERSISTENT_CODE_LOAD (1)
+#define MICROPY_PERSISTENT_CODE_SAVE (1)
+
+// mp_sched_schedule() is called from Pin interrupts
+#define MICROPY_BEGIN_ATOMIC_SECTION()     irq_lock()
+#define MICROPY_END_ATOMIC_SECTION(state)  irq_unlock(state)
 
 typedef int mp_int_t; // must be pointer size
 typedef unsigned mp_uint_t; // must be pointer size
@@ -108,13 +155,17 @@ typedef long mp_off_t;
 #define MP_STATE_PORT MP_STATE_VM
 
 #define MICROPY_PORT_ROOT_POINTERS \
-    const char *readline_hist[8];
+    const char *readline_hist[8]; \
+    struct _machine_pin_irq_obj_t *machine_pin_irq_list; \
+    struct _machine_timer_obj_t *machine_timer_list; \
+    struct _zfs_file_obj_t *zfs_file_list;
 
 extern const struct _mp_obj_module_t mp_module_machine;
 extern const struct _mp_obj_module_t mp_module_time;
 extern const struct _mp_obj_module_t mp_module_usocket;
 extern const struct _mp_obj_module_t mp_module_zephyr;
 extern const struct _mp_obj_module_t mp_module_zsensor;
+extern const struct _mp_obj_module_t mp_module_uselect;
 extern const struct _mp_obj_module_t mp_module_degu;
 
 #if MICROPY_PY_USOCKET
@@ -143,17 +194,27 @@ extern const struct _mp_obj_module_t mp_module_degu;
 #define MICROPY_PY_ZSENSOR_DEF
 #endif
 
+#if MICROPY_PY_ZEPHYR_USELECT
+#define MICROPY_PY_USELECT_DEF { MP_ROM_QSTR(MP_QSTR_uselect), MP_ROM_PTR(&mp_module_uselect) },
+#define MICROPY_PY_USELECT_WEAK_DEF { MP_ROM_QSTR(MP_QSTR_select), MP_ROM_PTR(&mp_module_uselect) },
+#else
+#define MICROPY_PY_USELECT_DEF
+#define MICROPY_PY_USELECT_WEAK_DEF
+#endif
+
 #define MICROPY_PORT_BUILTIN_MODULES \
     { MP_ROM_QSTR(MP_QSTR_machine), MP_ROM_PTR(&mp_module_machine) }, \
     MICROPY_PY_USOCKET_DEF \
     MICROPY_PY_UTIME_DEF \
     MICROPY_PY_ZEPHYR_DEF \
     MICROPY_PY_ZSENSOR_DEF \
+    MICROPY_PY_USELECT_DEF \
     { MP_ROM_QSTR(MP_QSTR_degu), MP_ROM_PTR(&mp_module_degu) }, \
 
 #define MICROPY_PORT_BUILTIN_MODULE_WEAK_LINKS			\
     { MP_ROM_QSTR(MP_QSTR_time), MP_ROM_PTR(&mp_module_time) }, \
     MICROPY_PY_USOCKET_WEAK_DEF \
+    MICROPY_PY_USELECT_WEAK_DEF \
 
 // extra built in names to add to the global namespace
 #define MICROPY_PORT_BUILTINS \
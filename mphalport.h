@@ -1,4 +1,5 @@
 #include <zephyr.h>
+#include "py/mpstate.h"
 #include "lib/utils/interrupt_char.h"
 
 static inline mp_uint_t mp_hal_ticks_us(void) {
@@ -20,6 +21,13 @@ static inline void mp_hal_delay_us(mp_uint_t delay) {
     k_busy_wait(delay);
 }
 
+#if MICROPY_PY_ZEPHYR_USELECT
+// Ends early on mp_zephyr_wake_up() too, see moduselect.c
+void mp_hal_delay_ms(mp_uint_t delay);
+#else
 static inline void mp_hal_delay_ms(mp_uint_t delay) {
+    MP_THREAD_GIL_EXIT();
     k_sleep(delay);
+    MP_THREAD_GIL_ENTER();
 }
+#endif
@@ -0,0 +1,338 @@
+/*
+ * This file is part of the MicroPython project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// _thread on top of Zephyr threads. New threads take their stack from a
+// static pool of CONFIG_DEGU_MPY_THREAD_COUNT stacks; threads[0] is the
+// thread which started the VM, the main thread or the shell. All of
+// them are scanned for root pointers by gc_collect().
+
+#include <stdio.h>
+#include <zephyr.h>
+
+#include "py/runtime.h"
+#include "py/gc.h"
+#include "py/mpthread.h"
+#include "zephyr_poll.h"
+#include "degu_ota.h"
+#ifdef CONFIG_DEGU_PROFILE
+#include "zephyr_prof.h"
+#endif
+
+#if MICROPY_PY_THREAD
+
+enum {
+    THREAD_FREE,
+    THREAD_STARTING, // created, not running Python yet
+    THREAD_RUNNING,
+    THREAD_STOPPING, // told to end by mp_thread_deinit()
+    THREAD_EXITED,   // done with Python, returning from its entry
+};
+
+#define THREAD_STOP_TIMEOUT K_SECONDS(1)
+#define THREAD_C_TIMEOUT K_SECONDS(10)
+#define THREAD_STOP_POLL K_MSEC(10)
+
+typedef struct _mp_thread_t {
+    k_tid_t tid;
+    int state;
+    void *(*entry)(void*);
+    void *arg; // heap object holding the function and its arguments
+    void *stack;
+    size_t stack_len;
+    // between MP_THREAD_GIL_EXIT() and MP_THREAD_GIL_ENTER(), the C code
+    // running there may hold locks of the network stack or of degu_*
+    volatile bool in_c;
+} mp_thread_t;
+
+K_THREAD_STACK_ARRAY_DEFINE(thread_stack, CONFIG_DEGU_MPY_THREAD_COUNT,
+                            CONFIG_DEGU_MPY_THREAD_STACK_SIZE);
+STATIC struct k_thread thread_data[CONFIG_DEGU_MPY_THREAD_COUNT];
+
+STATIC mp_thread_t threads[CONFIG_DEGU_MPY_THREAD_COUNT + 1];
+STATIC K_SEM_DEFINE(threads_sem, 1, 1);
+
+mp_state_thread_t *mp_thread_get_state(void) {
+    return k_thread_custom_data_get();
+}
+
+void mp_thread_set_state(void *state) {
+    k_thread_custom_data_set(state);
+}
+
+void mp_thread_init(void) {
+    k_tid_t tid = k_current_get();
+
+    k_thread_custom_data_set(&mp_state_ctx.thread);
+
+    k_sem_take(&threads_sem, K_FOREVER);
+    threads[0].tid = tid;
+    threads[0].state = THREAD_RUNNING;
+    threads[0].arg = NULL;
+    threads[0].stack = (void *)tid->stack_info.start;
+    threads[0].stack_len = tid->stack_info.size;
+    threads[0].in_c = false;
+    k_sem_give(&threads_sem);
+}
+
+STATIC mp_thread_t *thread_self(void) {
+    k_tid_t tid = k_current_get();
+
+    if (tid >= thread_data && tid < thread_data + ARRAY_SIZE(thread_data)) {
+        return &threads[tid - thread_data + 1];
+    }
+    return &threads[0];
+}
+
+// 0 for the thread which started the VM, or any other thread
+size_t mp_thread_index(void) {
+    return thread_self() - threads;
+}
+
+// The threads running Python, including the one which started the VM
+size_t mp_thread_count(void) {
+    size_t n = 1;
+
+    k_sem_take(&threads_sem, K_FOREVER);
+    for (size_t i = 1; i < ARRAY_SIZE(threads); i++) {
+        if (threads[i].state == THREAD_STARTING || threads[i].state == THREAD_RUNNING) {
+            n++;
+        }
+    }
+    k_sem_give(&threads_sem);
+    return n;
+}
+
+// A stopped thread ends itself where it would take the GIL again, it
+// holds no lock there.
+STATIC void thread_stopped(mp_thread_t *th) {
+    k_sem_take(&threads_sem, K_FOREVER);
+    th->state = THREAD_EXITED;
+    k_sem_give(&threads_sem);
+    k_thread_abort(k_current_get());
+    CODE_UNREACHABLE;
+}
+
+// Threads left running by a script are stopped when the VM is restarted.
+// They are woken from sleeps and polls and end when they next take the
+// GIL. Those still waiting for the GIL or for a _thread lock after
+// THREAD_STOP_TIMEOUT are aborted, they hold nothing. A thread inside a
+// C section may hold a lock there and pointers into the heap, so the
+// heap is not given back before it returns; if it has not within
+// THREAD_C_TIMEOUT, e.g. blocked on a socket, the system is rebooted.
+void mp_thread_deinit(void) {
+    s64_t start = k_uptime_get();
+    size_t i, stopping, in_c;
+    bool told = false;
+
+    k_sem_take(&threads_sem, K_FOREVER);
+    for (i = 1; i < ARRAY_SIZE(threads); i++) {
+        if (threads[i].state == THREAD_STARTING || threads[i].state == THREAD_RUNNING) {
+            threads[i].state = THREAD_STOPPING;
+            k_wakeup(threads[i].tid);
+        }
+    }
+    k_sem_give(&threads_sem);
+    mp_zephyr_wake_up();
+
+    MP_THREAD_GIL_EXIT();
+    for (;;) {
+        k_sleep(THREAD_STOP_POLL);
+        stopping = 0;
+        in_c = 0;
+        k_sem_take(&threads_sem, K_FOREVER);
+        for (i = 1; i < ARRAY_SIZE(threads); i++) {
+            if (threads[i].state == THREAD_STOPPING) {
+                stopping++;
+                if (threads[i].in_c) {
+                    in_c++;
+                }
+            }
+        }
+        k_sem_give(&threads_sem);
+
+        s64_t waited = k_uptime_get() - start;
+        if (stopping == 0 || (in_c == 0 && waited >= THREAD_STOP_TIMEOUT)) {
+            break;
+        }
+        if (waited >= THREAD_C_TIMEOUT) {
+            printf("threads still in C calls, rebooting\n");
+            degu_ota_reboot();
+        }
+        if (!told && waited >= THREAD_STOP_TIMEOUT) {
+            printf("waiting for threads in C calls\n");
+            told = true;
+        }
+    }
+    MP_THREAD_GIL_ENTER();
+
+    k_sem_take(&threads_sem, K_FOREVER);
+    for (i = 1; i < ARRAY_SIZE(threads); i++) {
+        mp_thread_t *th = &threads[i];
+        if (th->state == THREAD_EXITED || th->state == THREAD_STOPPING) {
+            k_thread_abort(th->tid);
+            th->state = THREAD_FREE;
+        }
+    }
+    k_sem_give(&threads_sem);
+}
+
+void mp_thread_gc_others(void) {
+    k_tid_t self = k_current_get();
+
+    k_sem_take(&threads_sem, K_FOREVER);
+    for (size_t i = 0; i < ARRAY_SIZE(threads); i++) {
+        mp_thread_t *th = &threads[i];
+        if (th->state == THREAD_FREE) {
+            continue;
+        }
+        gc_collect_root(&th->arg, 1);
+        if (th->tid == self || (th->state != THREAD_RUNNING && th->state != THREAD_STOPPING)) {
+            continue;
+        }
+        // The registers a switched out thread keeps outside its stack
+        gc_collect_root((void **)&th->tid->callee_saved,
+                        sizeof(th->tid->callee_saved) / sizeof(void *));
+        gc_collect_root(th->stack, th->stack_len / sizeof(void *));
+    }
+    k_sem_give(&threads_sem);
+}
+
+STATIC mp_thread_t *thread_find(k_tid_t tid) {
+    for (size_t i = 0; i < ARRAY_SIZE(threads); i++) {
+        if (threads[i].state != THREAD_FREE && threads[i].tid == tid) {
+            return &threads[i];
+        }
+    }
+    return NULL;
+}
+
+STATIC void thread_entry(void *p1, void *p2, void *p3) {
+    mp_thread_t *th = p1;
+
+    // calls mp_thread_start() and mp_thread_finish()
+    th->entry(th->arg);
+}
+
+// The stack size asked with _thread.stack_size() is ignored, all threads
+// get a stack of CONFIG_DEGU_MPY_THREAD_STACK_SIZE from the pool.
+void mp_thread_create(void *(*entry)(void*), void *arg, size_t *stack_size) {
+    mp_thread_t *th = NULL;
+    size_t i;
+
+    k_sem_take(&threads_sem, K_FOREVER);
+    for (i = 1; i < ARRAY_SIZE(threads); i++) {
+        if (threads[i].state == THREAD_EXITED) {
+            // it may not have returned yet, make sure it is gone
+            k_thread_abort(threads[i].tid);
+            threads[i].state = THREAD_FREE;
+        }
+        if (threads[i].state == THREAD_FREE) {
+            th = &threads[i];
+            break;
+        }
+    }
+    if (th == NULL) {
+        k_sem_give(&threads_sem);
+        mp_raise_msg(&mp_type_OSError, "can't create thread");
+    }
+
+    th->tid = &thread_data[i - 1];
+    th->state = THREAD_STARTING;
+    th->entry = entry;
+    th->arg = arg;
+    th->stack = thread_stack[i - 1];
+    th->stack_len = K_THREAD_STACK_SIZEOF(thread_stack[i - 1]);
+    th->in_c = false;
+    *stack_size = th->stack_len;
+    #ifdef CONFIG_DEGU_PROFILE
+    mp_zephyr_prof_clear(i);
+    #endif
+
+    k_thread_create(th->tid, thread_stack[i - 1], th->stack_len,
+                    thread_entry, th, NULL, NULL,
+                    k_thread_priority_get(k_current_get()), 0, K_NO_WAIT);
+    k_sem_give(&threads_sem);
+}
+
+void mp_thread_start(void) {
+    k_sem_take(&threads_sem, K_FOREVER);
+    mp_thread_t *th = thread_find(k_current_get());
+    if (th != NULL) {
+        th->state = THREAD_RUNNING;
+    }
+    k_sem_give(&threads_sem);
+}
+
+void mp_thread_finish(void) {
+    k_sem_take(&threads_sem, K_FOREVER);
+    mp_thread_t *th = thread_find(k_current_get());
+    if (th != NULL) {
+        th->state = THREAD_EXITED;
+    }
+    k_sem_give(&threads_sem);
+}
+
+void mp_thread_mutex_init(mp_thread_mutex_t *mutex) {
+    k_sem_init(&mutex->sem, 1, 1);
+}
+
+// The GIL is told apart from _thread locks to keep track of which threads
+// are in C sections, and to end the stopped threads.
+int mp_thread_mutex_lock(mp_thread_mutex_t *mutex, int wait) {
+    mp_thread_t *th = thread_self();
+    bool in_c = th->in_c;
+    int ret;
+
+    // blocked on a semaphore, the thread holds nothing which an abort
+    // would leave locked
+    th->in_c = false;
+    if (mutex == &MP_STATE_VM(gil_mutex)) {
+        if (th->state == THREAD_STOPPING) {
+            thread_stopped(th);
+        }
+        k_sem_take(&mutex->sem, K_FOREVER);
+        if (th->state == THREAD_STOPPING) {
+            k_sem_give(&mutex->sem);
+            thread_stopped(th);
+        }
+        #ifdef CONFIG_DEGU_PROFILE
+        mp_zephyr_prof_switch(th - threads);
+        #endif
+        return 1;
+    }
+    ret = k_sem_take(&mutex->sem, wait ? K_FOREVER : K_NO_WAIT) == 0;
+    th->in_c = in_c;
+    return ret;
+}
+
+void mp_thread_mutex_unlock(mp_thread_mutex_t *mutex) {
+    if (mutex == &MP_STATE_VM(gil_mutex)) {
+        thread_self()->in_c = true;
+    }
+    k_sem_give(&mutex->sem);
+}
+
+#endif // MICROPY_PY_THREAD
@@ -31,6 +31,11 @@ void sys_pm_notify_power_state_entry(enum power_states state)
 {
 #ifdef CONFIG_SYS_POWER_MANAGEMENT
 	switch (state) {
+	case SYS_POWER_STATE_SLEEP_1:
+		/* while a script waits in uselect, devices stay powered */
+		k_cpu_idle();
+		break;
+
 	case SYS_POWER_STATE_SLEEP_2:
 		device_power(false);
 		k_cpu_idle();
@@ -19,6 +19,7 @@
 #include <drivers/console/uart_console.h>
 #include <misc/printk.h>
 #include "zephyr_getchar.h"
+#include "../zephyr_poll.h"
 
 extern int mp_interrupt_char;
 void mp_keyboard_interrupt(void);
@@ -37,6 +38,7 @@ static int console_irq_input_hook(uint8_t ch)
     }
     if (ch == mp_interrupt_char) {
         mp_keyboard_interrupt();
+        mp_zephyr_wake_up();
         return 1;
     } else {
         uart_ringbuf[i_put] = ch;
@@ -28,6 +28,7 @@
 #include <power.h>
 #include "zephyr_getchar.h"
 #include "../degu_ota.h"
+#include "../degu_proxy.h"
 #include <shell/shell.h>
 #include <sys/util.h>
 #include <init.h>
@@ -52,7 +53,7 @@ LOG_MODULE_REGISTER(main);
 
 #ifndef ROUTER_ONLY
 int real_main(void);
-int bg_main(char *src, size_t len);
+int bg_main(const char *path);
 #endif
 static const char splash[] = "Start background micropython process.\r\n";
 bool mp_running = 0;
@@ -79,11 +80,8 @@ static int mount_fat(void)
 
 
 int run_user_script(char *path) {
-	struct fs_file_t file;
 	struct fs_dirent dirent;
-	int err, offset = 0;
-	static char *file_data;
-	static size_t len;
+	int err;
 	char version[32];
 
 	err = fs_stat(path, &dirent);
@@ -92,28 +90,6 @@ int run_user_script(char *path) {
 		goto no_script;
 	}
 
-	err = fs_open(&file, path);
-	if(err) {
-		LOG_ERR("Can't open file");
-		goto no_script;
-	}
-
-	if (offset > 0) {
-		fs_seek(&file, offset, FS_SEEK_SET);
-	}
-	len = dirent.size;
-	file_data = k_malloc(len);
-	int count = INT_MAX;
-	int read = 0;
-	while(1){
-		read = fs_read(&file, file_data + offset, MIN(count, len));
-		if (read <= 0) {
-			break;
-		}
-		offset += read;
-		count -= read;
-	}
-
 	sprintf(version, "Degu F/W version: %s.%s.%s\r\n", VERSION_MAJOR,
 					VERSION_MINOR, VERSION_REVISION);
 	console_init();
@@ -121,10 +97,9 @@ int run_user_script(char *path) {
 	console_write(NULL, splash, sizeof(splash) - 1);
 
 #ifndef ROUTER_ONLY
-	bg_main(file_data, len);
+	/* the VM streams the script from the file system */
+	degu_ota_script_exited(bg_main(path));
 #endif
-	fs_close(&file);
-	k_free(file_data);
 	return 1;
 no_script:
 	return 0;
@@ -137,6 +112,9 @@ void main(void) {
 	struct net_if *iface = net_if_get_default();
 	struct openthread_context *ot_context = net_if_l2_data(iface);
 	otThreadSetLocalLeaderWeight(ot_context->instance, OT_LEADER_WEIGHT);
+
+	/* serve update blocks to the children from a cache in slot-1 */
+	degu_proxy_start();
 #endif
 
 #ifdef CONFIG_SYS_POWER_MANAGEMENT
@@ -154,16 +132,19 @@ void main(void) {
 	}
 
 #ifndef ROUTER_ONLY
-	if(update_init() == DEGU_OTA_OK){
-		if (check_update() == DEGU_OTA_OK) {
-			LOG_INF("Trying to update...");
-			if (do_update() == DEGU_OTA_OK) {
-				sys_reboot(SYS_REBOOT_COLD);
-			}
-		}
-	}
+	/* updates are checked in the background, the script starts at once */
+	degu_ota_start();
 
 	mp_running = run_user_script("/NAND:/main.py");
+
+	/* script and config updates restart the VM instead of rebooting */
+	while (mp_running && degu_ota_wait_restart()) {
+		LOG_INF("Restarting the user script");
+		mp_running = run_user_script("/NAND:/main.py");
+	}
+
+	/* no script to run, a downloaded update can be applied any time */
+	degu_ota_safe_point();
 #endif
 }
 
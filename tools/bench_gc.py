@@ -0,0 +1,51 @@
+#
+# Copyright (c) 2019 Atmark Techno, Inc.
+#
+# SPDX-License-Identifier: MIT
+
+"""GC pauses and allocation sites of a workload.
+
+Copy to /NAND:/main.py and read the console. The workload builds strings
+and lists in a loop; the pauses it causes and where its large allocations
+come from are printed with zephyr.gc_stats() and zephyr.gc_trace_dump().
+"""
+
+import gc
+import zephyr
+
+N = 200
+THRESHOLD = 128
+
+
+def work():
+    chunks = []
+    for i in range(N):
+        chunks.append('%d:%s' % (i, 'x' * (i % 64)))
+        if len(chunks) > 16:
+            chunks = chunks[8:]
+    return len(chunks)
+
+
+def stats(name):
+    n, last, worst, since, free, largest, frag = zephyr.gc_stats()
+    print('%s: %d collections, last %d us, max %d us, %d bytes since' %
+          (name, n, last, worst, since))
+    print('  free %d bytes, largest block %d, %d%% fragmented' %
+          (free, largest, frag))
+
+
+gc.collect()
+stats('before')
+
+if hasattr(zephyr, 'gc_trace_start'):
+    zephyr.gc_trace_start(THRESHOLD)
+work()
+stats('after')
+
+if hasattr(zephyr, 'gc_trace_dump'):
+    for size, pause, file, func, line in zephyr.gc_trace_dump():
+        where = '%s:%d %s' % (file, line, func) if file else '?'
+        if pause:
+            print('%5d bytes, collected in %d us, at %s' % (size, pause, where))
+        else:
+            print('%5d bytes at %s' % (size, where))
@@ -0,0 +1,28 @@
+#
+# Copyright (c) 2019 Atmark Techno, Inc.
+#
+# SPDX-License-Identifier: MIT
+
+"""Heap and time cost of importing the frozen helper libraries.
+
+Copy to /NAND:/main.py and read the console. Run it once on the default
+build (frozen bytecode) and once on a build with the libraries frozen as
+source instead:
+
+    make FROZEN_MPY_DIR= FROZEN_DIR=modules
+"""
+
+import gc
+import utime
+
+for name in ('grove', 'telemetry'):
+    gc.collect()
+    before = gc.mem_alloc()
+    start = utime.ticks_us()
+    __import__(name)
+    took = utime.ticks_diff(utime.ticks_us(), start)
+    gc.collect()
+    print('%s: %d bytes of heap, %d us' % (name, gc.mem_alloc() - before, took))
+
+gc.collect()
+print('free:', gc.mem_free())
@@ -0,0 +1,136 @@
+#
+# Copyright (c) 2019 Atmark Techno, Inc.
+#
+# SPDX-License-Identifier: MIT
+
+"""Bytecode, native and viper timings of typical sensor loops.
+
+Copy to /NAND:/main.py on a build with CONFIG_DEGU_MPY_NATIVE and read
+the console.
+
+Native and viper code can't be kept in the .mpy cache, a main.py which
+has any is compiled on every boot. The last line shows how the script
+was brought up and must read 'source' on every boot, also after a reset.
+"""
+
+import micropython
+import utime
+import zephyr
+
+N = 256
+samples = bytearray((i * 37) & 0xff for i in range(N))
+
+
+# exponential moving average over ADC-like samples
+
+def ema(buf, n):
+    acc = 0
+    for i in range(n):
+        acc += (buf[i] - acc) >> 3
+    return acc
+
+
+@micropython.native
+def ema_native(buf, n):
+    acc = 0
+    for i in range(n):
+        acc += (buf[i] - acc) >> 3
+    return acc
+
+
+@micropython.viper
+def ema_viper(buf, n: int) -> int:
+    p = ptr8(buf)
+    acc = 0
+    for i in range(n):
+        acc += (int(p[i]) - acc) >> 3
+    return acc
+
+
+# CRC-8 as checked on every SHT31 reading
+
+def crc8(buf, n):
+    crc = 0xff
+    for i in range(n):
+        crc ^= buf[i]
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x31 if crc & 0x80 else crc << 1) & 0xff
+    return crc
+
+
+@micropython.native
+def crc8_native(buf, n):
+    crc = 0xff
+    for i in range(n):
+        crc ^= buf[i]
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x31 if crc & 0x80 else crc << 1) & 0xff
+    return crc
+
+
+@micropython.viper
+def crc8_viper(buf, n: int) -> int:
+    p = ptr8(buf)
+    crc = 0xff
+    for i in range(n):
+        crc ^= p[i]
+        for _ in range(8):
+            if crc & 0x80:
+                crc = ((crc << 1) ^ 0x31) & 0xff
+            else:
+                crc = (crc << 1) & 0xff
+    return crc
+
+
+# shifting a byte out MSB first, as a bit-banged bus would
+
+def shift(buf, n):
+    out = 0
+    for i in range(n):
+        b = buf[i]
+        for _ in range(8):
+            out = (out << 1 | b >> 7) & 0xffff
+            b = (b << 1) & 0xff
+    return out
+
+
+@micropython.native
+def shift_native(buf, n):
+    out = 0
+    for i in range(n):
+        b = buf[i]
+        for _ in range(8):
+            out = (out << 1 | b >> 7) & 0xffff
+            b = (b << 1) & 0xff
+    return out
+
+
+@micropython.viper
+def shift_viper(buf, n: int) -> int:
+    p = ptr8(buf)
+    out = 0
+    for i in range(n):
+        b = p[i]
+        for _ in range(8):
+            out = (out << 1 | b >> 7) & 0xffff
+            b = (b << 1) & 0xff
+    return out
+
+
+def run(name, funcs):
+    results = []
+    times = []
+    for f in funcs:
+        start = utime.ticks_us()
+        results.append(f(samples, N))
+        times.append(utime.ticks_diff(utime.ticks_us(), start))
+    ok = 'ok' if results[0] == results[1] == results[2] else 'MISMATCH'
+    print('%-6s bytecode %6d us, native %6d us, viper %6d us  %s' %
+          (name, times[0], times[1], times[2], ok))
+
+
+run('ema', (ema, ema_native, ema_viper))
+run('crc8', (crc8, crc8_native, crc8_viper))
+run('shift', (shift, shift_native, shift_viper))
+
+print('boot   %s' % zephyr.boot_stats()[0])
@@ -0,0 +1,55 @@
+#
+# Copyright (c) 2019 Atmark Techno, Inc.
+#
+# SPDX-License-Identifier: MIT
+
+"""Latency from a GPIO edge to its Pin.irq() handler.
+
+Wire OUT to IN, copy to /NAND:/main.py and read the console. The edges
+are made while the script sleeps, idles in a busy loop and waits in
+uselect.poll(), which are the cases that decide when the handler runs.
+"""
+
+import machine
+import uselect
+import utime
+
+OUT = ('GPIO_0', 3)
+IN = ('GPIO_0', 4)
+EDGES = 50
+
+out = machine.Pin(OUT, machine.Pin.OUT, value=0)
+inp = machine.Pin(IN, machine.Pin.IN, machine.Pin.PULL_DOWN)
+seen = [0]
+
+
+def handler(pin):
+    seen[0] += 1
+
+
+def toggle():
+    out.value(not out.value())
+
+
+def run(name, wait):
+    irq = inp.irq(handler, machine.Pin.IRQ_RISING | machine.Pin.IRQ_FALLING)
+    before = irq.stats()
+    for _ in range(EDGES):
+        toggle()
+        wait()
+    events, dropped, worst, _ = irq.stats()
+    print('%-6s %d edges, %d dropped, worst %d us' %
+          (name, events - before[0], dropped - before[1], worst))
+
+
+def busy():
+    start = utime.ticks_ms()
+    while utime.ticks_diff(utime.ticks_ms(), start) < 20:
+        pass
+
+
+run('sleep', lambda: utime.sleep_ms(20))
+run('busy', busy)
+run('poll', lambda: uselect.poll().poll(20))
+inp.irq(None)
+print('handler called %d times' % seen[0])
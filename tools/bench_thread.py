@@ -0,0 +1,43 @@
+#
+# Copyright (c) 2019 Atmark Techno, Inc.
+#
+# SPDX-License-Identifier: MIT
+
+"""Cadence of a sampling thread while the main thread reports.
+
+Copy to /NAND:/main.py on a build with CONFIG_DEGU_MPY_THREAD and read
+the console. The sampler should keep its 100 ms period while
+degu.update_shadow() waits for the network.
+"""
+
+import _thread
+import degu
+import utime
+
+PERIOD = 100
+late = [0, 0]   # worst lateness in ms, samples taken
+done = False
+
+
+def sampler():
+    due = utime.ticks_add(utime.ticks_ms(), PERIOD)
+    while not done:
+        wait = utime.ticks_diff(due, utime.ticks_ms())
+        if wait > 0:
+            utime.sleep_ms(wait)
+        lateness = utime.ticks_diff(utime.ticks_ms(), due)
+        if lateness > late[0]:
+            late[0] = lateness
+        late[1] += 1
+        due = utime.ticks_add(due, PERIOD)
+
+
+_thread.start_new_thread(sampler, ())
+for i in range(5):
+    start = utime.ticks_ms()
+    code = degu.update_shadow('{"state":{"reported":{"n":%d}}}' % i)
+    print('report %d: 0x%02x in %d ms' %
+          (i, code, utime.ticks_diff(utime.ticks_ms(), start)))
+done = True
+utime.sleep_ms(2 * PERIOD)
+print('%d samples, at most %d ms late' % (late[1], late[0]))
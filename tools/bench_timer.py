@@ -0,0 +1,63 @@
+#
+# Copyright (c) 2019 Atmark Techno, Inc.
+#
+# SPDX-License-Identifier: MIT
+
+"""Sampling jitter of machine.Timer against a utime.sleep_ms() loop.
+
+Copy to /NAND:/main.py and read the console. Both sample every PERIOD ms
+for N samples while the script keeps the VM busy; the error is measured
+against the ideal schedule from the first sample.
+"""
+
+import machine
+import utime
+
+PERIOD = 10
+N = 200
+
+stamps = []
+
+
+def sample(t=None):
+    if len(stamps) < N:
+        stamps.append(utime.ticks_us())
+
+
+def load():
+    # the kind of work done between samples: some arithmetic and garbage
+    x = 0
+    for i in range(200):
+        x += len(str(i))
+    return x
+
+
+def report(name, overruns=0):
+    worst = 0
+    # enumerate() is not built in
+    for i in range(len(stamps)):
+        err = utime.ticks_diff(stamps[i], stamps[0]) - i * PERIOD * 1000
+        if err < 0:
+            err = -err
+        if err > worst:
+            worst = err
+    span = utime.ticks_diff(stamps[-1], stamps[0]) // 1000
+    print('%-6s %d samples in %d ms, worst error %d us, %d overruns' %
+          (name, len(stamps), span, worst, overruns))
+
+
+# sleep loop: drifts by the time the loop body takes
+stamps = []
+while len(stamps) < N:
+    sample()
+    load()
+    utime.sleep_ms(PERIOD)
+report('sleep')
+
+# periodic timer: callbacks scheduled from the kernel timer
+stamps = []
+tim = machine.Timer(mode=machine.Timer.PERIODIC, period=PERIOD, callback=sample)
+while len(stamps) < N:
+    load()
+tim.deinit()
+report('timer', tim.overruns())
@@ -0,0 +1,104 @@
+#! /usr/bin/env python3
+#
+# Copyright (c) 2019 Atmark Techno, Inc.
+#
+# SPDX-License-Identifier: MIT
+
+"""Stand-in for the gateway side of a multicast firmware session.
+
+Sends a signed image to the group Degu nodes join with
+CONFIG_DEGU_OTA_MCAST, e.g. over the tap interface of a native_posix
+build:
+
+    mcast_sender.py -i zeth --drop 0.1 zephyr/build/zephyr/zephyr.signed.bin
+
+Dropped blocks are left for the nodes to repair over unicast once the
+shadow desires the same firmware.
+"""
+
+import argparse
+import hashlib
+import os
+import random
+import socket
+import struct
+import time
+
+COAP_PORT = 5683
+BLOCK_SIZE = 1024
+
+MCAST_MAGIC = 0x434d4744
+MCAST_ANNOUNCE = 0
+MCAST_DATA = 1
+MCAST_END = 2
+
+
+def coap_non_post(msg_id, payload):
+    # ver 1, NON, no token, 0.02 POST, Uri-Path "update" / "mcast"
+    hdr = struct.pack('!BBH', 0x50, 0x02, msg_id & 0xffff)
+    opts = bytes([0xb6]) + b'update' + bytes([0x05]) + b'mcast'
+    return hdr + opts + b'\xff' + payload
+
+
+def mcast_hdr(kind, session, arg):
+    return struct.pack('<IB3xII', MCAST_MAGIC, kind, session, arg)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('image', help='signed firmware image')
+    parser.add_argument('-g', '--group', default='ff03::dec0')
+    parser.add_argument('-i', '--interface', default=None)
+    parser.add_argument('--hops', type=int, default=8)
+    parser.add_argument('--lead', type=float, default=15.0,
+                        help='seconds between the announce and the blocks, '
+                             'the nodes erase slot-1 meanwhile')
+    parser.add_argument('--interval', type=float, default=0.05,
+                        help='seconds between two blocks')
+    parser.add_argument('--drop', type=float, default=0.0,
+                        help='fraction of blocks not sent, to test the repair')
+    args = parser.parse_args()
+
+    with open(args.image, 'rb') as f:
+        image = f.read()
+    ver = hashlib.md5(image).hexdigest()
+    session = int.from_bytes(os.urandom(4), 'little') or 1
+    blocks = (len(image) + BLOCK_SIZE - 1) // BLOCK_SIZE
+
+    sock = socket.socket(socket.AF_INET6, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_MULTICAST_HOPS, args.hops)
+    if args.interface:
+        sock.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_MULTICAST_IF,
+                        socket.if_nametoindex(args.interface))
+    dest = (args.group, COAP_PORT)
+    msg_id = random.randint(0, 0xffff)
+
+    def send(payload):
+        nonlocal msg_id
+        sock.sendto(coap_non_post(msg_id, payload), dest)
+        msg_id += 1
+
+    print('session %08x: %s, %d bytes, %d blocks' %
+          (session, ver, len(image), blocks))
+
+    announce = mcast_hdr(MCAST_ANNOUNCE, session, len(image)) + ver.encode()
+    for _ in range(3):
+        send(announce)
+        time.sleep(1)
+    time.sleep(args.lead)
+
+    dropped = 0
+    for block in range(blocks):
+        if random.random() < args.drop:
+            dropped += 1
+            continue
+        data = image[block * BLOCK_SIZE:(block + 1) * BLOCK_SIZE]
+        send(mcast_hdr(MCAST_DATA, session, block) + data)
+        time.sleep(args.interval)
+
+    send(mcast_hdr(MCAST_END, session, 0))
+    print('sent %d blocks, dropped %d' % (blocks - dropped, dropped))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,32 @@
+#
+# Copyright (c) 2019 Atmark Techno, Inc.
+#
+# SPDX-License-Identifier: MIT
+
+"""Print where a script spends its time.
+
+Copy to /NAND:/lib/profile_report.py and wrap the code to look at:
+
+    import zephyr, profile_report
+    zephyr.profile_start()
+    loop_body()
+    profile_report.show(zephyr.profile_dump())
+"""
+
+
+def show(d, top=10):
+    total = d['samples'] + d['idle'] + d['other'] + d['dropped']
+    if not total:
+        print('no samples')
+        return
+    print('%d ms sampled every %d ms: python %d%%, idle %d%%, other threads %d%%' %
+          (total * d['period'], d['period'], 100 * d['samples'] // total,
+           100 * d['idle'] // total, 100 * d['other'] // total))
+    if d['dropped'] or d['lost']:
+        print('%d samples dropped, %d lost' % (d['dropped'], d['lost']))
+    print('functions (samples, in C):')
+    for n, c, f, name in d['functions'][:top]:
+        print('%6d %6d  %s:%s' % (n, c, f, name))
+    print('lines (samples, in C):')
+    for n, c, f, line in d['lines'][:top]:
+        print('%6d %6d  %s:%d' % (n, c, f, line))
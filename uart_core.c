@@ -25,6 +25,7 @@
  */
 #include <unistd.h>
 #include "py/mpconfig.h"
+#include "py/mpstate.h"
 #include "src/zephyr_getchar.h"
 // Zephyr headers
 #include <uart.h>
@@ -36,11 +37,16 @@
 
 // Receive single character
 int mp_hal_stdin_rx_chr(void) {
+    int c;
+    // other threads run while the REPL waits for input
+    MP_THREAD_GIL_EXIT();
 #ifdef CONFIG_CONSOLE_SUBSYS
-    return console_getchar();
+    c = console_getchar();
 #else
-    return zephyr_getchar();
+    c = zephyr_getchar();
 #endif
+    MP_THREAD_GIL_ENTER();
+    return c;
 }
 
 // Send string of given length
@@ -46,13 +46,9 @@
 
 LOG_MODULE_REGISTER(zcoap);
 
-static struct coap_block_context blk_ctx;
-
-static u8_t token[8];
-
 static const u16_t COAP_BLOCK_THRESHOLD = 1024;
 
-static int zcoap_request(int sock, u8_t *path, u8_t method, u8_t *payload, u16_t *payload_len, bool *last_block)
+static int zcoap_request(int sock, struct zcoap_xfer *xfer, u8_t *path, u8_t method, u8_t *payload, u16_t *payload_len, bool *last_block)
 {
 	int r;
 	int rcvd;
@@ -65,36 +61,42 @@ static int zcoap_request(int sock, u8_t *path, u8_t method, u8_t *payload, u16_t
 	struct timeval tv;
 	u8_t retry;
 	long select_second;
+	u8_t token[8];
+	u8_t tkl;
+	bool matched;
+	struct coap_block_context *blk_ctx = &xfer->blk_ctx;
 
 	code = 0;
 	retry = 0;
 
-	if (blk_ctx.total_size == 0) {
+	if (blk_ctx->total_size == 0) {
 		if (method == COAP_METHOD_GET) {
-			coap_block_transfer_init(&blk_ctx, COAP_BLOCK_1024,
+			coap_block_transfer_init(blk_ctx, COAP_BLOCK_1024,
 						BLOCK_WISE_TRANSFER_SIZE_GET);
+			blk_ctx->current = xfer->blk_start;
+			xfer->blk_start = 0;
 		}
 		else if ((method == COAP_METHOD_POST || method == COAP_METHOD_PUT) &&
 			  *payload_len > COAP_BLOCK_THRESHOLD) {
-			r = coap_block_transfer_init(&blk_ctx, COAP_BLOCK_1024, *payload_len);
+			r = coap_block_transfer_init(blk_ctx, COAP_BLOCK_1024, *payload_len);
 			if (r != 0) {
 				LOG_ERR("failed to coap_block_transfer_init(%d)\n", r);
 				return code;
 			}
 		}
-		memcpy(token, coap_next_token(), sizeof(token));
+		memcpy(xfer->token, coap_next_token(), sizeof(xfer->token));
 	}
 
 	data = (u8_t *)k_malloc(MAX_COAP_MSG_LEN);
 	if (!data) {
 		LOG_ERR("can't malloc\n");
-		memset(&blk_ctx, 0, sizeof(blk_ctx));
+		memset(blk_ctx, 0, sizeof(*blk_ctx));
 		return code;
 	}
 	memset(data, 0, MAX_COAP_MSG_LEN);
 
 	r = coap_packet_init(&request, data, MAX_COAP_MSG_LEN,
-			     1, COAP_TYPE_CON, sizeof(token), token,
+			     1, COAP_TYPE_CON, sizeof(xfer->token), xfer->token,
 			     method, coap_next_id());
 	if (r < 0) {
 		LOG_ERR("Unable to init CoAP packet\n");
@@ -108,15 +110,15 @@ static int zcoap_request(int sock, u8_t *path, u8_t method, u8_t *payload, u16_t
 	}
 
 	if (method == COAP_METHOD_GET) {
-		r = coap_append_block2_option(&request, &blk_ctx);
+		r = coap_append_block2_option(&request, blk_ctx);
 		if (r < 0) {
 			LOG_ERR("Unable to append block2 option to request\n");
 			goto errorend;
 		}
 	}
 	else if (method == COAP_METHOD_POST || method == COAP_METHOD_PUT) {
-		if (*payload_len > COAP_BLOCK_THRESHOLD || blk_ctx.total_size != 0) {
-			r = coap_append_block1_option(&request, &blk_ctx);
+		if (*payload_len > COAP_BLOCK_THRESHOLD || blk_ctx->total_size != 0) {
+			r = coap_append_block1_option(&request, blk_ctx);
 			if (r < 0) {
 				LOG_ERR("Unable to append block1 option to request\n");
 				goto errorend;
@@ -128,10 +130,10 @@ static int zcoap_request(int sock, u8_t *path, u8_t method, u8_t *payload, u16_t
 			goto errorend;
 		}
 
-		if (blk_ctx.total_size > COAP_BLOCK_THRESHOLD) {
-			if ((blk_ctx.total_size - blk_ctx.current) < COAP_BLOCK_THRESHOLD) {
+		if (blk_ctx->total_size > COAP_BLOCK_THRESHOLD) {
+			if ((blk_ctx->total_size - blk_ctx->current) < COAP_BLOCK_THRESHOLD) {
 				r = coap_packet_append_payload(&request, payload,
-						blk_ctx.total_size - blk_ctx.current);
+						blk_ctx->total_size - blk_ctx->current);
 			} else {
 				r = coap_packet_append_payload(&request, payload, COAP_BLOCK_THRESHOLD);
 			}
@@ -154,6 +156,7 @@ static int zcoap_request(int sock, u8_t *path, u8_t method, u8_t *payload, u16_t
 	}
 
 	select_second = COAP_ACK_TIMEOUT_SEC;
+	matched = false;
 	while (1) {
 		r = send(sock, request.data, request.offset, 0);
 		if (r < 0) {
@@ -161,21 +164,60 @@ static int zcoap_request(int sock, u8_t *path, u8_t method, u8_t *payload, u16_t
 			goto errorend;
 		}
 
-		FD_ZERO(&fds);
-		FD_SET(sock, &fds);
-		tv.tv_sec = select_second;
-		tv.tv_usec = 0;
-		r = select(sock + 1, &fds, NULL, NULL, &tv);
-		if (!r) {
-			select_second *= 2;
-			LOG_ERR("Receiving response timeout:next %ld second",
-								select_second);
-			retry ++;
+		/* replies to other exchanges on a shared socket, and late
+		 * duplicate ACKs of earlier blocks, which carry the same token,
+		 * are dropped and the socket read again */
+		while (1) {
+			FD_ZERO(&fds);
+			FD_SET(sock, &fds);
+			tv.tv_sec = select_second;
+			tv.tv_usec = 0;
+			r = select(sock + 1, &fds, NULL, NULL, &tv);
+			if (!r) {
+				break;
+			}
+
+			rcvd = recv(sock, data, MAX_COAP_MSG_LEN, MSG_DONTWAIT);
+			if (rcvd == 0) {
+				LOG_ERR("Unable to receive response\n");
+				goto errorend;
+			}
+			if (rcvd < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					r = 0;
+				}
+				else {
+					LOG_ERR("Unable to receive response\n");
+					r = -errno;
+				}
+
+				goto errorend;
+			}
+
+			r = coap_packet_parse(&reply, data, rcvd, NULL, 0);
+			if (r < 0) {
+				LOG_ERR("Unable to parse recieved packet\n");
+				goto errorend;
+			}
+
+			tkl = coap_header_get_token(&reply, token);
+			if (tkl == sizeof(xfer->token) &&
+			    !memcmp(token, xfer->token, sizeof(xfer->token)) &&
+			    (coap_header_get_type(&reply) != COAP_TYPE_ACK ||
+			     coap_header_get_id(&reply) == coap_header_get_id(&request))) {
+				matched = true;
+				break;
+			}
+			LOG_WRN("Dropped a reply to another request\n");
 		}
-		else{
+		if (matched) {
 			break;
 		}
 
+		select_second *= 2;
+		LOG_ERR("Receiving response timeout:next %ld second",
+							select_second);
+		retry ++;
 		if (retry > COAP_MAX_RETRANSMIT) {
 			code = COAP_FAILED_TO_RECEIVE_RESPONSE;
 			LOG_ERR("Retry out\n");
@@ -183,37 +225,18 @@ static int zcoap_request(int sock, u8_t *path, u8_t method, u8_t *payload, u16_t
 		}
 	}
 
-	rcvd = recv(sock, data, MAX_COAP_MSG_LEN, MSG_DONTWAIT);
-	if (rcvd == 0) {
-		LOG_ERR("Unable to receive response\n");
-		goto errorend;
-	}
-	if (rcvd < 0) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK) {
-			r = 0;
-		}
-		else {
-			LOG_ERR("Unable to receive response\n");
-			r = -errno;
-		}
-
-		goto errorend;
-	}
-
-	r = coap_packet_parse(&reply, data, rcvd, NULL, 0);
-	if (r < 0) {
-		LOG_ERR("Unable to parse recieved packet\n");
-		goto errorend;
-	}
-
 	code = coap_header_get_code(&reply);
 
 	if (method == COAP_METHOD_GET) {
 		payload_buf = coap_packet_get_payload(&reply, payload_len);
 		memcpy(payload, payload_buf, *payload_len);
 
-		if (!coap_next_block(&reply, &blk_ctx) || code != COAP_RESPONSE_CODE_CONTENT) {
-			memset(&blk_ctx, 0, sizeof(blk_ctx));
+		if (code == COAP_RESPONSE_CODE_VALID) {
+			/* GW is in progress, request the same block again */
+			*last_block = false;
+		}
+		else if (!coap_next_block(&reply, blk_ctx) || code != COAP_RESPONSE_CODE_CONTENT) {
+			memset(blk_ctx, 0, sizeof(*blk_ctx));
 			*last_block = true;
 		}
 		else {
@@ -221,10 +244,10 @@ static int zcoap_request(int sock, u8_t *path, u8_t method, u8_t *payload, u16_t
 		}
 	}
 	else if (method == COAP_METHOD_POST || method == COAP_METHOD_PUT) {
-		if (blk_ctx.total_size > COAP_BLOCK_THRESHOLD) {
-			r = coap_next_block(&request, &blk_ctx);
+		if (blk_ctx->total_size > COAP_BLOCK_THRESHOLD) {
+			r = coap_next_block(&request, blk_ctx);
 			if (r >= *payload_len || r == 0) {
-				memset(&blk_ctx, 0, sizeof(blk_ctx));
+				memset(blk_ctx, 0, sizeof(*blk_ctx));
 				*last_block = true;
 			}
 			else {
@@ -232,7 +255,7 @@ static int zcoap_request(int sock, u8_t *path, u8_t method, u8_t *payload, u16_t
 			}
 		}
 		else {
-			memset(&blk_ctx, 0, sizeof(blk_ctx));
+			memset(blk_ctx, 0, sizeof(*blk_ctx));
 			*last_block = true;
 		}
 	}
@@ -241,27 +264,33 @@ static int zcoap_request(int sock, u8_t *path, u8_t method, u8_t *payload, u16_t
 	return code;
 
 errorend:
-	memset(&blk_ctx, 0, sizeof(blk_ctx));
+	memset(blk_ctx, 0, sizeof(*blk_ctx));
 	k_free(data);
 	return code;
 }
 
-int zcoap_request_post(int sock, u8_t *path, u8_t *payload, u16_t *payload_len, bool *last_block)
+int zcoap_request_post(int sock, struct zcoap_xfer *xfer, u8_t *path, u8_t *payload, u16_t *payload_len, bool *last_block)
+{
+	return zcoap_request(sock, xfer, path, COAP_METHOD_POST, payload, payload_len, last_block);
+}
+
+int zcoap_request_put(int sock, struct zcoap_xfer *xfer, u8_t *path, u8_t *payload, u16_t *payload_len, bool *last_block)
 {
-	return zcoap_request(sock, path, COAP_METHOD_POST, payload, payload_len, last_block);
+	return zcoap_request(sock, xfer, path, COAP_METHOD_PUT, payload, payload_len, last_block);
 }
 
-int zcoap_request_put(int sock, u8_t *path, u8_t *payload, u16_t *payload_len, bool *last_block)
+int zcoap_request_get(int sock, struct zcoap_xfer *xfer, u8_t *path, u8_t *payload, u16_t *payload_len, bool *last_block)
 {
-	return zcoap_request(sock, path, COAP_METHOD_PUT, payload, payload_len, last_block);
+	return zcoap_request(sock, xfer, path, COAP_METHOD_GET, payload, payload_len, last_block);
 }
 
-int zcoap_request_get(int sock, u8_t *path, u8_t *payload, u16_t *payload_len, bool *last_block)
+void zcoap_xfer_init(struct zcoap_xfer *xfer, size_t block2_start)
 {
-	return zcoap_request(sock, path, COAP_METHOD_GET, payload, payload_len, last_block);
+	memset(xfer, 0, sizeof(*xfer));
+	xfer->blk_start = block2_start;
 }
 
-int zcoap_request_delete(int sock, u8_t *path)
+int zcoap_request_delete(int sock, struct zcoap_xfer *xfer, u8_t *path)
 {
-	return zcoap_request(sock, path, COAP_METHOD_DELETE, NULL, NULL, NULL);
+	return zcoap_request(sock, xfer, path, COAP_METHOD_DELETE, NULL, NULL, NULL);
 }
@@ -31,8 +31,17 @@
 #define COAP_TYPE_ACK 2 //Acknowledgement
 #define COAP_TYPE_RST 3 //Reset
 #define COAP_FAILED_TO_RECEIVE_RESPONSE -1
+#define COAP_RESOURCE_NOT_FOUND -2 //4.04 on an update resource
 
-int zcoap_request_post(int sock, u8_t *path, u8_t *payload, u16_t *payload_len, bool *last_block);
-int zcoap_request_put(int sock, u8_t *path, u8_t *payload, u16_t *payload_len, bool *last_block);
-int zcoap_request_get(int sock, u8_t *path, u8_t *payload, u16_t *payload_len, bool *last_block);
-int zcoap_request_delete(int sock, u8_t *path);
+/* blockwise state of one request, requests may go between its exchanges */
+struct zcoap_xfer {
+	struct coap_block_context blk_ctx;
+	size_t blk_start;	/* block2 offset of a GET, used to resume a download */
+	u8_t token[8];
+};
+
+void zcoap_xfer_init(struct zcoap_xfer *xfer, size_t block2_start);
+int zcoap_request_post(int sock, struct zcoap_xfer *xfer, u8_t *path, u8_t *payload, u16_t *payload_len, bool *last_block);
+int zcoap_request_put(int sock, struct zcoap_xfer *xfer, u8_t *path, u8_t *payload, u16_t *payload_len, bool *last_block);
+int zcoap_request_get(int sock, struct zcoap_xfer *xfer, u8_t *path, u8_t *payload, u16_t *payload_len, bool *last_block);
+int zcoap_request_delete(int sock, struct zcoap_xfer *xfer, u8_t *path);
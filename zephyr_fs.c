@@ -0,0 +1,381 @@
+/*
+ * This file is part of the MicroPython project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// import and open() on top of the Zephyr file system API. Relative paths
+// are resolved against the /NAND: mount point.
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <zephyr.h>
+#include <fs.h>
+
+#include "py/runtime.h"
+#include "py/stream.h"
+#include "py/reader.h"
+#include "py/lexer.h"
+#include "py/builtin.h"
+#include "py/mperrno.h"
+#include "zephyr_fs.h"
+
+#define ZFS_ROOT "/NAND:"
+#define ZFS_READER_BUF_SIZE (128)
+#define ZFS_PATH_MAX (64)
+
+// A truncated path would name another file
+STATIC bool zfs_path(const char *path, char *out, size_t size) {
+    int n;
+
+    if (path[0] == '/') {
+        n = snprintf(out, size, "%s", path);
+    } else {
+        n = snprintf(out, size, ZFS_ROOT "/%s", path);
+    }
+    return n >= 0 && (size_t)n < size;
+}
+
+STATIC void zfs_path_or_raise(const char *path, char *out, size_t size) {
+    if (!zfs_path(path, out, size)) {
+        mp_raise_OSError(ENAMETOOLONG);
+    }
+}
+
+/******************************************************************************/
+// mp_reader_t for the lexer and .mpy loader, pulls small chunks from the file
+
+typedef struct _zfs_reader_t {
+    struct fs_file_t file;
+    uint16_t len;
+    uint16_t pos;
+    byte buf[ZFS_READER_BUF_SIZE];
+} zfs_reader_t;
+
+STATIC mp_uint_t zfs_reader_readbyte(void *data) {
+    zfs_reader_t *reader = data;
+    if (reader->pos >= reader->len) {
+        ssize_t n = fs_read(&reader->file, reader->buf, sizeof(reader->buf));
+        if (n <= 0) {
+            return MP_READER_EOF;
+        }
+        reader->len = n;
+        reader->pos = 0;
+    }
+    return reader->buf[reader->pos++];
+}
+
+STATIC void zfs_reader_close(void *data) {
+    zfs_reader_t *reader = data;
+    fs_close(&reader->file);
+    m_del_obj(zfs_reader_t, reader);
+}
+
+void mp_reader_new_file(mp_reader_t *reader, const char *filename) {
+    char path[ZFS_PATH_MAX];
+    struct fs_dirent dirent;
+
+    zfs_path_or_raise(filename, path, sizeof(path));
+    // fs_open() creates missing files
+    if (fs_stat(path, &dirent) || dirent.type != FS_DIR_ENTRY_FILE) {
+        mp_raise_OSError(MP_ENOENT);
+    }
+
+    zfs_reader_t *rd = m_new_obj(zfs_reader_t);
+    if (fs_open(&rd->file, path)) {
+        m_del_obj(zfs_reader_t, rd);
+        mp_raise_OSError(MP_EIO);
+    }
+    rd->len = 0;
+    rd->pos = 0;
+
+    reader->data = rd;
+    reader->readbyte = zfs_reader_readbyte;
+    reader->close = zfs_reader_close;
+}
+
+mp_lexer_t *mp_lexer_new_from_file(const char *filename) {
+    mp_reader_t reader;
+    mp_reader_new_file(&reader, filename);
+    return mp_lexer_new(qstr_from_str(filename), reader);
+}
+
+mp_import_stat_t mp_import_stat(const char *path) {
+    char full[ZFS_PATH_MAX];
+    struct fs_dirent dirent;
+
+    if (!zfs_path(path, full, sizeof(full)) || fs_stat(full, &dirent)) {
+        return MP_IMPORT_STAT_NO_EXIST;
+    }
+    return dirent.type == FS_DIR_ENTRY_DIR ? MP_IMPORT_STAT_DIR : MP_IMPORT_STAT_FILE;
+}
+
+/******************************************************************************/
+// file objects returned by open()
+
+// Open files are kept on MP_STATE_PORT(zfs_file_list) so that the ones the
+// script never closed can be closed before the VM is torn down, FatFs has
+// only a few handles to go around.
+typedef struct _zfs_file_obj_t {
+    mp_obj_base_t base;
+    struct _zfs_file_obj_t *next;
+    struct fs_file_t file;
+    bool open;
+    bool readable;
+    bool writable;
+} zfs_file_obj_t;
+
+STATIC const mp_obj_type_t zfs_fileio_type;
+STATIC const mp_obj_type_t zfs_textio_type;
+
+STATIC void zfs_file_check(zfs_file_obj_t *self) {
+    if (!self->open) {
+        mp_raise_ValueError("I/O operation on closed file");
+    }
+}
+
+STATIC void zfs_file_unlink(zfs_file_obj_t *self) {
+    zfs_file_obj_t **p;
+
+    for (p = &MP_STATE_PORT(zfs_file_list); *p != NULL; p = &(*p)->next) {
+        if (*p == self) {
+            *p = self->next;
+            break;
+        }
+    }
+    self->next = NULL;
+}
+
+void mp_zephyr_fs_close_all(void) {
+    zfs_file_obj_t *self;
+
+    for (self = MP_STATE_PORT(zfs_file_list); self != NULL; self = self->next) {
+        if (self->open) {
+            self->open = false;
+            fs_close(&self->file);
+        }
+    }
+    MP_STATE_PORT(zfs_file_list) = NULL;
+}
+
+STATIC mp_uint_t zfs_file_read(mp_obj_t self_in, void *buf, mp_uint_t size, int *errcode) {
+    zfs_file_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    zfs_file_check(self);
+    if (!self->readable) {
+        *errcode = MP_EBADF;
+        return MP_STREAM_ERROR;
+    }
+    ssize_t n = fs_read(&self->file, buf, size);
+    if (n < 0) {
+        *errcode = -n;
+        return MP_STREAM_ERROR;
+    }
+    return n;
+}
+
+STATIC mp_uint_t zfs_file_write(mp_obj_t self_in, const void *buf, mp_uint_t size, int *errcode) {
+    zfs_file_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    zfs_file_check(self);
+    // fs_open() always opens for reading and writing
+    if (!self->writable) {
+        *errcode = MP_EBADF;
+        return MP_STREAM_ERROR;
+    }
+    ssize_t n = fs_write(&self->file, buf, size);
+    if (n < 0) {
+        *errcode = -n;
+        return MP_STREAM_ERROR;
+    }
+    return n;
+}
+
+STATIC mp_uint_t zfs_file_ioctl(mp_obj_t self_in, mp_uint_t request, uintptr_t arg, int *errcode) {
+    zfs_file_obj_t *self = MP_OBJ_TO_PTR(self_in);
+    int ret;
+
+    if (request == MP_STREAM_CLOSE) {
+        if (self->open) {
+            self->open = false;
+            fs_close(&self->file);
+            zfs_file_unlink(self);
+        }
+        return 0;
+    }
+
+    zfs_file_check(self);
+    if (request == MP_STREAM_SEEK) {
+        struct mp_stream_seek_t *s = (struct mp_stream_seek_t *)arg;
+        static const int whence[] = { FS_SEEK_SET, FS_SEEK_CUR, FS_SEEK_END };
+        // stream_seek() passes whence on unchecked
+        if ((mp_uint_t)s->whence >= MP_ARRAY_SIZE(whence)) {
+            *errcode = MP_EINVAL;
+            return MP_STREAM_ERROR;
+        }
+        ret = fs_seek(&self->file, s->offset, whence[s->whence]);
+        if (ret < 0) {
+            *errcode = -ret;
+            return MP_STREAM_ERROR;
+        }
+        s->offset = fs_tell(&self->file);
+        return 0;
+    } else if (request == MP_STREAM_FLUSH) {
+        ret = fs_sync(&self->file);
+        if (ret < 0) {
+            *errcode = -ret;
+            return MP_STREAM_ERROR;
+        }
+        return 0;
+    }
+
+    *errcode = MP_EINVAL;
+    return MP_STREAM_ERROR;
+}
+
+STATIC void zfs_file_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+    (void)kind;
+    mp_printf(print, "<io.%s %p>", mp_obj_get_type_str(self_in), MP_OBJ_TO_PTR(self_in));
+}
+
+STATIC mp_obj_t zfs_file___exit__(size_t n_args, const mp_obj_t *args) {
+    (void)n_args;
+    return mp_stream_close(args[0]);
+}
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(zfs_file___exit___obj, 4, 4, zfs_file___exit__);
+
+STATIC const mp_rom_map_elem_t zfs_file_locals_dict_table[] = {
+    { MP_ROM_QSTR(MP_QSTR_read), MP_ROM_PTR(&mp_stream_read_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readinto), MP_ROM_PTR(&mp_stream_readinto_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readline), MP_ROM_PTR(&mp_stream_unbuffered_readline_obj) },
+    { MP_ROM_QSTR(MP_QSTR_readlines), MP_ROM_PTR(&mp_stream_unbuffered_readlines_obj) },
+    { MP_ROM_QSTR(MP_QSTR_write), MP_ROM_PTR(&mp_stream_write_obj) },
+    { MP_ROM_QSTR(MP_QSTR_flush), MP_ROM_PTR(&mp_stream_flush_obj) },
+    { MP_ROM_QSTR(MP_QSTR_close), MP_ROM_PTR(&mp_stream_close_obj) },
+    { MP_ROM_QSTR(MP_QSTR_seek), MP_ROM_PTR(&mp_stream_seek_obj) },
+    { MP_ROM_QSTR(MP_QSTR_tell), MP_ROM_PTR(&mp_stream_tell_obj) },
+    { MP_ROM_QSTR(MP_QSTR___enter__), MP_ROM_PTR(&mp_identity_obj) },
+    { MP_ROM_QSTR(MP_QSTR___exit__), MP_ROM_PTR(&zfs_file___exit___obj) },
+};
+STATIC MP_DEFINE_CONST_DICT(zfs_file_locals_dict, zfs_file_locals_dict_table);
+
+STATIC const mp_stream_p_t zfs_fileio_stream_p = {
+    .read = zfs_file_read,
+    .write = zfs_file_write,
+    .ioctl = zfs_file_ioctl,
+};
+
+STATIC const mp_obj_type_t zfs_fileio_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_FileIO,
+    .print = zfs_file_print,
+    .getiter = mp_identity_getiter,
+    .iternext = mp_stream_unbuffered_iter,
+    .protocol = &zfs_fileio_stream_p,
+    .locals_dict = (mp_obj_dict_t *)&zfs_file_locals_dict,
+};
+
+STATIC const mp_stream_p_t zfs_textio_stream_p = {
+    .read = zfs_file_read,
+    .write = zfs_file_write,
+    .ioctl = zfs_file_ioctl,
+    .is_text = true,
+};
+
+STATIC const mp_obj_type_t zfs_textio_type = {
+    { &mp_type_type },
+    .name = MP_QSTR_TextIOWrapper,
+    .print = zfs_file_print,
+    .getiter = mp_identity_getiter,
+    .iternext = mp_stream_unbuffered_iter,
+    .protocol = &zfs_textio_stream_p,
+    .locals_dict = (mp_obj_dict_t *)&zfs_file_locals_dict,
+};
+
+mp_obj_t mp_builtin_open(size_t n_args, const mp_obj_t *args, mp_map_t *kwargs) {
+    enum { ARG_file, ARG_mode };
+    static const mp_arg_t allowed_args[] = {
+        { MP_QSTR_file, MP_ARG_OBJ | MP_ARG_REQUIRED, {.u_rom_obj = MP_ROM_NONE} },
+        { MP_QSTR_mode, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_QSTR(MP_QSTR_r)} },
+    };
+    mp_arg_val_t arg_vals[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, args, kwargs, MP_ARRAY_SIZE(allowed_args), allowed_args, arg_vals);
+
+    char path[ZFS_PATH_MAX];
+    const char *mode = mp_obj_str_get_str(arg_vals[ARG_mode].u_obj);
+    const mp_obj_type_t *type = &zfs_textio_type;
+    struct fs_dirent dirent;
+    char kind = 'r';
+
+    for (; *mode; mode++) {
+        switch (*mode) {
+            case 'r':
+            case 'w':
+            case 'a':
+            case 'x':
+                kind = *mode;
+                break;
+            case 'b':
+                type = &zfs_fileio_type;
+                break;
+            case 't':
+                type = &zfs_textio_type;
+                break;
+            default:
+                // '+' can't be honoured, a file is either read or written
+                mp_raise_ValueError("unsupported mode");
+        }
+    }
+
+    zfs_path_or_raise(mp_obj_str_get_str(arg_vals[ARG_file].u_obj), path, sizeof(path));
+    bool exists = fs_stat(path, &dirent) == 0;
+
+    // fs_open() creates the file and never truncates it
+    if (kind == 'r' && !exists) {
+        mp_raise_OSError(MP_ENOENT);
+    } else if (kind == 'x' && exists) {
+        mp_raise_OSError(MP_EEXIST);
+    } else if (kind == 'w' && exists) {
+        fs_unlink(path);
+    }
+
+    zfs_file_obj_t *o = m_new_obj(zfs_file_obj_t);
+    o->base.type = type;
+    o->next = NULL;
+    int ret = fs_open(&o->file, path);
+    if (ret < 0) {
+        o->open = false;
+        mp_raise_OSError(-ret);
+    }
+    o->open = true;
+    o->readable = kind == 'r';
+    o->writable = kind != 'r';
+    o->next = MP_STATE_PORT(zfs_file_list);
+    MP_STATE_PORT(zfs_file_list) = o;
+
+    if (kind == 'a') {
+        fs_seek(&o->file, 0, FS_SEEK_END);
+    }
+
+    return MP_OBJ_FROM_PTR(o);
+}
+MP_DEFINE_CONST_FUN_OBJ_KW(mp_builtin_open_obj, 1, mp_builtin_open);
@@ -0,0 +1,133 @@
+/*
+ * This file is part of the MicroPython project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// GC pause and allocation counters. gc_alloc() is wrapped at link time
+// (--wrap=gc_alloc, see CMakeLists.txt) to count the bytes allocated and
+// to record where large allocations and those which made the heap
+// collect come from.
+
+#include <string.h>
+#include <zephyr.h>
+
+#include "py/runtime.h"
+#include "py/gc.h"
+#include "zephyr_gc.h"
+#ifdef CONFIG_DEGU_GC_TRACE
+#include "zephyr_prof.h"
+#endif
+
+#ifdef CONFIG_DEGU_GC_STATS
+
+struct mp_zephyr_gc_stats mp_zephyr_gc_stats;
+
+#ifdef CONFIG_DEGU_GC_TRACE
+STATIC struct {
+    struct mp_zephyr_gc_trace ring[CONFIG_DEGU_GC_TRACE_SIZE];
+    size_t n; // recorded since the start, the ring keeps the last ones
+    size_t threshold;
+    bool active;
+} trace;
+
+STATIC void trace_record(size_t n_bytes, uint32_t pause_us) {
+    struct mp_zephyr_gc_trace *rec = &trace.ring[trace.n++ % CONFIG_DEGU_GC_TRACE_SIZE];
+
+    // the thread allocating holds the GIL
+    rec->fun = mp_zephyr_prof_cur->fun;
+    rec->ip = mp_zephyr_prof_cur->ip;
+    rec->size = n_bytes;
+    rec->pause_us = pause_us;
+}
+
+void mp_zephyr_gc_trace_start(size_t threshold) {
+    trace.n = 0;
+    trace.threshold = threshold;
+    trace.active = true;
+}
+
+size_t mp_zephyr_gc_trace_stop(void) {
+    trace.active = false;
+    return MIN(trace.n, CONFIG_DEGU_GC_TRACE_SIZE);
+}
+
+const struct mp_zephyr_gc_trace *mp_zephyr_gc_trace_at(size_t i) {
+    if (trace.n > CONFIG_DEGU_GC_TRACE_SIZE) {
+        i += trace.n - CONFIG_DEGU_GC_TRACE_SIZE;
+    }
+    return &trace.ring[i % CONFIG_DEGU_GC_TRACE_SIZE];
+}
+#endif // CONFIG_DEGU_GC_TRACE
+
+void *__real_gc_alloc(size_t n_bytes, bool has_finaliser);
+
+void *__wrap_gc_alloc(size_t n_bytes, bool has_finaliser) {
+    uint32_t collections = mp_zephyr_gc_stats.collections;
+    void *ptr = __real_gc_alloc(n_bytes, has_finaliser);
+
+    // a failed allocation is left to the MemoryError it raises
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    // reset by a collection made for this allocation
+    mp_zephyr_gc_stats.since_gc += n_bytes;
+
+    #ifdef CONFIG_DEGU_GC_TRACE
+    if (trace.active) {
+        if (mp_zephyr_gc_stats.collections != collections) {
+            trace_record(n_bytes, mp_zephyr_gc_stats.last_us);
+        } else if (n_bytes >= trace.threshold) {
+            trace_record(n_bytes, 0);
+        }
+    }
+    #else
+    (void)collections;
+    #endif
+
+    return ptr;
+}
+
+// Called by gc_collect() with the cycles it took
+void mp_zephyr_gc_collected(uint32_t cycles) {
+    uint32_t us = (uint32_t)(SYS_CLOCK_HW_CYCLES_TO_NS64(cycles) / 1000);
+
+    mp_zephyr_gc_stats.collections++;
+    mp_zephyr_gc_stats.last_us = us;
+    if (us > mp_zephyr_gc_stats.max_us) {
+        mp_zephyr_gc_stats.max_us = us;
+    }
+    mp_zephyr_gc_stats.since_gc = 0;
+}
+
+// A new heap: the counts and the records of the previous one are dropped
+void mp_zephyr_gc_init(void) {
+    memset(&mp_zephyr_gc_stats, 0, sizeof(mp_zephyr_gc_stats));
+    #ifdef CONFIG_DEGU_GC_TRACE
+    trace.n = 0;
+    trace.active = false;
+    #endif
+}
+
+#endif // CONFIG_DEGU_GC_STATS
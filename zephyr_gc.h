@@ -0,0 +1,58 @@
+/*
+ * This file is part of the MicroPython project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef MICROPY_INCLUDED_ZEPHYR_GC_H
+#define MICROPY_INCLUDED_ZEPHYR_GC_H
+
+#include <zephyr.h>
+
+// Collections and the allocations between them, see zephyr.gc_stats()
+struct mp_zephyr_gc_stats {
+    uint32_t collections;
+    uint32_t last_us;   // pause of the last collection
+    uint32_t max_us;
+    size_t since_gc;    // bytes allocated since the last collection
+};
+
+extern struct mp_zephyr_gc_stats mp_zephyr_gc_stats;
+
+// An allocation of at least the trace threshold, or one which made the
+// heap collect, see zephyr.gc_trace_start()
+struct mp_zephyr_gc_trace {
+    const void *fun;    // mp_obj_fun_bc_t running, as noted for profiling
+    const void *ip;     // its last jump or branch, not the allocating opcode
+    uint32_t size;
+    uint32_t pause_us;  // of the collection it caused, or 0
+};
+
+void mp_zephyr_gc_init(void);
+void mp_zephyr_gc_collected(uint32_t cycles);
+void mp_zephyr_gc_trace_start(size_t threshold);
+// Stop tracing, return how many records are kept
+size_t mp_zephyr_gc_trace_stop(void);
+// The i-th oldest record
+const struct mp_zephyr_gc_trace *mp_zephyr_gc_trace_at(size_t i);
+
+#endif // MICROPY_INCLUDED_ZEPHYR_GC_H
@@ -0,0 +1,49 @@
+/*
+ * This file is part of the MicroPython project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef MICROPY_INCLUDED_ZEPHYR_POLL_H
+#define MICROPY_INCLUDED_ZEPHYR_POLL_H
+
+#include <zephyr.h>
+
+// Streams which can be waited for with k_poll answer this ioctl, with a
+// struct mp_zephyr_kpoll as argument. They add the events that signal
+// they may have become ready and return how many, or MP_STREAM_ERROR if
+// they can't be waited for, in which case uselect polls them periodically.
+#define MP_STREAM_KPOLL (0x100)
+
+struct mp_zephyr_kpoll {
+    struct k_poll_event *ev;
+    size_t max;
+    unsigned int events; // MP_STREAM_POLL_RD and/or MP_STREAM_POLL_WR
+};
+
+// The wake signal of the calling Python thread, raised with all the
+// others from interrupts, other threads and Ctrl-C to end the waits in
+// uselect, see moduselect.c
+struct k_poll_signal *mp_zephyr_wake_signal(void);
+void mp_zephyr_wake_up(void);
+
+#endif // MICROPY_INCLUDED_ZEPHYR_POLL_H
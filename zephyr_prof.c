@@ -0,0 +1,266 @@
+/*
+ * This file is part of the MicroPython project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Sampling profiler. The VM notes the function and bytecode it runs on
+// function entry and return and at jumps and branches (MICROPY_VM_HOOK_*
+// in mpconfigport.h); a k_timer copies that into a fixed buffer, which
+// is only decoded into lines by profile_dump().
+
+#include <string.h>
+#include <zephyr.h>
+
+#include "py/runtime.h"
+#include "py/bc.h"
+#include "py/gc.h"
+#include "py/objfun.h"
+#include "zephyr_prof.h"
+
+#ifdef CONFIG_DEGU_PROFILE
+
+volatile struct mp_zephyr_prof_vm mp_zephyr_prof_vm[MP_ZEPHYR_PROF_THREADS];
+volatile struct mp_zephyr_prof_vm *mp_zephyr_prof_cur = &mp_zephyr_prof_vm[0];
+
+STATIC void prof_expiry(struct k_timer *timer);
+STATIC K_TIMER_DEFINE(prof_timer, prof_expiry, NULL);
+
+STATIC struct {
+    struct mp_zephyr_prof_sample buf[CONFIG_DEGU_PROFILE_SAMPLES];
+    struct mp_zephyr_prof_counts counts;
+    unsigned int last_ops[MP_ZEPHYR_PROF_THREADS];
+    #if !MICROPY_PY_THREAD
+    k_tid_t vm_thread;
+    #endif
+} prof;
+
+STATIC bool prof_in_python(k_tid_t tid) {
+    #if MICROPY_PY_THREAD
+    // only threads running the VM have a state, see mpthreadport.c
+    (void)tid;
+    return k_thread_custom_data_get() != NULL;
+    #else
+    return tid == prof.vm_thread;
+    #endif
+}
+
+STATIC size_t prof_index(void) {
+    #if MICROPY_PY_THREAD
+    return mp_thread_index();
+    #else
+    return 0;
+    #endif
+}
+
+STATIC void prof_expiry(struct k_timer *timer) {
+    k_tid_t tid = k_current_get();
+
+    if (!prof_in_python(tid)) {
+        if (k_thread_priority_get(tid) == K_IDLE_PRIO) {
+            prof.counts.idle++;
+        } else {
+            prof.counts.other++;
+        }
+        return;
+    }
+    if (prof.counts.n_samples == CONFIG_DEGU_PROFILE_SAMPLES) {
+        prof.counts.dropped++;
+        return;
+    }
+
+    // the thread interrupted, which may be in C without the GIL while
+    // another one runs Python
+    size_t i = prof_index();
+    volatile struct mp_zephyr_prof_vm *vm = &mp_zephyr_prof_vm[i];
+    struct mp_zephyr_prof_sample *s = &prof.buf[prof.counts.n_samples++];
+    s->fun = (uintptr_t)vm->fun;
+    s->ip = vm->ip;
+    if (vm->ops == prof.last_ops[i]) {
+        s->fun |= 1;
+    }
+    prof.last_ops[i] = vm->ops;
+}
+
+// HOOK_INIT runs when a function starts, but also when it catches an
+// exception and when a generator is resumed. The frames are told apart
+// by their code_state: one found on the stack is running already, and
+// the frames above it ended by an exception.
+void mp_zephyr_prof_enter(const void *code_state, const void *fun, const void *ip) {
+    volatile struct mp_zephyr_prof_vm *vm = mp_zephyr_prof_cur;
+    size_t i = vm->depth;
+
+    while (i > 0 && vm->frames[i - 1].code_state != code_state) {
+        i--;
+    }
+    if (i > 0) {
+        vm->depth = i;
+    } else {
+        if (vm->depth == MP_ZEPHYR_PROF_FRAMES) {
+            // the outermost caller is forgotten, see mp_zephyr_prof_return()
+            for (i = 1; i < MP_ZEPHYR_PROF_FRAMES; i++) {
+                vm->frames[i - 1].code_state = vm->frames[i].code_state;
+                vm->frames[i - 1].fun = vm->frames[i].fun;
+                vm->frames[i - 1].ip = vm->frames[i].ip;
+            }
+            vm->depth--;
+        }
+        i = vm->depth++;
+        vm->frames[i].code_state = code_state;
+        vm->frames[i].fun = vm->fun;
+        vm->frames[i].ip = vm->ip;
+    }
+    vm->fun = fun;
+    vm->ip = ip;
+    vm->ops++;
+}
+
+void mp_zephyr_prof_return(const void *code_state) {
+    volatile struct mp_zephyr_prof_vm *vm = mp_zephyr_prof_cur;
+    size_t i = vm->depth;
+
+    while (i > 0 && vm->frames[i - 1].code_state != code_state) {
+        i--;
+    }
+    if (i > 0) {
+        vm->depth = i - 1;
+        vm->fun = vm->frames[i - 1].fun;
+        vm->ip = vm->frames[i - 1].ip;
+    } else {
+        // unknown until the caller next branches
+        vm->fun = NULL;
+        vm->ip = NULL;
+    }
+    vm->ops++;
+}
+
+#if MICROPY_PY_THREAD
+void mp_zephyr_prof_switch(size_t index) {
+    mp_zephyr_prof_cur = &mp_zephyr_prof_vm[index];
+}
+
+// A new thread starts with no callers
+void mp_zephyr_prof_clear(size_t index) {
+    volatile struct mp_zephyr_prof_vm *vm = &mp_zephyr_prof_vm[index];
+
+    vm->fun = NULL;
+    vm->ip = NULL;
+    vm->depth = 0;
+}
+#endif
+
+void mp_zephyr_prof_start(s32_t period_ms) {
+    k_timer_stop(&prof_timer);
+    memset(&prof.counts, 0, sizeof(prof.counts));
+    for (size_t i = 0; i < MP_ZEPHYR_PROF_THREADS; i++) {
+        prof.last_ops[i] = mp_zephyr_prof_vm[i].ops;
+    }
+    #if !MICROPY_PY_THREAD
+    prof.vm_thread = k_current_get();
+    #endif
+    k_timer_start(&prof_timer, period_ms, period_ms);
+}
+
+void mp_zephyr_prof_stop(void) {
+    k_timer_stop(&prof_timer);
+}
+
+// The samples and positions point into the heap, drop them when the VM
+// stops
+void mp_zephyr_prof_deinit(void) {
+    k_timer_stop(&prof_timer);
+    memset(&prof.counts, 0, sizeof(prof.counts));
+    for (size_t i = 0; i < MP_ZEPHYR_PROF_THREADS; i++) {
+        mp_zephyr_prof_vm[i].fun = NULL;
+        mp_zephyr_prof_vm[i].ip = NULL;
+        mp_zephyr_prof_vm[i].depth = 0;
+    }
+    mp_zephyr_prof_cur = &mp_zephyr_prof_vm[0];
+}
+
+const struct mp_zephyr_prof_sample *mp_zephyr_prof_samples(struct mp_zephyr_prof_counts *counts) {
+    *counts = prof.counts;
+    return prof.buf;
+}
+
+// The line is found as the VM does for a traceback
+bool mp_zephyr_prof_locate(const struct mp_zephyr_prof_sample *s, size_t *file, size_t *block, size_t *line) {
+    const mp_obj_fun_bc_t *fun = (const mp_obj_fun_bc_t *)(s->fun & ~1);
+
+    // the function may have been collected since it was sampled
+    if (fun == NULL || gc_nbytes(fun) == 0 || fun->base.type != &mp_type_fun_bc) {
+        return false;
+    }
+
+    const byte *ip = fun->bytecode;
+    ip = mp_decode_uint_skip(ip); // n_state
+    ip = mp_decode_uint_skip(ip); // n_exc_stack
+    ip += 4; // scope_flags, n_pos_args, n_kwonly_args, n_def_pos_args
+    if ((const byte *)s->ip < ip) {
+        return false;
+    }
+    size_t bc = (const byte *)s->ip - ip;
+    size_t code_info_size = mp_decode_uint_value(ip);
+    ip = mp_decode_uint_skip(ip);
+    if (bc < code_info_size) {
+        // fun and ip were not noted together
+        return false;
+    }
+    bc -= code_info_size;
+    #if MICROPY_PERSISTENT_CODE
+    *block = ip[0] | (ip[1] << 8);
+    *file = ip[2] | (ip[3] << 8);
+    ip += 4;
+    #else
+    *block = mp_decode_uint_value(ip);
+    ip = mp_decode_uint_skip(ip);
+    *file = mp_decode_uint_value(ip);
+    ip = mp_decode_uint_skip(ip);
+    #endif
+
+    *line = 1;
+    size_t c;
+    while ((c = *ip)) {
+        size_t b, l;
+        if ((c & 0x80) == 0) {
+            // 0b0LLBBBBB
+            b = c & 0x1f;
+            l = c >> 5;
+            ip += 1;
+        } else {
+            // 0b1LLLBBBB 0bLLLLLLLL
+            b = c & 0xf;
+            l = ((c << 4) & 0x700) | ip[1];
+            ip += 2;
+        }
+        if (bc >= b) {
+            bc -= b;
+            *line += l;
+        } else {
+            break;
+        }
+    }
+    return true;
+}
+
+#endif // CONFIG_DEGU_PROFILE
@@ -0,0 +1,97 @@
+/*
+ * This file is part of the MicroPython project, http://micropython.org/
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2019 Atmark Techno, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef MICROPY_INCLUDED_ZEPHYR_PROF_H
+#define MICROPY_INCLUDED_ZEPHYR_PROF_H
+
+#include <zephyr.h>
+
+// Where the VM is, read by the sampling timer. Written by the VM hooks
+// when a function is entered or returns and at jumps and branches, not
+// before every opcode: a sample names the function running and the last
+// of those points, so lines of straight-line code are merged. Generators
+// which yield and exceptions caught in C leave the position in the callee
+// until the caller next branches.
+//
+// Each thread running Python has its own, as the VM keeps no room for
+// the port in mp_state_thread_t: the hooks write the one of the thread
+// holding the GIL, the timer reads the one of the thread it interrupted.
+#define MP_ZEPHYR_PROF_FRAMES (16)
+
+struct mp_zephyr_prof_vm {
+    const void *fun; // mp_obj_fun_bc_t
+    const void *ip;
+    unsigned int ops;
+    // callers' positions of the frames running, see mp_zephyr_prof_enter()
+    size_t depth;
+    struct {
+        const void *code_state;
+        const void *fun;
+        const void *ip;
+    } frames[MP_ZEPHYR_PROF_FRAMES];
+};
+
+#ifdef CONFIG_DEGU_MPY_THREAD
+#define MP_ZEPHYR_PROF_THREADS (CONFIG_DEGU_MPY_THREAD_COUNT + 1)
+#else
+#define MP_ZEPHYR_PROF_THREADS (1)
+#endif
+
+// indexed by mp_thread_index()
+extern volatile struct mp_zephyr_prof_vm mp_zephyr_prof_vm[MP_ZEPHYR_PROF_THREADS];
+// the one of the thread holding the GIL
+extern volatile struct mp_zephyr_prof_vm *mp_zephyr_prof_cur;
+
+void mp_zephyr_prof_enter(const void *code_state, const void *fun, const void *ip);
+void mp_zephyr_prof_return(const void *code_state);
+#ifdef CONFIG_DEGU_MPY_THREAD
+// called by mpthreadport.c when a thread takes the GIL or is created
+void mp_zephyr_prof_switch(size_t index);
+void mp_zephyr_prof_clear(size_t index);
+#endif
+
+// A sample of Python code; bit 0 of fun is set when the VM had not
+// moved since the previous sample, i.e. it was in a C function
+struct mp_zephyr_prof_sample {
+    uintptr_t fun;
+    const void *ip;
+};
+
+struct mp_zephyr_prof_counts {
+    size_t n_samples;   // in the buffer
+    unsigned int dropped; // Python samples after the buffer was full
+    unsigned int idle;
+    unsigned int other; // other threads: network, OTA...
+};
+
+void mp_zephyr_prof_start(s32_t period_ms);
+void mp_zephyr_prof_stop(void);
+void mp_zephyr_prof_deinit(void);
+const struct mp_zephyr_prof_sample *mp_zephyr_prof_samples(struct mp_zephyr_prof_counts *counts);
+// qstrs of the source file and function, and the line of a sample;
+// false if its function has been collected
+bool mp_zephyr_prof_locate(const struct mp_zephyr_prof_sample *s, size_t *file, size_t *block, size_t *line);
+
+#endif // MICROPY_INCLUDED_ZEPHYR_PROF_H